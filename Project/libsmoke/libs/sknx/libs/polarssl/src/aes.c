@@ -42,7 +42,7 @@
 #include "polarssl/padlock.h"
 #endif
 #if defined(POLARSSL_AESNI_C)
-#include "polarssl/aesni.h"
+#include "polarssl/include/polarssl/aesni.h"
 #endif
 
 #if defined(POLARSSL_PLATFORM_C)
@@ -36,7 +36,7 @@
 
 #if defined(POLARSSL_AESNI_C)
 
-#include "polarssl/aesni.h"
+#include "polarssl/include/polarssl/aesni.h"
 #include <stdio.h>
 
 #if defined(POLARSSL_HAVE_X86_64)
@@ -21,6 +21,8 @@ class Backend {
         virtual void shutdown() = 0;
         virtual bool must_update() const = 0;
         virtual bool update() = 0;
+        /** Sends the telegrams buffered by broadcast(), if any */
+        virtual bool flush() { return true; }
         bool isReady() const { return _ready; }
     protected:
         bool _ready;
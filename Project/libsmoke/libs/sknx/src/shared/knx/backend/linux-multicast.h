@@ -0,0 +1,259 @@
+#ifndef BACKEND_LINUX_MULTICAST_HH
+#define BACKEND_LINUX_MULTICAST_HH
+
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <vector>
+#include <queue>
+
+using std::vector;
+using std::queue;
+
+#include "backend.h"
+
+/* Group and port of KNXnet/IP routing */
+#define MCAST_DEFAULT_GROUP "224.0.23.12"
+#define MCAST_DEFAULT_PORT 3671
+
+/* Max #datagrams moved by a single sendmmsg()/recvmmsg() */
+#define MCAST_BATCH 64
+#define MCAST_TTL 1
+
+namespace KNX {
+
+/**
+ * Every telegram is a datagram sent to an IP multicast group, so the network
+ * (or the kernel on loopback, with IP_MULTICAST_LOOP) copies it to all the
+ * members: no server is needed in the data path.
+ * Like on a KNX bus our own telegrams come back, they are dropped by src.
+ */
+template<uint16_t PORT>
+class LinuxMulticast : public Backend {
+public:
+    /**
+     * @param addr - IP of the multicast group.
+     * @param iface - IP of the interface joining the group, NULL for the
+     *                default one. Use "127.0.0.1" to test on loopback.
+     */
+    LinuxMulticast(const char *addr = MCAST_DEFAULT_GROUP,
+                   const char *iface = NULL) : Backend(), _socket(-1) {
+        memset(&_group, 0, sizeof(_group));
+        _group.sin_family = AF_INET;
+        _group.sin_port = htons(PORT);
+        _group.sin_addr.s_addr = inet_addr(addr);
+        _iface.s_addr = iface ? inet_addr(iface) : htonl(INADDR_ANY);
+
+        for(size_t i = 0; i < MCAST_BATCH; i++) {
+            _rxiov[i].iov_base = _rxbuf[i];
+            _rxiov[i].iov_len = sizeof(_rxbuf[i]);
+        }
+    }
+
+    bool init() {
+        if(_ready)
+            return false;
+
+        if(!IN_MULTICAST(ntohl(_group.sin_addr.s_addr))) {
+            LOG("Not a multicast group.");
+            return false;
+        }
+
+        if((_socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC,
+                             IPPROTO_UDP)) == -1)
+            return false;
+
+        /* All the members on this host share the port */
+        int one = 1;
+        setsockopt(_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        struct sockaddr_in local;
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_port = _group.sin_port;
+        local.sin_addr.s_addr = htonl(INADDR_ANY);
+
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr = _group.sin_addr;
+        mreq.imr_interface = _iface;
+
+        unsigned char ttl = MCAST_TTL, loop = 1;
+        if(bind(_socket, (struct sockaddr *)&local, sizeof(local)) != 0 ||
+           setsockopt(_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                      &mreq, sizeof(mreq)) != 0 ||
+           setsockopt(_socket, IPPROTO_IP, IP_MULTICAST_IF,
+                      &_iface, sizeof(_iface)) != 0 ||
+           setsockopt(_socket, IPPROTO_IP, IP_MULTICAST_TTL,
+                      &ttl, sizeof(ttl)) != 0 ||
+           setsockopt(_socket, IPPROTO_IP, IP_MULTICAST_LOOP,
+                      &loop, sizeof(loop)) != 0) {
+            LOG("Cannot join the multicast group.");
+            close(_socket);
+            _socket = -1;
+            return false;
+        }
+
+        _ready = true;
+        return true;
+    }
+
+    /** Telegrams are buffered and sent all together by flush() */
+    bool broadcast(const telegram &data) {
+        if(!_ready)
+            return false;
+
+        _outbuf.push_back(data);
+        return true;
+    }
+
+    /** One datagram per telegram, up to MCAST_BATCH per sendmmsg() */
+    bool flush() {
+        if(!_ready)
+            return false;
+
+        struct mmsghdr msgs[MCAST_BATCH];
+        struct iovec iov[MCAST_BATCH];
+        size_t off = 0;
+        while(off < _outbuf.size()) {
+            size_t cnt = _outbuf.size() - off;
+            if(cnt > MCAST_BATCH)
+                cnt = MCAST_BATCH;
+
+            memset(msgs, 0, sizeof(msgs[0]) * cnt);
+            for(size_t i = 0; i < cnt; i++) {
+                const telegram &t = _outbuf[off + i];
+                iov[i].iov_base = (void *)t.raw();
+                iov[i].iov_len = t.size();
+                msgs[i].msg_hdr.msg_name = &_group;
+                msgs[i].msg_hdr.msg_namelen = sizeof(_group);
+                msgs[i].msg_hdr.msg_iov = &iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            int n = sendmmsg(_socket, msgs, (unsigned)cnt, 0);
+            if(n <= 0) {
+                LOG("Send failed.");
+                _outbuf.clear();
+                return false;
+            }
+            off += (size_t)n;
+        }
+
+        _outbuf.clear();
+        return true;
+    }
+
+    bool read(telegram &data) {
+        if(!_ready || _pkts.size() == 0)
+            return false;
+        data = _pkts.front();
+
+        _pkts.pop();
+        return true;
+    }
+
+    void pop() {
+        if(_pkts.size() > 0)
+            _pkts.pop();
+    }
+
+    size_t count() const {
+        return _pkts.size();
+    }
+
+    void shutdown() {
+        if(_ready) flush();
+        if(_ready) _ready = false;
+        if(_socket >= 0) {
+            struct ip_mreq mreq;
+            mreq.imr_multiaddr = _group.sin_addr;
+            mreq.imr_interface = _iface;
+            setsockopt(_socket, IPPROTO_IP, IP_DROP_MEMBERSHIP,
+                       &mreq, sizeof(mreq));
+            close(_socket);
+            _socket = -1;
+        }
+    }
+
+    bool must_update() const {
+        return false;
+    }
+
+    /** Waits up to 10ms, then drains the socket MCAST_BATCH datagrams at once */
+    bool update() {
+        if(!_ready) return false;
+
+        struct pollfd pfd;
+        pfd.fd = _socket;
+        pfd.events = POLLIN;
+
+        NETBENCHMARK_START(mcast_waiting);
+        int n = poll(&pfd, 1, 10);
+        if(n < 0) {
+            NETBENCHMARK_STOP(mcast_waiting);
+            LOG("Poll returned -1.\n");
+            return false;
+        }
+        NETBENCHMARK_STOP(mcast_waiting);
+
+        NETBENCHMARK_START(mcast_read);
+        while(n > 0) {
+            struct mmsghdr msgs[MCAST_BATCH];
+            memset(msgs, 0, sizeof(msgs));
+            for(size_t i = 0; i < MCAST_BATCH; i++) {
+                msgs[i].msg_hdr.msg_iov = &_rxiov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            int m = recvmmsg(_socket, msgs, MCAST_BATCH, MSG_DONTWAIT, NULL);
+            if(m < 0) {
+                NETBENCHMARK_STOP(mcast_read);
+                if(errno == EAGAIN || errno == EWOULDBLOCK)
+                    return true;
+                LOG("Recvmmsg returned -1.");
+                return false;
+            }
+
+            for(int i = 0; i < m; i++) {
+                if(msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+                    continue;
+                _process_packet(_rxbuf[i], msgs[i].msg_len);
+            }
+
+            /* A full batch: there may be more */
+            n = (m == MCAST_BATCH);
+        }
+        NETBENCHMARK_STOP(mcast_read);
+
+        return true;
+    }
+private:
+
+    /** Datagram -> KNX Telegram, ours and the malformed ones are dropped */
+    void _process_packet(const uint8_t *buf, size_t len) {
+        if(len < tg_size::hdr + 1 || telegram::rawSize(buf) != len ||
+           !telegram::rawCheck(buf))
+            return;
+
+        telegram pkt;
+        memcpy(&pkt[0], buf, len);
+        if(pkt.src() != sKConfig.id())
+            _pkts.push(pkt);
+    }
+
+    queue<telegram> _pkts;
+    vector<telegram> _outbuf;
+    int _socket;
+    struct sockaddr_in _group;
+    struct in_addr _iface;
+    uint8_t _rxbuf[MCAST_BATCH][tg_size::max];
+    struct iovec _rxiov[MCAST_BATCH];
+
+    TAG_DEF("LinuxMulticast")
+};
+
+} // namespace KNX
+#endif /* ifndef BACKEND_LINUX_MULTICAST_HH */
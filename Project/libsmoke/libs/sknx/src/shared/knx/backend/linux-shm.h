@@ -0,0 +1,318 @@
+#ifndef BACKEND_LINUX_SHM_HH
+#define BACKEND_LINUX_SHM_HH
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
+#include <queue>
+
+using std::queue;
+
+#include "backend.h"
+
+#define SHM_DEFAULT_NAME "knx"
+#define SHM_NAME_MAX 64
+
+/* #Telegrams kept by the ring, a power of 2. Readers lapped by the writers
+ * lose the overwritten ones, like a slow node on a bus. */
+#define SHM_SLOTS 4096
+#define SHM_MAGIC 0x534b4e58u
+/* Ring::nodes of a ring being removed by its last node */
+#define SHM_REMOVED UINT32_MAX
+
+namespace KNX {
+
+/**
+ * Broadcast ring in /dev/shm shared by the nodes of a host: writers claim a
+ * slot with an atomic ticket and publish it with a seqlock, every reader
+ * keeps its own cursor. A reader sleeps on a futex only when the ring is
+ * empty, and writers wake it only if somebody sleeps, so telegrams flow
+ * with no syscalls while there is traffic.
+ * Like on a KNX bus our own telegrams come back, they are dropped by src.
+ * The ring counts its nodes, and the last one to shutdown() removes it from
+ * /dev/shm. The ring of nodes that died without a shutdown() stays there
+ * until unlink() is called.
+ */
+template<uint16_t PORT>
+class LinuxShm : public Backend {
+public:
+    /**
+     * @param name - name of the ring, shared by all its nodes.
+     * @param group - optional group, nodes of different groups use
+     *                different rings.
+     */
+    LinuxShm(const char *name = SHM_DEFAULT_NAME, const char *group = NULL) :
+        Backend(), _ring(NULL), _cursor(0), _lost(0) {
+        if(group)
+            snprintf(_name, sizeof(_name), "/smoke.%s.%u.%s", name,
+                     (unsigned)PORT, group);
+        else
+            snprintf(_name, sizeof(_name), "/smoke.%s.%u", name,
+                     (unsigned)PORT);
+    }
+
+    ~LinuxShm() {
+        shutdown();
+    }
+
+    bool init() {
+        if(_ready)
+            return false;
+
+        /* A ring removed by its last node is replaced by a new one */
+        for(int i = 0; ; i++) {
+            if(!_map())
+                return false;
+            if(_attach())
+                break;
+
+            munmap(_ring, sizeof(Ring));
+            _ring = NULL;
+            if(i == 1000) {
+                LOG("Shared memory ring still being removed.");
+                return false;
+            }
+            usleep(1000);
+        }
+
+        /* Only the telegrams written from now on */
+        _cursor = _ring->head.load(std::memory_order_acquire);
+        _ready = true;
+        return true;
+    }
+
+    /** The telegram is published right away, no need to flush() */
+    bool broadcast(const telegram &data) {
+        if(!_ready)
+            return false;
+
+        uint64_t t = _ring->head.fetch_add(1, std::memory_order_acq_rel);
+        Slot &s = _ring->slots[t & (SHM_SLOTS - 1)];
+
+        /* Odd while written, readers of the previous lap see it's gone */
+        s.seq.store(2 * t + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(s.raw, data.raw(), data.size());
+        s.seq.store(2 * t + 2, std::memory_order_release);
+
+        _ring->futex.fetch_add(1, std::memory_order_release);
+        if(_ring->sleepers.load(std::memory_order_seq_cst) > 0)
+            _futex(FUTEX_WAKE, INT32_MAX, NULL);
+        return true;
+    }
+
+    bool read(telegram &data) {
+        if(!_ready || _pkts.size() == 0)
+            return false;
+        data = _pkts.front();
+
+        _pkts.pop();
+        return true;
+    }
+
+    void pop() {
+        if(_pkts.size() > 0)
+            _pkts.pop();
+    }
+
+    size_t count() const {
+        return _pkts.size();
+    }
+
+    void shutdown() {
+        if(_ready) _ready = false;
+        if(_ring) {
+            if(_detach())
+                shm_unlink(_name);
+            munmap(_ring, sizeof(Ring));
+            _ring = NULL;
+        }
+    }
+
+    bool must_update() const {
+        return false;
+    }
+
+    /** Reads the new telegrams, waiting up to 10ms if there's none */
+    bool update() {
+        if(!_ready) return false;
+
+        NETBENCHMARK_START(shm_read);
+        if(_drain()) {
+            NETBENCHMARK_STOP(shm_read);
+            return true;
+        }
+        NETBENCHMARK_STOP(shm_read);
+
+        NETBENCHMARK_START(shm_waiting);
+        uint32_t seen = _ring->futex.load(std::memory_order_acquire);
+        _ring->sleepers.fetch_add(1, std::memory_order_seq_cst);
+        /* A writer may have missed us before we were counted */
+        if(_ring->head.load(std::memory_order_seq_cst) == _cursor) {
+            struct timespec ts;
+            ts.tv_sec = 0;
+            ts.tv_nsec = 10000000;
+            _futex(FUTEX_WAIT, seen, &ts);
+        }
+        _ring->sleepers.fetch_sub(1, std::memory_order_relaxed);
+        NETBENCHMARK_STOP(shm_waiting);
+
+        _drain();
+        return true;
+    }
+
+    /** #Telegrams overwritten before we could read them */
+    uint64_t lost() const { return _lost; }
+
+    /**
+     * Removes the ring from /dev/shm, the nodes using it keep it until
+     * their shutdown(). Needed only for the rings of the nodes that died
+     * without a shutdown().
+     */
+    static bool unlink(const char *name = SHM_DEFAULT_NAME,
+                       const char *group = NULL) {
+        LinuxShm<PORT> shm(name, group);
+        return shm_unlink(shm._name) == 0;
+    }
+private:
+
+    struct Slot {
+        /* 2 * (ticket + 1) when published, odd while written */
+        std::atomic<uint64_t> seq;
+        uint8_t raw[tg_size::max];
+    } __attribute__((aligned(32)));
+
+    struct Ring {
+        std::atomic<uint32_t> magic;
+        /* Bumped by every publish, readers sleep on it */
+        std::atomic<uint32_t> futex;
+        std::atomic<uint32_t> sleepers;
+        /* Nodes attached, SHM_REMOVED once the last one is gone */
+        std::atomic<uint32_t> nodes;
+        uint8_t pad0[48];
+        /* Next ticket */
+        std::atomic<uint64_t> head;
+        uint8_t pad1[56];
+        Slot slots[SHM_SLOTS];
+    };
+
+    /** Ring -> queue of telegrams, ours and the invalid ones are dropped */
+    bool _drain() {
+        bool found = false;
+        for(;;) {
+            Slot &s = _ring->slots[_cursor & (SHM_SLOTS - 1)];
+            uint64_t want = 2 * _cursor + 2;
+            uint64_t seq = s.seq.load(std::memory_order_acquire);
+            if(seq < want - 1)
+                break;  // Not written yet
+
+            telegram pkt;
+            if(seq == want) {
+                memcpy(&pkt[0], s.raw, tg_size::max);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if(s.seq.load(std::memory_order_relaxed) == want) {
+                    _cursor++;
+                    if(pkt.check() && pkt.src() != sKConfig.id())
+                        _pkts.push(pkt);
+                    found = true;
+                    continue;
+                }
+                seq = s.seq.load(std::memory_order_relaxed);
+            }
+
+            if(seq == want - 1)
+                break;  // Still written
+
+            /* Lapped: skip to the oldest telegram still in the ring */
+            uint64_t head = _ring->head.load(std::memory_order_acquire);
+            uint64_t oldest = head > SHM_SLOTS ? head - SHM_SLOTS + 1 : 0;
+            if(oldest <= _cursor)
+                oldest = _cursor + 1;
+            _lost += oldest - _cursor;
+            _cursor = oldest;
+        }
+        return found;
+    }
+
+    /** Maps the ring, creating it if there's none */
+    bool _map() {
+        int fd = shm_open(_name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if(fd == -1) {
+            LOG("Cannot open the shared memory.");
+            return false;
+        }
+
+        /* The size is fixed, so every node can set it: it's zero-filled */
+        if(ftruncate(fd, sizeof(Ring)) != 0) {
+            close(fd);
+            return false;
+        }
+
+        void *mem = mmap(NULL, sizeof(Ring), PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+        close(fd);
+        if(mem == MAP_FAILED)
+            return false;
+
+        _ring = (Ring *)mem;
+        uint32_t magic = 0;
+        if(_ring->magic.compare_exchange_strong(magic, SHM_MAGIC - 1))
+            _ring->magic.store(SHM_MAGIC, std::memory_order_release);
+
+        /* Somebody else is creating it */
+        for(int i = 0; _ring->magic.load(std::memory_order_acquire) !=
+                       SHM_MAGIC; i++) {
+            if(i == 1000) {
+                LOG("Invalid shared memory ring.");
+                munmap(_ring, sizeof(Ring));
+                _ring = NULL;
+                return false;
+            }
+            usleep(1000);
+        }
+        return true;
+    }
+
+    /** Counts this node, FALSE if the ring is being removed */
+    bool _attach() {
+        uint32_t n = _ring->nodes.load(std::memory_order_acquire);
+        do {
+            if(n == SHM_REMOVED)
+                return false;
+        } while(!_ring->nodes.compare_exchange_weak(n, n + 1,
+                                                    std::memory_order_acq_rel));
+        return true;
+    }
+
+    /** Uncounts this node, TRUE if it was the last one */
+    bool _detach() {
+        uint32_t n = _ring->nodes.load(std::memory_order_acquire);
+        for(;;) {
+            uint32_t next = n > 1 ? n - 1 : SHM_REMOVED;
+            if(_ring->nodes.compare_exchange_weak(n, next,
+                                                  std::memory_order_acq_rel))
+                return next == SHM_REMOVED;
+        }
+    }
+
+    long _futex(int op, uint32_t val, const struct timespec *ts) {
+        return syscall(SYS_futex, &_ring->futex, op, val, ts, NULL, 0);
+    }
+
+    queue<telegram> _pkts;
+    Ring *_ring;
+    uint64_t _cursor;
+    uint64_t _lost;
+    char _name[SHM_NAME_MAX];
+
+    TAG_DEF("LinuxShm")
+};
+
+} // namespace KNX
+#endif /* ifndef BACKEND_LINUX_SHM_HH */
@@ -0,0 +1,342 @@
+#ifndef BACKEND_LINUX_STREAM_HH
+#define BACKEND_LINUX_STREAM_HH
+
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <vector>
+#include <queue>
+
+using std::vector;
+using std::queue;
+
+#include "backend.h"
+#include <knx/capture.h>
+#include <knx/ringbuffer.h>
+
+/* Preamble sent right after connecting to join a group of ServerSmoke:
+ * TCP_JOIN_MAGIC, name length, name. The magic is not a valid ctrl byte,
+ * so it can't be confused with a telegram. */
+#define TCP_JOIN_MAGIC 0x47
+#define TCP_GROUP_NAME_MAX 16
+
+/* Keepalive of ServerSmoke: a silent node gets a TCP_KEEPALIVE_PING between
+ * two telegrams and answers with a TCP_KEEPALIVE_PONG, or it's considered
+ * dead. Neither is a valid ctrl byte. */
+#define TCP_KEEPALIVE_PING 0x4b
+#define TCP_KEEPALIVE_PONG 0x4c
+
+/* Sent by a node to get the recent telegrams of its group, that the server
+ * sends before the next ones. Not a valid ctrl byte. */
+#define TCP_CATCHUP_MAGIC 0x4d
+
+/* Max size of a SOCK_SEQPACKET record, holding only whole telegrams */
+#define UNIX_RECORD_MAX 2048
+
+namespace KNX {
+
+/**
+ * Protocol of the nodes of a ServerSmoke, whatever the socket: telegrams
+ * buffered by broadcast() and sent together by flush(), the join preamble,
+ * the answers to the keepalive probes, the catch-up request and the
+ * capture of the telegrams received.
+ * A stream is split into telegrams by their header, a socket of records
+ * (SOCK_SEQPACKET) carries only whole telegrams in each of them.
+ *
+ * @tparam Socket - the backend, whose int _open() creates and connects
+ *                  the socket (-1 on errors).
+ */
+template<class Socket>
+class StreamBackend : public Backend {
+public:
+    bool init() {
+        if(_ready)
+            return false;
+
+        if((_socket = static_cast<Socket *>(this)->_open()) == -1)
+            return false;
+
+        if(_group && !_join()) {
+            close(_socket);
+            _socket = -1;
+            return false;
+        }
+
+        _ready = true;
+        return true;
+    }
+
+    /** Telegrams are buffered and sent all together by flush() */
+    bool broadcast(const telegram &data) {
+        if(!_ready)
+            return false;
+
+        _outbuf.insert(_outbuf.end(), data.raw(), data.raw() + data.size());
+        return true;
+    }
+
+    /** Records are cut at telegram boundaries, UNIX_RECORD_MAX at most */
+    bool flush() {
+        if(!_ready)
+            return false;
+
+        size_t off = 0;
+        while(off < _outbuf.size()) {
+            size_t len = _outbuf.size() - off;
+            if(_records) {
+                len = 0;
+                while(off + len < _outbuf.size()) {
+                    size_t size = telegram::rawSize(&_outbuf[off + len]);
+                    if(len + size > UNIX_RECORD_MAX)
+                        break;
+                    len += size;
+                }
+            }
+
+            ssize_t n = send(_socket, &_outbuf[off], len, MSG_NOSIGNAL);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                /* Sent by the next flush() */
+                _outbuf.erase(_outbuf.begin(), _outbuf.begin() + off);
+                return false;
+            }
+            if(n <= 0) {
+                LOG("Send failed.");
+                _outbuf.clear();
+                return false;
+            }
+            off += (size_t)n;
+        }
+
+        _outbuf.clear();
+        return true;
+    }
+
+    bool read(telegram &data) {
+        if(!_ready || _pkts.size() == 0)
+            return false;
+        data = _pkts.front();
+
+        _pkts.pop();
+        return true;
+    }
+
+    void pop() {
+        if(_pkts.size() > 0)
+            _pkts.pop();
+    }
+
+    size_t count() const {
+        return _pkts.size();
+    }
+
+    void shutdown() {
+        if(_ready) flush();
+        if(_ready) _ready = false;
+        if(_socket >= 0) close(_socket);
+        _socket = -1;
+        _capture.close();
+        _stream = NULL;
+    }
+
+    /**
+     * Asks the server for the recent telegrams of the group (see
+     * ServerSmoke::setHistory()), received before the live ones. Those
+     * received since init() may be received twice.
+     *
+     * @return TRUE - if the request is sent.
+     *         FALSE - otherwise.
+     */
+    bool catchup() {
+        if(!_ready)
+            return false;
+        uint8_t req = TCP_CATCHUP_MAGIC;
+        return send(_socket, &req, 1, MSG_NOSIGNAL) == 1;
+    }
+
+    /**
+     * Records the telegrams received from the server inside a capture
+     * file (see knx/capture.h), as sent by a single connection.
+     *
+     * @param path - the capture file, created or truncated.
+     * @return TRUE - if the capture is running.
+     *         FALSE - if the file can't be created.
+     */
+    bool capture(const char *path) {
+        if(_stream || !_capture.open(path))
+            return false;
+
+        _stream = _capture.stream();
+        const char *name = _group ? _group : "";
+        _stream->record(CAPTURE_GROUP, 0, 0, (const uint8_t *)name,
+                        (uint8_t)strlen(name), Capture::nowUs());
+        return true;
+    }
+
+    bool must_update() const {
+        return false;
+    }
+
+    /** Waits up to 10ms, then reads all the available data */
+    bool update() {
+        if(!_ready) return false;
+
+        struct pollfd pfd;
+        pfd.fd = _socket;
+        pfd.events = POLLIN;
+
+        NETBENCHMARK_START(tcp_waiting);
+        int n = poll(&pfd, 1, 10);
+        if(n < 0) {
+            NETBENCHMARK_STOP(tcp_waiting);
+            LOG("Poll returned -1.\n");
+            return false;
+        }
+        NETBENCHMARK_STOP(tcp_waiting);
+
+        NETBENCHMARK_START(tcp_read);
+        while(n > 0) {
+            uint8_t buf[UNIX_RECORD_MAX];
+            size_t room = _records ? sizeof(buf) :
+                          _pktbuffer.capacity() - _pktbuffer.size();
+            if(room > sizeof(buf))
+                room = sizeof(buf);
+
+            ssize_t m = recv(_socket, buf, room, MSG_DONTWAIT);
+            if(m < 0 && errno == EINTR)
+                continue;
+            if(m < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if(m <= 0) {
+                NETBENCHMARK_STOP(tcp_read);
+                LOG("Connection closed.");
+                return false;
+            }
+
+            if(_records)
+                _process_record(buf, (size_t)m);
+            else
+                _process_packet(buf, (size_t)m);
+        }
+        if(_stream)
+            _stream->tick(Capture::nowUs());
+        NETBENCHMARK_STOP(tcp_read);
+
+        return true;
+    }
+protected:
+    /**
+     * @param group - group of the server to join, NULL for the default one.
+     * @param ringSize - bytes kept while a telegram of a stream is split.
+     * @param records - TRUE if the socket carries records.
+     */
+    StreamBackend(const char *group, size_t ringSize, bool records) :
+        Backend(), _pktbuffer(ringSize), _socket(-1), _records(records),
+        _group(group), _stream(NULL) {}
+
+private:
+
+    /** Join the group: numbered groups are joined by their decimal name */
+    bool _join() {
+        size_t len = strlen(_group);
+        if(len > TCP_GROUP_NAME_MAX) {
+            LOG("Group name too long.");
+            return false;
+        }
+
+        uint8_t preamble[2 + TCP_GROUP_NAME_MAX];
+        preamble[0] = TCP_JOIN_MAGIC;
+        preamble[1] = (uint8_t)len;
+        memcpy(&preamble[2], _group, len);
+
+        return send(_socket, preamble, 2 + len, 0) == (ssize_t)(2 + len);
+    }
+
+    /** Answers a keepalive probe of the server */
+    void _pong() {
+        uint8_t pong = TCP_KEEPALIVE_PONG;
+        if(send(_socket, &pong, 1, MSG_NOSIGNAL) != 1)
+            LOG("Cannot answer the keepalive.");
+    }
+
+    /** Queues a telegram received, and records it if captured */
+    void _received(const telegram &pkt, uint8_t dsize) {
+        if(_stream)
+            _stream->record(CAPTURE_TELEGRAM, 1, 0, pkt.raw(), dsize,
+                            Capture::nowUs());
+        _pkts.push(pkt);
+    }
+
+    /** Record -> Array of KNX Telegrams, no leftovers */
+    void _process_record(const uint8_t *buf, size_t len) {
+        size_t off = 0;
+        while(off < len) {
+            if(buf[off] == TCP_KEEPALIVE_PING) {
+                _pong();
+                off++;
+                continue;
+            }
+
+            if(len - off < tg_size::hdr + 1)
+                break;
+            uint8_t dsize = telegram::rawSize(buf + off);
+            if(dsize > len - off)
+                break;
+
+            telegram pkt;
+            memcpy(&pkt[0], buf + off, dsize);
+            _received(pkt, dsize);
+            off += dsize;
+        }
+
+        if(off < len)
+            LOG("Truncated record.");
+    }
+
+    /** Stream -> Array of KNX Telegrams */
+    void _process_packet(uint8_t *buf, size_t len) {
+        if(len == 0) return;
+
+        _pktbuffer.write(buf, len);
+
+        while(_pktbuffer.size() > 0) {
+            uint8_t hdr[tg_size::hdr];
+            _pktbuffer.peek((uint8_t *)&hdr, 1);
+            if(hdr[0] == TCP_KEEPALIVE_PING) {
+                _pktbuffer.read((uint8_t *)&hdr, 1);
+                _pong();
+                continue;
+            }
+
+            if(_pktbuffer.size() < tg_size::hdr + 1)
+                return;
+            _pktbuffer.peek((uint8_t *)&hdr, sizeof(hdr));
+
+            uint8_t dsize = telegram::rawSize(hdr);
+
+            if(dsize > _pktbuffer.size())
+                return;
+
+            telegram pkt;
+
+            _pktbuffer.read(&pkt[0], dsize);
+            _received(pkt, dsize);
+        }
+    }
+
+    queue<telegram> _pkts;
+    vector<uint8_t> _outbuf;
+    RingBuffer _pktbuffer;
+    int _socket;
+    bool _records;
+    const char *_group;
+    Capture _capture;
+    CaptureStream *_stream;
+
+    TAG_DEF("StreamBackend")
+};
+
+} // namespace KNX
+#endif /* ifndef BACKEND_LINUX_STREAM_HH */
@@ -0,0 +1,58 @@
+#ifndef BACKEND_LINUX_UNIX_HH
+#define BACKEND_LINUX_UNIX_HH
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "linux-stream.h"
+
+#define UNIX_RINGBUFSIZE (2 * UNIX_RECORD_MAX)
+
+namespace KNX {
+
+/**
+ * Same as LinuxTCP, on a AF_UNIX socket of a local ServerSmoke.
+ * With SOCK_SEQPACKET (the default) every record carries whole telegrams,
+ * so no reassembly is needed; SOCK_STREAM behaves exactly like TCP.
+ * PORT is unused, it's there to match LinuxTCP.
+ */
+template<uint16_t PORT>
+class LinuxUnix : public StreamBackend<LinuxUnix<PORT> > {
+    friend class StreamBackend<LinuxUnix<PORT> >;
+public:
+    /**
+     * @param path - path of the socket of the server.
+     * @param group - group of the server to join, NULL for the default one.
+     * @param type - SOCK_SEQPACKET or SOCK_STREAM.
+     */
+    LinuxUnix(const char *path, const char *group = NULL,
+              int type = SOCK_SEQPACKET) :
+        StreamBackend<LinuxUnix<PORT> >(group, UNIX_RINGBUFSIZE,
+                                        type == SOCK_SEQPACKET),
+        _type(type) {
+        memset(&_addr, 0, sizeof(_addr));
+        _addr.sun_family = AF_UNIX;
+        strncpy(_addr.sun_path, path, sizeof(_addr.sun_path) - 1);
+    }
+
+private:
+
+    int _open() {
+        int s = socket(AF_UNIX, _type | SOCK_CLOEXEC, 0);
+        if(s == -1)
+            return -1;
+
+        if(connect(s, (struct sockaddr *)&_addr, sizeof(_addr)) != 0) {
+            close(s);
+            return -1;
+        }
+        return s;
+    }
+
+    int _type;
+    struct sockaddr_un _addr;
+};
+
+} // namespace KNX
+#endif /* ifndef BACKEND_LINUX_UNIX_HH */
@@ -0,0 +1,357 @@
+#ifndef KNX_CAPTURE_H
+#define KNX_CAPTURE_H
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Capture file: a CaptureHeader followed by records, each one a
+ * CaptureRecord and len bytes of data, padded to CAPTURE_ALIGN so every
+ * record can be read in place once the file is mmap'd. Host byte order.
+ * Records of different producers (e.g. the reactors of a server) are
+ * written a chunk at a time, so the file is ordered by time only inside
+ * each producer: the reader sorts them by ts.
+ */
+#define CAPTURE_MAGIC "SMKCAP1"
+#define CAPTURE_VERSION 1
+#define CAPTURE_ALIGN 8
+
+/* Each producer fills a chunk, handed whole to the writer thread. All the
+ * chunks are allocated by open(): when none is free the records are
+ * dropped (and counted), the producers never wait for the disk. */
+#define CAPTURE_CHUNK (1024 * 1024)
+#define CAPTURE_CHUNKS 16
+/* A chunk not full is handed anyway after this time (us) */
+#define CAPTURE_FLUSH_US 200000
+
+namespace KNX {
+
+/**
+ * Kind of a record.
+ */
+enum CaptureType {
+    /** A valid telegram received on a connection. */
+    CAPTURE_TELEGRAM = 1,
+    /** The name (the data) of a group, before its first telegram. */
+    CAPTURE_GROUP = 2,
+};
+
+struct CaptureHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    /** Wall clock (us since the epoch) and monotonic time of the start */
+    uint64_t startRealUs;
+    uint64_t startMonoUs;
+};
+
+struct CaptureRecord {
+    /** us since the start of the capture */
+    uint64_t ts;
+    /** Id of the connection, unique inside the capture */
+    uint32_t conn;
+    /** Group of the telegram, named by a CAPTURE_GROUP record */
+    uint16_t group;
+    uint8_t type;
+    uint8_t len;
+
+    /** Bytes taken by a record with the given data */
+    static size_t size(size_t len) {
+        return (sizeof(CaptureRecord) + len + CAPTURE_ALIGN - 1) &
+               ~(size_t)(CAPTURE_ALIGN - 1);
+    }
+};
+
+class Capture;
+
+/**
+ * Producer side of a Capture, used by a single thread.
+ */
+class CaptureStream {
+public:
+    /**
+     * Appends a record: a copy inside the current chunk, no syscall and
+     * no lock but when the chunk is full.
+     *
+     * @param type - kind of the record.
+     * @param conn - id of the connection.
+     * @param group - id of the group.
+     * @param data - the telegram, or the name of the group.
+     * @param len - the length of the data.
+     * @param nowUs - the current time (monotonic, us).
+     */
+    inline void record(uint8_t type, uint32_t conn, uint16_t group,
+                       const uint8_t *data, uint8_t len, uint64_t nowUs);
+
+    /**
+     * Hands the current chunk to the writer if it's been waiting for
+     * more than CAPTURE_FLUSH_US. To be called now and then by the
+     * producer, so a quiet capture is still written.
+     *
+     * @param nowUs - the current time (monotonic, us).
+     */
+    inline void tick(uint64_t nowUs);
+
+private:
+    friend class Capture;
+
+    explicit CaptureStream(Capture *cap) : _cap(cap), _chunk(NULL),
+        _used(0), _since(0), _records(0), _dropped(0) {}
+
+    inline void handoff();
+
+    /** Written only by the producer, read by anybody */
+    static void inc(std::atomic<uint64_t> &counter) {
+        counter.store(counter.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+    }
+
+    Capture *_cap;
+    uint8_t *_chunk;
+    size_t _used;
+    uint64_t _since;
+    std::atomic<uint64_t> _records;
+    std::atomic<uint64_t> _dropped;
+};
+
+/**
+ * Append-only capture file, written by a thread of its own from chunks
+ * filled by the producers.
+ */
+class Capture {
+public:
+    Capture() : _fd(-1), _chunkSize(0), _startUs(0), _stop(false),
+        _records(0), _dropped(0) {}
+
+    ~Capture() {
+        close();
+    }
+
+    /** Monotonic time (us), the clock of the timestamps */
+    static uint64_t nowUs() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+    }
+
+    /**
+     * Creates the file (truncated if it exists) and allocates the chunks.
+     *
+     * @param path - path of the file.
+     * @param chunkSize - bytes of each chunk.
+     * @param chunks - #Chunks, the memory of the capture.
+     * @return TRUE - if the capture is running.
+     *         FALSE - if the file can't be created.
+     */
+    bool open(const char *path, size_t chunkSize = CAPTURE_CHUNK,
+              size_t chunks = CAPTURE_CHUNKS) {
+        if(_fd >= 0 || chunks == 0 ||
+           chunkSize < CaptureRecord::size(UINT8_MAX))
+            return false;
+
+        _fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(_fd < 0)
+            return false;
+
+        struct timespec real;
+        clock_gettime(CLOCK_REALTIME, &real);
+        CaptureHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+        h.version = CAPTURE_VERSION;
+        h.startRealUs = (uint64_t)real.tv_sec * 1000000ULL +
+                        (uint64_t)real.tv_nsec / 1000;
+        h.startMonoUs = _startUs = nowUs();
+        if(write(_fd, &h, sizeof(h)) != (ssize_t)sizeof(h)) {
+            ::close(_fd);
+            _fd = -1;
+            return false;
+        }
+
+        _chunkSize = chunkSize;
+        for(size_t i = 0; i < chunks; i++) {
+            _memory.push_back(new uint8_t[chunkSize]);
+            _free.push_back(_memory.back());
+        }
+        _freeCount.store(chunks, std::memory_order_relaxed);
+
+        _stop = false;
+        _writer = std::thread(&Capture::writer, this);
+        return true;
+    }
+
+    /**
+     * Gets a new producer. Must be called before it starts recording.
+     */
+    CaptureStream *stream() {
+        std::lock_guard<std::mutex> l(_lock);
+        _streams.push_back(new CaptureStream(this));
+        return _streams.back();
+    }
+
+    /**
+     * Writes what's left and closes the file. The producers must have
+     * stopped.
+     */
+    void close() {
+        if(_fd < 0)
+            return;
+
+        for(CaptureStream *s : _streams)
+            if(s->_chunk)
+                s->handoff();
+        {
+            std::lock_guard<std::mutex> l(_lock);
+            _stop = true;
+        }
+        _cv.notify_one();
+        _writer.join();
+
+        ::close(_fd);
+        _fd = -1;
+        std::lock_guard<std::mutex> l(_lock);
+        for(CaptureStream *s : _streams) {
+            _records += s->_records.load(std::memory_order_relaxed);
+            _dropped += s->_dropped.load(std::memory_order_relaxed);
+            delete s;
+        }
+        _streams.clear();
+        for(uint8_t *c : _memory)
+            delete[] c;
+        _memory.clear();
+        _free.clear();
+    }
+
+    /** #Records appended, and the ones dropped for lack of chunks */
+    uint64_t records() {
+        std::lock_guard<std::mutex> l(_lock);
+        uint64_t n = _records;
+        for(const CaptureStream *s : _streams)
+            n += s->_records.load(std::memory_order_relaxed);
+        return n;
+    }
+
+    uint64_t dropped() {
+        std::lock_guard<std::mutex> l(_lock);
+        uint64_t n = _dropped;
+        for(const CaptureStream *s : _streams)
+            n += s->_dropped.load(std::memory_order_relaxed);
+        return n;
+    }
+
+private:
+    friend class CaptureStream;
+
+    /** A free chunk, NULL if they are all waiting for the disk */
+    uint8_t *take() {
+        if(_freeCount.load(std::memory_order_relaxed) == 0)
+            return NULL;
+        std::lock_guard<std::mutex> l(_lock);
+        if(_free.empty())
+            return NULL;
+        uint8_t *c = _free.back();
+        _free.pop_back();
+        _freeCount.fetch_sub(1, std::memory_order_relaxed);
+        return c;
+    }
+
+    /** Queues a chunk to be written */
+    void put(uint8_t *chunk, size_t used) {
+        {
+            std::lock_guard<std::mutex> l(_lock);
+            _full.push_back(std::make_pair(chunk, used));
+        }
+        _cv.notify_one();
+    }
+
+    void writer() {
+        std::unique_lock<std::mutex> l(_lock);
+        for(;;) {
+            _cv.wait(l, [this]() { return _stop || !_full.empty(); });
+            if(_full.empty())
+                return;
+
+            std::pair<uint8_t *, size_t> c = _full.front();
+            _full.pop_front();
+            l.unlock();
+
+            size_t off = 0;
+            while(off < c.second) {
+                ssize_t n = write(_fd, c.first + off, c.second - off);
+                if(n <= 0)
+                    break;  // Disk full: the chunk is lost
+                off += (size_t)n;
+            }
+
+            l.lock();
+            _free.push_back(c.first);
+            _freeCount.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    int _fd;
+    size_t _chunkSize;
+    uint64_t _startUs;
+    std::thread _writer;
+    std::mutex _lock;
+    std::condition_variable _cv;
+    bool _stop;
+    std::vector<uint8_t *> _memory;
+    std::vector<uint8_t *> _free;
+    std::atomic<size_t> _freeCount;
+    std::deque<std::pair<uint8_t *, size_t>> _full;
+    std::vector<CaptureStream *> _streams;
+    /** Counters of the producers already closed */
+    uint64_t _records;
+    uint64_t _dropped;
+};
+
+void CaptureStream::record(uint8_t type, uint32_t conn, uint16_t group,
+                           const uint8_t *data, uint8_t len, uint64_t nowUs) {
+    size_t size = CaptureRecord::size(len);
+    if(_chunk && _used + size > _cap->_chunkSize)
+        handoff();
+    if(_chunk == NULL) {
+        _chunk = _cap->take();
+        _used = 0;
+        _since = nowUs;
+        if(_chunk == NULL) {
+            inc(_dropped);
+            return;
+        }
+    }
+
+    CaptureRecord *r = (CaptureRecord *)(_chunk + _used);
+    r->ts = nowUs - _cap->_startUs;
+    r->conn = conn;
+    r->group = group;
+    r->type = type;
+    r->len = len;
+    memcpy(r + 1, data, len);
+    memset((uint8_t *)(r + 1) + len, 0, size - sizeof(*r) - len);
+    _used += size;
+    inc(_records);
+}
+
+void CaptureStream::tick(uint64_t nowUs) {
+    if(_chunk && _used > 0 && nowUs - _since >= CAPTURE_FLUSH_US)
+        handoff();
+}
+
+void CaptureStream::handoff() {
+    _cap->put(_chunk, _used);
+    _chunk = NULL;
+    _used = 0;
+}
+
+} // namespace KNX
+#endif /* ifndef KNX_CAPTURE_H */
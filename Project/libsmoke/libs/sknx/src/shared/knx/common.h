@@ -16,7 +16,10 @@ extern "C" {
 #include "../../../libs/sban/include/sban/common.h"
 }
 
+/* SKNX logs are compiled in unless it's a release (NDEBUG) build */
+#if !defined(NDEBUG) && !defined(_DEBUG)
 #define _DEBUG
+#endif
 
 #define ENABLE_BENCHMARKS
 #define BENCHMARK_KEYEXCHANGE
@@ -82,6 +82,7 @@ public:
             _backend.broadcast(_out.front());
             _out.pop();
         }
+        _backend.flush();
         
         // Recv new telegrams
         while(_backend.count() > 0) {
@@ -69,6 +69,10 @@ class RingBuffer {
         size_t size() const {
             return plen;
         }
+
+        size_t capacity() const {
+            return bufsize;
+        }
     private:
         uint8_t *buf;
         const size_t bufsize;
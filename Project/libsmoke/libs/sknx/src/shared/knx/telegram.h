@@ -112,6 +112,24 @@ public:
         return ~sum;
     }
 
+    /** Size of the raw telegram starting with the given header */
+    static uint8_t rawSize(const uint8_t *hdr)
+    {
+        return tg_size::hdr + 1 + (hdr[5] & 0x0f);
+    }
+
+    /** Same as check(), on a raw telegram of rawSize() bytes */
+    static bool rawCheck(const uint8_t *raw)
+    {
+        uint8_t size = rawSize(raw);
+        uint8_t sum = 0;
+        for (uint8_t i = 0; i < size - 1; ++i)
+            sum ^= raw[i];
+
+        return ((raw[0] & 0b11010011) == 0b10010000) &&
+               ((uint8_t)~sum == raw[size - 1]);
+    }
+
     uint8_t operator[](uint8_t i) const { return pkt.raw[i]; }
     uint8_t &operator[](uint8_t i) { return pkt.raw[i]; }
 private:
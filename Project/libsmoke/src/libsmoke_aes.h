@@ -0,0 +1,215 @@
+#ifndef LIBSMOKE_AES_H
+#define LIBSMOKE_AES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <sknx/libs/polarssl/include/polarssl/aes.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SMOKE_HAVE_AESNI
+#endif
+
+#define AES_CTR_BLOCK 16
+/* Blocks encrypted together by AES-NI: each aesenc has a latency of some
+ * cycles but a new one can start every cycle, so independent blocks hide
+ * the latency of each other */
+#define AES_CTR_PIPELINE 8
+
+/**
+ * AES in counter mode, compatible with AES_CTR_xcrypt_buffer() of
+ * tiny-AES: the counter block starts from the IV and is incremented as a
+ * 128 bits big endian number.
+ * With AES-NI (checked with CPUID) AES_CTR_PIPELINE blocks are encrypted
+ * at once, otherwise each block is encrypted by the portable code of
+ * PolarSSL.
+ */
+class AesCtr {
+public:
+    static const size_t BLOCK = AES_CTR_BLOCK;
+
+    /**
+     * Constructor of the engine, no key is set.
+     *
+     * @param hardware - FALSE to always use the portable code.
+     */
+    explicit AesCtr(bool hardware = true) :
+            _hw(hardware && supported()) {
+        memset(&_aes, 0, sizeof(_aes));
+    }
+
+    /**
+     * The round keys are referenced by the context itself.
+     */
+    AesCtr(const AesCtr &) = delete;
+    AesCtr &operator=(const AesCtr &) = delete;
+
+    ~AesCtr() {
+        memset(&_aes, 0, sizeof(_aes));
+    }
+
+
+    /**
+     * Checks if the CPU has the AES-NI instructions.
+     */
+    static bool supported() {
+#ifdef SMOKE_HAVE_AESNI
+        static const bool aesni = __builtin_cpu_supports("aes") &&
+                                  __builtin_cpu_supports("sse4.1");
+        return aesni;
+#else
+        return false;
+#endif
+    }
+
+
+    /**
+     * Checks if the engine uses AES-NI.
+     */
+    bool hardware() const {
+        return _hw;
+    }
+
+
+    /**
+     * Expands a key.
+     *
+     * @param key - the key.
+     * @param bits - the length of the key: 128, 192 or 256.
+     * @return TRUE - if the key is set.
+     *         FALSE - if the length is not valid.
+     */
+    bool setKey(const uint8_t *key, unsigned bits = 256) {
+        return aes_setkey_enc(&_aes, key, bits) == 0;
+    }
+
+
+    /**
+     * Encrypts (or decrypts) a buffer in place.
+     *
+     * @param iv - the first counter block.
+     * @param buf - the data.
+     * @param len - the length of the data.
+     */
+    void xcrypt(const uint8_t iv[AES_CTR_BLOCK], uint8_t *buf, size_t len) {
+#ifdef SMOKE_HAVE_AESNI
+        if(_hw) {
+            xcryptAesni(iv, buf, len);
+            return;
+        }
+#endif
+        uint8_t ctr[AES_CTR_BLOCK];
+        uint8_t ks[AES_CTR_BLOCK];
+        memcpy(ctr, iv, AES_CTR_BLOCK);
+        for(size_t off = 0; off < len; off += AES_CTR_BLOCK) {
+            aes_crypt_ecb(&_aes, AES_ENCRYPT, ctr, ks);
+            size_t n = len - off < AES_CTR_BLOCK ? len - off : AES_CTR_BLOCK;
+            for(size_t i = 0; i < n; i++)
+                buf[off + i] ^= ks[i];
+
+            for(int i = AES_CTR_BLOCK - 1; i >= 0 && ++ctr[i] == 0; i--)
+                ;
+        }
+    }
+
+
+    /**
+     * Encrypts (or decrypts) a buffer in place, with the counter blocks of
+     * AES-GCM: a 96 bits nonce followed by a 32 bits big endian counter.
+     *
+     * @param nonce - the nonce, 96 bits.
+     * @param block - the counter of the first block.
+     * @param buf - the data.
+     * @param len - the length of the data.
+     */
+    void xcrypt(const uint8_t nonce[12], uint32_t block, uint8_t *buf,
+                size_t len) {
+        uint8_t iv[AES_CTR_BLOCK];
+        memcpy(iv, nonce, 12);
+        for(int i = 0; i < 4; i++)
+            iv[12 + i] = (uint8_t) (block >> (24 - 8 * i));
+        xcrypt(iv, buf, len);
+    }
+
+private:
+#ifdef SMOKE_HAVE_AESNI
+    /**
+     * Gets a counter block, from the counter as two 64 bits halves.
+     */
+    __attribute__((target("aes,sse4.1")))
+    static __m128i counter(uint64_t hi, uint64_t lo) {
+        return _mm_set_epi64x((long long) __builtin_bswap64(lo),
+                              (long long) __builtin_bswap64(hi));
+    }
+
+    __attribute__((target("aes,sse4.1")))
+    void xcryptAesni(const uint8_t iv[AES_CTR_BLOCK], uint8_t *buf,
+                     size_t len) {
+        const int nr = _aes.nr;
+        __m128i rk[15];
+        for(int r = 0; r <= nr; r++)
+            rk[r] = _mm_loadu_si128((const __m128i *) _aes.rk + r);
+
+        uint64_t hi, lo;
+        memcpy(&hi, iv, 8);
+        memcpy(&lo, iv + 8, 8);
+        hi = __builtin_bswap64(hi);
+        lo = __builtin_bswap64(lo);
+
+        size_t off = 0;
+        for(; off + AES_CTR_PIPELINE * AES_CTR_BLOCK <= len;
+            off += AES_CTR_PIPELINE * AES_CTR_BLOCK) {
+            // Unrolled, so the blocks stay inside the registers
+            __m128i b[AES_CTR_PIPELINE];
+#pragma GCC unroll 8
+            for(int i = 0; i < AES_CTR_PIPELINE; i++) {
+                b[i] = _mm_xor_si128(counter(hi, lo), rk[0]);
+                hi += ++lo == 0;
+            }
+            for(int r = 1; r < nr; r++) {
+#pragma GCC unroll 8
+                for(int i = 0; i < AES_CTR_PIPELINE; i++)
+                    b[i] = _mm_aesenc_si128(b[i], rk[r]);
+            }
+#pragma GCC unroll 8
+            for(int i = 0; i < AES_CTR_PIPELINE; i++) {
+                __m128i *p = (__m128i *) (buf + off) + i;
+                b[i] = _mm_aesenclast_si128(b[i], rk[nr]);
+                _mm_storeu_si128(p, _mm_xor_si128(b[i], _mm_loadu_si128(p)));
+            }
+        }
+
+        // The last blocks (all of them for a telegram) one by one
+        for(; off < len; off += AES_CTR_BLOCK) {
+            __m128i b = _mm_xor_si128(counter(hi, lo), rk[0]);
+            hi += ++lo == 0;
+            for(int r = 1; r < nr; r++)
+                b = _mm_aesenc_si128(b, rk[r]);
+            b = _mm_aesenclast_si128(b, rk[nr]);
+
+            if(len - off >= AES_CTR_BLOCK) {
+                __m128i *p = (__m128i *) (buf + off);
+                _mm_storeu_si128(p, _mm_xor_si128(b, _mm_loadu_si128(p)));
+            } else {
+                uint8_t ks[AES_CTR_BLOCK];
+                _mm_storeu_si128((__m128i *) ks, b);
+                for(size_t i = 0; i < len - off; i++)
+                    buf[off + i] ^= ks[i];
+            }
+        }
+    }
+#endif
+
+    /**
+     * Used to save the round keys.
+     */
+    aes_context _aes;
+    /**
+     * Used to check if AES-NI is used.
+     */
+    const bool _hw;
+};
+
+#endif //LIBSMOKE_AES_H
@@ -0,0 +1,475 @@
+#ifndef LIBSMOKE_CHACHA_H
+#define LIBSMOKE_CHACHA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SMOKE_HAVE_X86_SIMD
+#endif
+
+#define CHACHA_BLOCK 64
+/* Bytes of the tag of a message encrypted with ChaCha20-Poly1305 */
+#define POLY1305_TAG_SIZE 16
+
+/**
+ * ChaCha20 (RFC 8439), the stream cipher for the nodes without AES
+ * instructions: only additions, rotations and xors of 32 bits words, so
+ * the portable code is fast on the 32 bits MCUs too.
+ * On x86 the blocks are computed in parallel, one word of 4 blocks per
+ * SSE2 register or of 8 blocks per AVX2 register (checked with CPUID).
+ * Only the last blocks, and the short messages, use the portable code.
+ */
+class ChaCha20 {
+public:
+    static const size_t BLOCK = CHACHA_BLOCK;
+
+    /**
+     * Constructor of the cipher, no key is set.
+     *
+     * @param lanes - max #Blocks computed in parallel: 1 to always use the
+     *                portable code, 4 for SSE2, 8 for AVX2.
+     */
+    explicit ChaCha20(unsigned lanes = 8) :
+            _lanes(lanes < supported() ? lanes : supported()) {
+        memset(_key, 0, sizeof(_key));
+    }
+
+    ChaCha20(const ChaCha20 &) = delete;
+    ChaCha20 &operator=(const ChaCha20 &) = delete;
+
+    ~ChaCha20() {
+        memset(_key, 0, sizeof(_key));
+    }
+
+
+    /**
+     * Gets the max #Blocks the CPU can compute in parallel.
+     */
+    static unsigned supported() {
+#ifdef SMOKE_HAVE_X86_SIMD
+        static const unsigned lanes = __builtin_cpu_supports("avx2") ? 8 :
+                                      __builtin_cpu_supports("sse2") ? 4 : 1;
+        return lanes;
+#else
+        return 1;
+#endif
+    }
+
+
+    /**
+     * Gets the #Blocks computed in parallel.
+     */
+    unsigned lanes() const {
+        return _lanes;
+    }
+
+
+    /**
+     * Sets a key.
+     *
+     * @param key - the key, 256 bits.
+     * @return TRUE - always, the length is fixed.
+     */
+    bool setKey(const uint8_t *key) {
+        for(int i = 0; i < 8; i++)
+            _key[i] = load32(key + 4 * i);
+        return true;
+    }
+
+
+    /**
+     * Encrypts (or decrypts) a buffer in place.
+     *
+     * @param nonce - the nonce, 96 bits.
+     * @param block - the counter of the first block.
+     * @param buf - the data.
+     * @param len - the length of the data.
+     */
+    void xcrypt(const uint8_t nonce[12], uint32_t block, uint8_t *buf,
+                size_t len) const {
+        uint32_t st[16] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+        memcpy(st + 4, _key, sizeof(_key));
+        st[12] = block;
+        for(int i = 0; i < 3; i++)
+            st[13 + i] = load32(nonce + 4 * i);
+
+        size_t off = 0;
+#ifdef SMOKE_HAVE_X86_SIMD
+        if(_lanes >= 8) {
+            for(; len - off >= 8 * CHACHA_BLOCK; off += 8 * CHACHA_BLOCK) {
+                xcryptAvx2(st, buf + off);
+                st[12] += 8;
+            }
+        }
+        if(_lanes >= 4) {
+            for(; len - off >= 4 * CHACHA_BLOCK; off += 4 * CHACHA_BLOCK) {
+                xcryptSse2(st, buf + off);
+                st[12] += 4;
+            }
+        }
+#endif
+        // The last blocks (all of them for a telegram) one by one
+        for(; off < len; off += CHACHA_BLOCK) {
+            uint32_t x[16];
+            rounds(st, x);
+            size_t n = len - off < CHACHA_BLOCK ? len - off : CHACHA_BLOCK;
+            for(size_t i = 0; i < n; i++)
+                buf[off + i] ^= (uint8_t) (x[i / 4] >> (8 * (i % 4)));
+            st[12]++;
+        }
+    }
+
+private:
+    static uint32_t load32(const uint8_t *p) {
+        return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+               ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+    }
+
+    static uint32_t rotl(uint32_t v, int n) {
+        return (v << n) | (v >> (32 - n));
+    }
+
+    static void quarter(uint32_t &a, uint32_t &b, uint32_t &c, uint32_t &d) {
+        a += b; d ^= a; d = rotl(d, 16);
+        c += d; b ^= c; b = rotl(b, 12);
+        a += b; d ^= a; d = rotl(d, 8);
+        c += d; b ^= c; b = rotl(b, 7);
+    }
+
+    /**
+     * Portable: the 20 rounds of a block, plus the input.
+     */
+    static void rounds(const uint32_t st[16], uint32_t x[16]) {
+        memcpy(x, st, 16 * sizeof(uint32_t));
+        for(int r = 0; r < 10; r++) {
+            quarter(x[0], x[4], x[8], x[12]);
+            quarter(x[1], x[5], x[9], x[13]);
+            quarter(x[2], x[6], x[10], x[14]);
+            quarter(x[3], x[7], x[11], x[15]);
+            quarter(x[0], x[5], x[10], x[15]);
+            quarter(x[1], x[6], x[11], x[12]);
+            quarter(x[2], x[7], x[8], x[13]);
+            quarter(x[3], x[4], x[9], x[14]);
+        }
+        for(int i = 0; i < 16; i++)
+            x[i] += st[i];
+    }
+
+#ifdef SMOKE_HAVE_X86_SIMD
+    /**
+     * SSE2 has no rotation, nor byte shuffle: 16 bits are swapped as
+     * words, the others shifted.
+     */
+    __attribute__((target("sse2")))
+    static __m128i rotl(__m128i v, int n) {
+        if(n == 16)
+            return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xb1), 0xb1);
+        return _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - n));
+    }
+
+    __attribute__((target("sse2")))
+    static void quarter(__m128i &a, __m128i &b, __m128i &c, __m128i &d) {
+        a = _mm_add_epi32(a, b); d = rotl(_mm_xor_si128(d, a), 16);
+        c = _mm_add_epi32(c, d); b = rotl(_mm_xor_si128(b, c), 12);
+        a = _mm_add_epi32(a, b); d = rotl(_mm_xor_si128(d, a), 8);
+        c = _mm_add_epi32(c, d); b = rotl(_mm_xor_si128(b, c), 7);
+    }
+
+    /**
+     * Gets, from the same 4 words of 4 blocks, the 4 words of each block.
+     */
+    __attribute__((target("sse2")))
+    static void transpose(__m128i &a, __m128i &b, __m128i &c, __m128i &d) {
+        __m128i ab0 = _mm_unpacklo_epi32(a, b);
+        __m128i cd0 = _mm_unpacklo_epi32(c, d);
+        __m128i ab2 = _mm_unpackhi_epi32(a, b);
+        __m128i cd2 = _mm_unpackhi_epi32(c, d);
+        a = _mm_unpacklo_epi64(ab0, cd0);
+        b = _mm_unpackhi_epi64(ab0, cd0);
+        c = _mm_unpacklo_epi64(ab2, cd2);
+        d = _mm_unpackhi_epi64(ab2, cd2);
+    }
+
+    /**
+     * Encrypts 4 blocks, the word i of all of them inside x[i].
+     */
+    __attribute__((target("sse2")))
+    static void xcryptSse2(const uint32_t st[16], uint8_t *buf) {
+        __m128i x[16];
+        for(int i = 0; i < 16; i++)
+            x[i] = _mm_set1_epi32((int) st[i]);
+        const __m128i ctr = _mm_set_epi32(3, 2, 1, 0);
+        x[12] = _mm_add_epi32(x[12], ctr);
+
+        for(int r = 0; r < 10; r++) {
+            quarter(x[0], x[4], x[8], x[12]);
+            quarter(x[1], x[5], x[9], x[13]);
+            quarter(x[2], x[6], x[10], x[14]);
+            quarter(x[3], x[7], x[11], x[15]);
+            quarter(x[0], x[5], x[10], x[15]);
+            quarter(x[1], x[6], x[11], x[12]);
+            quarter(x[2], x[7], x[8], x[13]);
+            quarter(x[3], x[4], x[9], x[14]);
+        }
+        for(int i = 0; i < 16; i++)
+            x[i] = _mm_add_epi32(x[i], _mm_set1_epi32((int) st[i]));
+        x[12] = _mm_add_epi32(x[12], ctr);
+
+        for(int g = 0; g < 16; g += 4) {
+            transpose(x[g], x[g + 1], x[g + 2], x[g + 3]);
+            for(int b = 0; b < 4; b++) {
+                __m128i *p = (__m128i *) (buf + b * CHACHA_BLOCK) + g / 4;
+                _mm_storeu_si128(p, _mm_xor_si128(x[g + b],
+                                                  _mm_loadu_si128(p)));
+            }
+        }
+    }
+
+    __attribute__((target("avx2")))
+    static __m256i rotl(__m256i v, int n) {
+        if(n == 16)
+            return _mm256_shuffle_epi8(v, _mm256_set_epi8(
+                    13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+                    13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2));
+        if(n == 8)
+            return _mm256_shuffle_epi8(v, _mm256_set_epi8(
+                    14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+                    14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3));
+        return _mm256_or_si256(_mm256_slli_epi32(v, n),
+                               _mm256_srli_epi32(v, 32 - n));
+    }
+
+    __attribute__((target("avx2")))
+    static void quarter(__m256i &a, __m256i &b, __m256i &c, __m256i &d) {
+        a = _mm256_add_epi32(a, b); d = rotl(_mm256_xor_si256(d, a), 16);
+        c = _mm256_add_epi32(c, d); b = rotl(_mm256_xor_si256(b, c), 12);
+        a = _mm256_add_epi32(a, b); d = rotl(_mm256_xor_si256(d, a), 8);
+        c = _mm256_add_epi32(c, d); b = rotl(_mm256_xor_si256(b, c), 7);
+    }
+
+    /**
+     * As the SSE2 one, inside each half: the low one gets the blocks 0-3,
+     * the high one the blocks 4-7.
+     */
+    __attribute__((target("avx2")))
+    static void transpose(__m256i &a, __m256i &b, __m256i &c, __m256i &d) {
+        __m256i ab0 = _mm256_unpacklo_epi32(a, b);
+        __m256i cd0 = _mm256_unpacklo_epi32(c, d);
+        __m256i ab2 = _mm256_unpackhi_epi32(a, b);
+        __m256i cd2 = _mm256_unpackhi_epi32(c, d);
+        a = _mm256_unpacklo_epi64(ab0, cd0);
+        b = _mm256_unpackhi_epi64(ab0, cd0);
+        c = _mm256_unpacklo_epi64(ab2, cd2);
+        d = _mm256_unpackhi_epi64(ab2, cd2);
+    }
+
+    /**
+     * Encrypts 8 blocks, the word i of all of them inside x[i].
+     */
+    __attribute__((target("avx2")))
+    static void xcryptAvx2(const uint32_t st[16], uint8_t *buf) {
+        __m256i x[16];
+        for(int i = 0; i < 16; i++)
+            x[i] = _mm256_set1_epi32((int) st[i]);
+        const __m256i ctr = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+        x[12] = _mm256_add_epi32(x[12], ctr);
+
+        for(int r = 0; r < 10; r++) {
+            quarter(x[0], x[4], x[8], x[12]);
+            quarter(x[1], x[5], x[9], x[13]);
+            quarter(x[2], x[6], x[10], x[14]);
+            quarter(x[3], x[7], x[11], x[15]);
+            quarter(x[0], x[5], x[10], x[15]);
+            quarter(x[1], x[6], x[11], x[12]);
+            quarter(x[2], x[7], x[8], x[13]);
+            quarter(x[3], x[4], x[9], x[14]);
+        }
+        for(int i = 0; i < 16; i++)
+            x[i] = _mm256_add_epi32(x[i], _mm256_set1_epi32((int) st[i]));
+        x[12] = _mm256_add_epi32(x[12], ctr);
+
+        for(int g = 0; g < 16; g += 4)
+            transpose(x[g], x[g + 1], x[g + 2], x[g + 3]);
+        // The words 0-7 of a block from the first two groups, 8-15 from
+        // the other two
+        for(int b = 0; b < 4; b++) {
+            for(int half = 0; half < 2; half++) {
+                __m256i lo = x[8 * half + b];
+                __m256i hi = x[8 * half + 4 + b];
+                __m256i *p = (__m256i *) (buf + b * CHACHA_BLOCK) + half;
+                __m256i *q = (__m256i *) (buf + (b + 4) * CHACHA_BLOCK) + half;
+                _mm256_storeu_si256(p, _mm256_xor_si256(
+                        _mm256_permute2x128_si256(lo, hi, 0x20),
+                        _mm256_loadu_si256(p)));
+                _mm256_storeu_si256(q, _mm256_xor_si256(
+                        _mm256_permute2x128_si256(lo, hi, 0x31),
+                        _mm256_loadu_si256(q)));
+            }
+        }
+    }
+#endif
+
+    /**
+     * Used to save the key, as words.
+     */
+    uint32_t _key[8];
+    /**
+     * Used to save the #Blocks computed in parallel.
+     */
+    const unsigned _lanes;
+};
+
+/**
+ * Poly1305 (RFC 8439), the authentication of ChaCha20-Poly1305, with a
+ * one-time key. The 32 bits code of poly1305-donna: 5 limbs of 26 bits,
+ * multiplied as 64 bits.
+ * Each piece of the message is padded to 16 bytes, as the AEAD does with
+ * the additional data and the ciphertext.
+ */
+class Poly1305 {
+public:
+
+    /**
+     * Constructor of the authenticator.
+     *
+     * @param key - the one-time key, 256 bits.
+     */
+    explicit Poly1305(const uint8_t key[32]) {
+        _r[0] = load32(key + 0) & 0x3ffffff;
+        _r[1] = (load32(key + 3) >> 2) & 0x3ffff03;
+        _r[2] = (load32(key + 6) >> 4) & 0x3ffc0ff;
+        _r[3] = (load32(key + 9) >> 6) & 0x3f03fff;
+        _r[4] = (load32(key + 12) >> 8) & 0x00fffff;
+        for(int i = 0; i < 4; i++)
+            _pad[i] = load32(key + 16 + 4 * i);
+        memset(_h, 0, sizeof(_h));
+    }
+
+    Poly1305(const Poly1305 &) = delete;
+    Poly1305 &operator=(const Poly1305 &) = delete;
+
+    ~Poly1305() {
+        memset(_r, 0, sizeof(_r));
+        memset(_pad, 0, sizeof(_pad));
+        memset(_h, 0, sizeof(_h));
+    }
+
+
+    /**
+     * Adds a piece of the message, padded with zeros to 16 bytes.
+     *
+     * @param m - the piece.
+     * @param len - the length of the piece (can be also 0).
+     */
+    void pad(const uint8_t *m, size_t len) {
+        size_t off = 0;
+        for(; off + 16 <= len; off += 16)
+            block(m + off);
+        if(off < len) {
+            uint8_t last[16] = { 0 };
+            memcpy(last, m + off, len - off);
+            block(last);
+        }
+    }
+
+
+    /**
+     * Gets the tag.
+     *
+     * @param tag - the tag.
+     */
+    void finish(uint8_t tag[POLY1305_TAG_SIZE]) {
+        const uint32_t mask26 = 0x3ffffff;
+        uint32_t h0 = _h[0], h1 = _h[1], h2 = _h[2], h3 = _h[3], h4 = _h[4];
+        uint32_t c;
+        c = h1 >> 26; h1 &= mask26; h2 += c;
+        c = h2 >> 26; h2 &= mask26; h3 += c;
+        c = h3 >> 26; h3 &= mask26; h4 += c;
+        c = h4 >> 26; h4 &= mask26; h0 += c * 5;
+        c = h0 >> 26; h0 &= mask26; h1 += c;
+
+        // h - p, kept only if h >= p (in constant time)
+        uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= mask26;
+        uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= mask26;
+        uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= mask26;
+        uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= mask26;
+        uint32_t g4 = h4 + c - (1U << 26);
+        uint32_t mask = (g4 >> 31) - 1;
+        h0 = (h0 & ~mask) | (g0 & mask);
+        h1 = (h1 & ~mask) | (g1 & mask);
+        h2 = (h2 & ~mask) | (g2 & mask);
+        h3 = (h3 & ~mask) | (g3 & mask);
+        h4 = (h4 & ~mask) | (g4 & mask);
+
+        // (h + pad) % 2^128
+        uint32_t w[4] = { h0 | (h1 << 26), (h1 >> 6) | (h2 << 20),
+                          (h2 >> 12) | (h3 << 14), (h3 >> 18) | (h4 << 8) };
+        uint64_t f = 0;
+        for(int i = 0; i < 4; i++) {
+            f = (uint64_t) w[i] + _pad[i] + (f >> 32);
+            for(int j = 0; j < 4; j++)
+                tag[4 * i + j] = (uint8_t) (f >> (8 * j));
+        }
+    }
+
+private:
+    static uint32_t load32(const uint8_t *p) {
+        return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+               ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+    }
+
+    /**
+     * h = (h + m + 2^128) * r % (2^130 - 5)
+     */
+    void block(const uint8_t m[16]) {
+        const uint32_t mask26 = 0x3ffffff;
+        const uint32_t r0 = _r[0], r1 = _r[1], r2 = _r[2], r3 = _r[3],
+                       r4 = _r[4];
+        const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+
+        uint32_t h0 = _h[0] + (load32(m + 0) & mask26);
+        uint32_t h1 = _h[1] + ((load32(m + 3) >> 2) & mask26);
+        uint32_t h2 = _h[2] + ((load32(m + 6) >> 4) & mask26);
+        uint32_t h3 = _h[3] + ((load32(m + 9) >> 6) & mask26);
+        uint32_t h4 = _h[4] + ((load32(m + 12) >> 8) | (1U << 24));
+
+        uint64_t d0 = (uint64_t) h0 * r0 + (uint64_t) h1 * s4 +
+                      (uint64_t) h2 * s3 + (uint64_t) h3 * s2 +
+                      (uint64_t) h4 * s1;
+        uint64_t d1 = (uint64_t) h0 * r1 + (uint64_t) h1 * r0 +
+                      (uint64_t) h2 * s4 + (uint64_t) h3 * s3 +
+                      (uint64_t) h4 * s2;
+        uint64_t d2 = (uint64_t) h0 * r2 + (uint64_t) h1 * r1 +
+                      (uint64_t) h2 * r0 + (uint64_t) h3 * s4 +
+                      (uint64_t) h4 * s3;
+        uint64_t d3 = (uint64_t) h0 * r3 + (uint64_t) h1 * r2 +
+                      (uint64_t) h2 * r1 + (uint64_t) h3 * r0 +
+                      (uint64_t) h4 * s4;
+        uint64_t d4 = (uint64_t) h0 * r4 + (uint64_t) h1 * r3 +
+                      (uint64_t) h2 * r2 + (uint64_t) h3 * r1 +
+                      (uint64_t) h4 * r0;
+
+        uint32_t c;
+        c = (uint32_t) (d0 >> 26); h0 = (uint32_t) d0 & mask26;
+        d1 += c; c = (uint32_t) (d1 >> 26); h1 = (uint32_t) d1 & mask26;
+        d2 += c; c = (uint32_t) (d2 >> 26); h2 = (uint32_t) d2 & mask26;
+        d3 += c; c = (uint32_t) (d3 >> 26); h3 = (uint32_t) d3 & mask26;
+        d4 += c; c = (uint32_t) (d4 >> 26); h4 = (uint32_t) d4 & mask26;
+        h0 += c * 5; c = h0 >> 26; h0 &= mask26;
+        h1 += c;
+
+        _h[0] = h0; _h[1] = h1; _h[2] = h2; _h[3] = h3; _h[4] = h4;
+    }
+
+    /**
+     * Used to save the key (r clamped, and the pad) and the accumulator.
+     */
+    uint32_t _r[5];
+    uint32_t _pad[4];
+    uint32_t _h[5];
+};
+
+#endif //LIBSMOKE_CHACHA_H
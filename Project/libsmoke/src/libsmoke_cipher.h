@@ -0,0 +1,206 @@
+#ifndef LIBSMOKE_CIPHER_H
+#define LIBSMOKE_CIPHER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "libsmoke_aes.h"
+#include "libsmoke_chacha.h"
+#include "libsmoke_gcm.h"
+#include "libsmoke_keystream.h"
+
+/*
+ * Ciphers of ClientSmoke, its Cipher template parameter: all the nodes
+ * must use the same one. Each message is sealed as
+ * [tag, TAG_SIZE bytes][ciphertext], with the nonce (the id of the sender
+ * and its counter) and the command authenticated too. The keystreams are
+ * prepared while the node is idle by a KeystreamPool.
+ * A cipher has:
+ *   TAG_SIZE
+ *   bool setKey(key) - 256 bits.
+ *   void reset(self) - drops the keystreams, after setKey().
+ *   uint64_t next() - the nonce of the next message of this node.
+ *   size_t refill(max) - prepares max keystreams.
+ *   void seal(src, nonce, cmd, tag, buf, len)
+ *   bool open(src, nonce, cmd, tag, buf, len) - FALSE if the tag is wrong.
+ */
+
+/**
+ * Base of the ciphers whose keystreams are prepared by a KeystreamPool.
+ *
+ * @tparam Stream - the cipher of the keystreams.
+ * @tparam BYTES - the keystream prepared for each message.
+ */
+template<class Stream, size_t BYTES = KEYSTREAM_BYTES>
+class StreamCipher {
+public:
+
+    /**
+     * Drops every keystream, to be called when the key changes.
+     *
+     * @param self - the id of this node.
+     */
+    void reset(uint16_t self) {
+        _pool.reset(self);
+    }
+
+
+    /**
+     * Gets the nonce of the next message sent by this node.
+     */
+    uint64_t next() {
+        return _pool.next();
+    }
+
+
+    /**
+     * Prepares some keystreams.
+     *
+     * @param max - max #Keystreams prepared by this call.
+     * @return #Keystreams prepared.
+     */
+    size_t refill(size_t max) {
+        return _pool.refill(max);
+    }
+
+protected:
+    /**
+     * @param first - the counter of the first block of each keystream.
+     */
+    explicit StreamCipher(uint32_t first = 0) : _pool(_stream, first) {}
+
+    /**
+     * Compares two tags in constant time.
+     */
+    static bool equal(const uint8_t *a, const uint8_t *b, size_t len) {
+        uint8_t diff = 0;
+        for(size_t i = 0; i < len; i++)
+            diff |= a[i] ^ b[i];
+        return diff == 0;
+    }
+
+    /**
+     * Used to save the key, and the keystreams of the next messages.
+     */
+    Stream _stream;
+    KeystreamPool<Stream, BYTES> _pool;
+};
+
+/**
+ * AES-256-CTR, the messages are not authenticated. AES-NI when the CPU
+ * has it.
+ */
+class AesCtrCipher : public StreamCipher<AesCtr> {
+public:
+    static const size_t TAG_SIZE = 0;
+
+    bool setKey(const uint8_t *key) {
+        return _stream.setKey(key);
+    }
+
+    void seal(uint16_t src, uint64_t nonce, uint8_t, uint8_t *,
+              uint8_t *buf, size_t len) {
+        _pool.xcrypt(src, nonce, buf, len);
+    }
+
+    bool open(uint16_t src, uint64_t nonce, uint8_t, const uint8_t *,
+              uint8_t *buf, size_t len) {
+        _pool.xcrypt(src, nonce, buf, len);
+        return true;
+    }
+};
+
+/**
+ * AES-256-GCM, for the nodes with AES-NI and PCLMULQDQ. Each keystream
+ * starts from the block 1: the mask of the tag, then the message.
+ */
+class AesGcmCipher : public StreamCipher<AesCtr> {
+public:
+    static const size_t TAG_SIZE = GCM_TAG_SIZE;
+
+    AesGcmCipher() : StreamCipher<AesCtr>(1) {}
+
+    bool setKey(const uint8_t *key) {
+        if(!_stream.setKey(key))
+            return false;
+        _ghash.setKey(_stream);
+        return true;
+    }
+
+    void seal(uint16_t src, uint64_t nonce, uint8_t cmd, uint8_t *tag,
+              uint8_t *buf, size_t len) {
+        const uint8_t *ks = _pool.take(src, nonce);
+        _pool.xcrypt(src, nonce, ks, GCM_TAG_SIZE, buf, len);
+        _ghash.digest(&cmd, 1, buf, len, tag);
+        for(size_t i = 0; i < GCM_TAG_SIZE; i++)
+            tag[i] ^= ks[i];
+    }
+
+    bool open(uint16_t src, uint64_t nonce, uint8_t cmd, const uint8_t *tag,
+              uint8_t *buf, size_t len) {
+        uint8_t hash[GCM_TAG_SIZE];
+        _ghash.digest(&cmd, 1, buf, len, hash);
+        const uint8_t *ks = _pool.take(src, nonce);
+        for(size_t i = 0; i < GCM_TAG_SIZE; i++)
+            hash[i] ^= ks[i];
+        _pool.xcrypt(src, nonce, ks, GCM_TAG_SIZE, buf, len);
+        return equal(hash, tag, GCM_TAG_SIZE);
+    }
+
+private:
+    /**
+     * Used to save the GHASH of the key.
+     */
+    Ghash _ghash;
+};
+
+/**
+ * ChaCha20-Poly1305 (RFC 8439), for the nodes without AES instructions.
+ * Each keystream is the block 0, whose first 32 bytes are the key of
+ * Poly1305, then the message from the block 1.
+ */
+class ChaChaPolyCipher : public StreamCipher<ChaCha20, 2 * CHACHA_BLOCK> {
+public:
+    static const size_t TAG_SIZE = POLY1305_TAG_SIZE;
+
+    bool setKey(const uint8_t *key) {
+        return _stream.setKey(key);
+    }
+
+    void seal(uint16_t src, uint64_t nonce, uint8_t cmd, uint8_t *tag,
+              uint8_t *buf, size_t len) {
+        const uint8_t *ks = _pool.take(src, nonce);
+        _pool.xcrypt(src, nonce, ks, CHACHA_BLOCK, buf, len);
+        mac(ks, cmd, buf, len, tag);
+    }
+
+    bool open(uint16_t src, uint64_t nonce, uint8_t cmd, const uint8_t *tag,
+              uint8_t *buf, size_t len) {
+        uint8_t expected[POLY1305_TAG_SIZE];
+        const uint8_t *ks = _pool.take(src, nonce);
+        mac(ks, cmd, buf, len, expected);
+        _pool.xcrypt(src, nonce, ks, CHACHA_BLOCK, buf, len);
+        return equal(expected, tag, POLY1305_TAG_SIZE);
+    }
+
+private:
+    /**
+     * Authenticates the command and the ciphertext, as the AEAD of
+     * RFC 8439.
+     */
+    static void mac(const uint8_t *key, uint8_t cmd, const uint8_t *buf,
+                    size_t len, uint8_t tag[POLY1305_TAG_SIZE]) {
+        uint8_t lens[16] = { 1 };
+        for(int i = 0; i < 8; i++)
+            lens[8 + i] = (uint8_t) ((uint64_t) len >> (8 * i));
+
+        Poly1305 poly(key);
+        poly.pad(&cmd, 1);
+        poly.pad(buf, len);
+        poly.pad(lens, sizeof(lens));
+        poly.finish(tag);
+    }
+};
+
+#endif //LIBSMOKE_CIPHER_H
@@ -1,21 +1,22 @@
 #ifndef LIBSMOKE_CLIENT_H
 #define LIBSMOKE_CLIENT_H
 
-#include <tiny-AES-c-master/aes.hpp>
 #include <sknx/src/shared/knx/knx.h>
 #include <sknx/src/shared/knx/backend/linux-tcp.h>
+#include <sknx/src/shared/knx/backend/linux-multicast.h>
+#include <sknx/src/shared/knx/backend/linux-shm.h>
+#include <sknx/src/shared/knx/backend/linux-unix.h>
 #include <sknx/src/shared/knx/nodecounter/dummy.h>
 #include <sknx/src/shared/knx/crypto/mka.h>
 #include <sknx/src/shared/knx/pktwrapper.h>
 #include <sknx/src/shared/knx/backend/backend.h>
 #include <sknx/src/shared/knx/debug.h>
 
-/**
- * It's a fixed initialization vector, used to initialize AES
- */
-static const uint8_t iv[16]  = { 0xc0, 0xa1, 0x62, 0xb3, 0x84, 0x25, 0xe6,
-                                    0xc7, 0x58, 0x99, 0xaa, 0x0b, 0x1c, 0x6d, 0xbe, 0xff };
+#include "libsmoke_cipher.h"
+#include "libsmoke_log.h"
 
+/* Keystreams prepared by each receive() that finds nothing to read */
+#define KEYSTREAM_REFILL 4
 
 /**
  * Class of Libsmoke Client.
@@ -23,24 +24,46 @@ static const uint8_t iv[16]  = { 0xc0, 0xa1, 0x62, 0xb3, 0x84, 0x25, 0xe6,
  * @tparam KeyAlgorithm - is the KeyExchange Algorithm needed for SKNX to generate the key.
  * @tparam PORT - is the PORT used by sockets.
  * @tparam numClients - is the #Clients connected.
+ * @tparam Transport - is the SKNX Backend: KNX::LinuxTCP to go through a
+ *                     ServerSmoke, KNX::LinuxMulticast to talk directly on
+ *                     an IP multicast group, KNX::LinuxShm to talk with the
+ *                     nodes of the same host through shared memory
+ *                     (removed from /dev/shm by the last node that
+ *                     leaves, LinuxShm::unlink() for a crashed one),
+ *                     KNX::LinuxUnix to reach a local ServerSmoke through
+ *                     its unix socket.
+ * @tparam Cipher - is how the messages are encrypted, the same for all the
+ *                  nodes (libsmoke_cipher.h): AesCtrCipher (not
+ *                  authenticated), AesGcmCipher for the nodes with AES-NI,
+ *                  ChaChaPolyCipher for the ones without AES instructions.
  */
-template<typename KeyAlgorithm, uint16_t PORT, size_t numClients>
+template<typename KeyAlgorithm, uint16_t PORT, size_t numClients,
+         template<uint16_t> class Transport = KNX::LinuxTCP,
+         class Cipher = AesCtrCipher>
 class ClientSmoke {
 public:
 
     /**
      * Constructor of Libsmoke Client.
      *
-     * @param addr const char* - is a pointer to the IP to which socket client has to connect.
+     * @param addr const char* - is a pointer to the IP to which socket client has to connect,
+     *              the multicast group with KNX::LinuxMulticast, the name of
+     *              the ring with KNX::LinuxShm, the path of the socket with
+     *              KNX::LinuxUnix.
+     * @param group const char* - is the name of the group of the server to join,
+     *              NULL to stay in the default one. With KNX::LinuxMulticast
+     *              it's the IP of the interface joining the multicast group.
+     *              With KNX::LinuxShm it selects the ring of the group.
      */
-    ClientSmoke(const char *addr) :
-            _backend(addr), _pktwrapper(numClients, _backend),
+    ClientSmoke(const char *addr, const char *group = NULL) :
+            _backend(addr, group), _pktwrapper(numClients, _backend),
             _key(_pktwrapper) {}
 
 
     /**
      * Initializes _backend and sknx.
-     * When sknx is ONLINE retrieves the KeyAlgorithm.
+     * When sknx is ONLINE retrieves the KeyAlgorithm, and expands the key
+     * once for all the messages of send() and receive().
      *
      * \return     TRUE - if all initializations are completed successfully and key is retrieved.
      *             FALSE - if there's an error on initialization or key retrieving.
@@ -51,17 +74,17 @@ public:
 
         // Initialize backend
         if (!_backend.init()) {
-            printf("Cannot init TCP connection.");
+            SMOKE_ERROR("Cannot init TCP connection.");
             return false;
         }
 
         // Initialize sknx
         if (!sknx.init()) {
-            printf("Cannot init SKNX.");
+            SMOKE_ERROR("Cannot init SKNX.");
             return false;
         }
 
-        printf("Running....");
+        SMOKE_INFO("Running....");
         // Starts the key exchange
         while ((sknx.status() != KNX::SKNX_ONLINE &&
                 sknx.status() != KNX::SKNX_OFFLINE)) {
@@ -71,15 +94,20 @@ public:
 
         // Check final state
         if (sknx.status() == KNX::SKNX_OFFLINE) {
-            printf("SKNX Error :(");
+            SMOKE_ERROR("SKNX Error :(");
             return false;
         } else if (sknx.status() == KNX::SKNX_ONLINE) {
-            printf("Key exchange completed.\n");
+            SMOKE_INFO("Key exchange completed.");
 
             // retrieve the calculated key
             if (sknx.getKey(_key)) {
                 // used to debug the key
-                Debug::printArray(_key.key(), _key.size());
+                SMOKE_LOG_HEX(SMOKE_LOG_TRACE, "Key", _key.key(), _key.size());
+                // Set once for all the messages of this key
+                if (!_cipher.setKey(_key.key()))
+                    return false;
+                _cipher.reset(KNX::sKConfig.id());
+                _cipher.refill(KEYSTREAM_AHEAD);
                 return true;
             } else {
                 return false;
@@ -90,7 +118,11 @@ public:
 
     /**
      * Uses pktwrapper in order to get the oldest pkt received from other clients.
-     * It decrypts the body using AES_CTR with the shared key of the client.
+     * It decrypts the body using the Cipher with the shared key of the
+     * client and the nonce sent in front of it, that is removed with the
+     * tag. The messages whose tag is wrong are discarded.
+     * When nothing is received, it prepares the keystreams of the next
+     * messages, so call it while idle.
      *
      * @param data KNX::pkt_t& - pointer to a pkt that the method uses to pass the oldest recieved one.
      * @return TRUE - if there is actually a recieved pkt in the queue of pktwrapper.
@@ -98,29 +130,44 @@ public:
      */
     bool receive(KNX::pkt_t &data) {
         _pktwrapper.update();
-        if (_pktwrapper.read(data)) {
-            printf("\nReceived packet\n");
-            Debug::printArray(data.getData().data(), data.getData().size());
+        while (_pktwrapper.read(data)) {
+            SMOKE_LOG_HEX(SMOKE_LOG_TRACE, "Received packet",
+                          data.data.data(), data.data.size());
+            size_t head = NONCE_SIZE + Cipher::TAG_SIZE;
+            if (data.data.size() < head) {
+                SMOKE_ERROR("Message without nonce, discarded.");
+                continue;
+            }
+
+            uint64_t nonce = 0;
+            for (size_t i = 0; i < NONCE_SIZE; i++)
+                nonce = (nonce << 8) | data.data[i];
+            uint8_t *body = data.data.data() + NONCE_SIZE;
+            size_t len = data.data.size() - head;
 
-            // Get data tmp parameters
-            uint8_t *tmpBuff = data.getData().data();
-            uint32_t buffSize = (uint32_t) data.getData().size();
             // Decrypt MSG
-            AES_init_ctx_iv(&_ctx, _key.key(), iv);
-            AES_CTR_xcrypt_buffer(&_ctx, tmpBuff, buffSize);
-            printf("\nDecrypted\n");
-            Debug::printArray(tmpBuff, buffSize);
+            if (!_cipher.open(data.src, nonce, data.cmd, body,
+                              body + Cipher::TAG_SIZE, len)) {
+                SMOKE_ERROR("Message not authentic, discarded.");
+                continue;
+            }
+            data.data.erase(data.data.begin(), data.data.begin() + head);
+            SMOKE_LOG_HEX(SMOKE_LOG_TRACE, "Decrypted",
+                          data.data.data(), data.data.size());
             return true;
-        } else {
-            return false;
         }
+
+        _cipher.refill(KEYSTREAM_REFILL);
+        return false;
     }
 
 
     /**
      * Uses pktwrapper in order to send data (buf), with a specific length (len)
      * and command (cmd), to a specific destination (dest).
-     * It encrypts the body using AES_CTR with the shared key of the client.
+     * It encrypts a copy of the body using the Cipher with the shared key
+     * of the client and a nonce of its own, sent in front of it (NONCE_SIZE
+     * bytes) and followed by the tag.
      *
      * @param dest - the destination of the data.
      * @param cmd - the command to send to the client(s).
@@ -129,18 +176,31 @@ public:
      */
     void send(uint16_t dest, uint8_t cmd, uint8_t *buf,
               uint16_t len) {
-        printf("\nSent MSG\n");
-        Debug::printArray(buf, len);
+        SMOKE_LOG_HEX(SMOKE_LOG_TRACE, "Sent MSG", buf, len);
+        size_t head = NONCE_SIZE + Cipher::TAG_SIZE;
+        if (len > UINT16_MAX - head) {
+            SMOKE_ERROR("Message too long.");
+            return;
+        }
+
+        uint64_t nonce = _cipher.next();
+        _frame.resize(head + len);
+        for (size_t i = 0; i < NONCE_SIZE; i++)
+            _frame[i] = (uint8_t) (nonce >> (8 * (NONCE_SIZE - 1 - i)));
+        memcpy(_frame.data() + head, buf, len);
 
         // Encrypt MSG
-        AES_init_ctx_iv(&_ctx, _key.key(), iv);
-        AES_CTR_xcrypt_buffer(&_ctx, buf, len);
-        printf("\nEncrypted MSG\n");
-        Debug::printArray(buf, len);
+        _cipher.seal(KNX::sKConfig.id(), nonce, cmd, _frame.data() + NONCE_SIZE,
+                     _frame.data() + head, len);
+        SMOKE_LOG_HEX(SMOKE_LOG_TRACE, "Encrypted MSG",
+                      _frame.data(), _frame.size());
 
         // Send MSG
-        _pktwrapper.write(dest, cmd, buf, len);
+        _pktwrapper.write(dest, cmd, _frame.data(),
+                          (uint16_t) _frame.size());
         _pktwrapper.update();
+        // Already sent: replace the keystream just used
+        _cipher.refill(1);
     }
 
 private:
@@ -153,13 +213,18 @@ private:
      */
     KeyAlgorithm _key;
     /**
-     * Used to save locally the LinuxTCP backend connection used to communicate.
+     * Used to save locally the backend connection used to communicate.
+     */
+    Transport<PORT> _backend;
+    /**
+     * Used to save locally the Cipher, with the shared key set by init(),
+     * and to prepare the keystreams of the next messages.
      */
-    KNX::LinuxTCP<PORT> _backend;
+    Cipher _cipher;
     /**
-     * Used to save locally an instance of AES.
+     * Used to build the messages sent.
      */
-    struct AES_ctx _ctx;
+    std::vector<uint8_t> _frame;
 };
 
 #endif //LIBSMOKE_CLIENT_H
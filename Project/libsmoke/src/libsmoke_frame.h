@@ -0,0 +1,189 @@
+#ifndef LIBSMOKE_FRAME_H
+#define LIBSMOKE_FRAME_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include <sknx/src/shared/knx/telegram.h>
+
+#include "libsmoke_link.h"
+
+#define FRAMES_PER_SLAB 256
+/* A telegram, with the header used by the links between servers */
+#define FRAME_MAX (KNX::tg_size::max + LINK_HDR_MAX)
+
+class FramePool;
+
+/**
+ * Refcounted buffer holding a single KNX telegram received by the server
+ * (or its encoding for the links to the other servers).
+ * It's stored once and referenced by the outbound queue of every recipient,
+ * so the payload is never copied per client.
+ */
+struct Frame {
+    std::atomic<uint32_t> refs;
+    uint16_t len;
+    /**
+     * KNX::telegram::level of the data, used to choose what to shed first.
+     */
+    uint8_t priority;
+    /**
+     * Source and destination addresses of the telegram.
+     */
+    uint16_t src;
+    uint16_t dest;
+    /**
+     * TRUE if the telegram is addressed to a single node.
+     */
+    bool unicast;
+    /**
+     * Id of the group of the sender, only its members get the telegram.
+     */
+    uint16_t group;
+    /**
+     * Connection the telegram comes from, never used as a recipient.
+     */
+    const void *origin;
+    /**
+     * Server the telegram comes from, and the servers it can still cross
+     * after the next one: -1 if it must not be sent to any link.
+     */
+    uint32_t server;
+    int8_t hops;
+    /**
+     * When the telegram has been received (monotonicUs()), and TRUE once
+     * it has been completely sent to at least one client.
+     */
+    uint64_t rxTime;
+    std::atomic<bool> delivered;
+    /**
+     * Pool the frame is returned to when the last reference is dropped.
+     */
+    FramePool *pool;
+    /**
+     * Used to link the frame inside the free lists of the pool.
+     */
+    Frame *next;
+    uint8_t data[FRAME_MAX];
+
+    /**
+     * Adds n references to the frame.
+     */
+    void ref(uint32_t n = 1) {
+        refs.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    /**
+     * Drops a reference. The last one gives back the frame to its pool.
+     * Can be called by any thread.
+     *
+     * @return TRUE - if it was the last reference.
+     */
+    inline bool unref();
+};
+
+/**
+ * Slab allocator of Frames.
+ * Only the owner thread can call alloc(), while frames can be released by
+ * any thread: they're pushed on a lock-free stack that the owner takes as
+ * a whole (so there's no ABA problem) when its private free list is empty.
+ */
+class FramePool {
+public:
+
+    /**
+     * Constructor of the pool. No slab is allocated until it's needed.
+     */
+    FramePool() : _free(nullptr), _returned(nullptr) {}
+
+
+    /**
+     * Destructor of the pool. All the frames must have been released.
+     */
+    ~FramePool() {
+        for(Frame *slab : _slabs)
+            delete[] slab;
+    }
+
+
+    /**
+     * Gets an unused frame, with a single reference owned by the caller.
+     * Must be called only by the owner thread.
+     *
+     * @return the new frame.
+     */
+    Frame *alloc() {
+        if(_free == nullptr)
+            _free = _returned.exchange(nullptr, std::memory_order_acquire);
+
+        if(_free == nullptr)
+            grow();
+
+        Frame *f = _free;
+        _free = f->next;
+        f->refs.store(1, std::memory_order_relaxed);
+        f->len = 0;
+        f->priority = 0;
+        f->src = f->dest = 0;
+        f->unicast = false;
+        f->group = 0;
+        f->origin = nullptr;
+        f->server = 0;
+        f->hops = -1;
+        f->rxTime = 0;
+        f->delivered.store(false, std::memory_order_relaxed);
+        return f;
+    }
+
+
+    /**
+     * Gives back a frame to the pool. Can be called by any thread.
+     *
+     * @param f - the frame with no more references.
+     */
+    void recycle(Frame *f) {
+        Frame *head = _returned.load(std::memory_order_relaxed);
+        do {
+            f->next = head;
+        } while(!_returned.compare_exchange_weak(head, f,
+                                                 std::memory_order_release,
+                                                 std::memory_order_relaxed));
+    }
+
+private:
+    /**
+     * Allocates a new slab and links all its frames in the free list.
+     */
+    void grow() {
+        Frame *slab = new Frame[FRAMES_PER_SLAB];
+        _slabs.push_back(slab);
+        for(size_t i = 0; i < FRAMES_PER_SLAB; i++) {
+            slab[i].pool = this;
+            slab[i].next = _free;
+            _free = &slab[i];
+        }
+    }
+
+    /**
+     * Used to save the free frames, only touched by the owner.
+     */
+    Frame *_free;
+    /**
+     * Used to save the frames released by any thread.
+     */
+    std::atomic<Frame *> _returned;
+    /**
+     * Used to save all the slabs allocated by the pool.
+     */
+    std::vector<Frame *> _slabs;
+};
+
+bool Frame::unref() {
+    if(refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return false;
+    pool->recycle(this);
+    return true;
+}
+
+#endif //LIBSMOKE_FRAME_H
@@ -0,0 +1,359 @@
+#ifndef LIBSMOKE_GCM_H
+#define LIBSMOKE_GCM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "libsmoke_aes.h"
+
+/* Bytes of the tag of a message encrypted with AES-GCM */
+#define GCM_TAG_SIZE 16
+/* Blocks hashed together by PCLMULQDQ: their products are summed and
+ * reduced once, with the powers of H up to this one */
+#define GHASH_AGGREGATE 4
+
+/**
+ * GHASH, the authentication of AES-GCM (NIST SP 800-38D): a polynomial of
+ * the blocks of the message evaluated in GF(2^128) at H, the encryption of
+ * the zero block. Counter mode is left to AesCtr, so a GCM message is:
+ * the keystream from the counter block 2 (IV || 2, with a 96 bits IV)
+ * xored to the message, and the tag E(IV || 1) xored to the hash of the
+ * additional data and of the ciphertext.
+ * With PCLMULQDQ (checked with CPUID) each block is a carry-less multiply,
+ * otherwise the 4 bits tables of Shoup (the ones of PolarSSL) are used.
+ */
+class Ghash {
+public:
+
+    /**
+     * Constructor of the hash, no key is set.
+     *
+     * @param hardware - FALSE to always use the portable code.
+     */
+    explicit Ghash(bool hardware = true) :
+            _hw(hardware && supported()) {
+        clear();
+    }
+
+    Ghash(const Ghash &) = delete;
+    Ghash &operator=(const Ghash &) = delete;
+
+    ~Ghash() {
+        clear();
+    }
+
+
+    /**
+     * Checks if the CPU has the PCLMULQDQ instruction.
+     */
+    static bool supported() {
+#ifdef SMOKE_HAVE_AESNI
+        static const bool clmul = __builtin_cpu_supports("pclmul") &&
+                                  __builtin_cpu_supports("sse4.1");
+        return clmul;
+#else
+        return false;
+#endif
+    }
+
+
+    /**
+     * Checks if the hash uses PCLMULQDQ.
+     */
+    bool hardware() const {
+        return _hw;
+    }
+
+
+    /**
+     * Computes H, and the tables (or the powers of H) of the key.
+     *
+     * @param aes - the engine, with the key set.
+     */
+    void setKey(AesCtr &aes) {
+        uint8_t h[AES_CTR_BLOCK] = { 0 };
+        uint8_t zero[AES_CTR_BLOCK] = { 0 };
+        aes.xcrypt(zero, h, sizeof(h));
+
+        uint64_t vh = load64(h);
+        uint64_t vl = load64(h + 8);
+#ifdef SMOKE_HAVE_AESNI
+        if(_hw) {
+            powers(vh, vl);
+            memset(h, 0, sizeof(h));
+            return;
+        }
+#endif
+        // HL/HH[i] = H * i, with the bits of i reversed
+        _hl[8] = vl;
+        _hh[8] = vh;
+        _hl[0] = _hh[0] = 0;
+        for(int i = 4; i > 0; i >>= 1) {
+            uint64_t t = (vl & 1) * 0xe100000000000000ULL;
+            vl = (vh << 63) | (vl >> 1);
+            vh = (vh >> 1) ^ t;
+            _hl[i] = vl;
+            _hh[i] = vh;
+        }
+        for(int i = 2; i < 16; i <<= 1) {
+            for(int j = 1; j < i; j++) {
+                _hh[i + j] = _hh[i] ^ _hh[j];
+                _hl[i + j] = _hl[i] ^ _hl[j];
+            }
+        }
+        memset(h, 0, sizeof(h));
+    }
+
+
+    /**
+     * Hashes the additional data and the ciphertext of a message, both
+     * padded to a block, followed by their lengths in bits.
+     *
+     * @param aad - the additional data, authenticated but not encrypted.
+     * @param aadLen - the length of the additional data (can be also 0).
+     * @param buf - the ciphertext.
+     * @param len - the length of the ciphertext (can be also 0).
+     * @param out - the hash, to be xored with E(IV || 1) to get the tag.
+     */
+    void digest(const uint8_t *aad, size_t aadLen, const uint8_t *buf,
+                size_t len, uint8_t out[AES_CTR_BLOCK]) const {
+#ifdef SMOKE_HAVE_AESNI
+        if(_hw) {
+            digestClmul(aad, aadLen, buf, len, out);
+            return;
+        }
+#endif
+        uint8_t lens[AES_CTR_BLOCK];
+        store64(lens, (uint64_t) aadLen * 8);
+        store64(lens + 8, (uint64_t) len * 8);
+        memset(out, 0, AES_CTR_BLOCK);
+        absorb(out, aad, aadLen);
+        absorb(out, buf, len);
+        absorb(out, lens, sizeof(lens));
+    }
+
+private:
+    static uint64_t load64(const uint8_t *p) {
+        uint64_t v = 0;
+        for(int i = 0; i < 8; i++)
+            v = (v << 8) | p[i];
+        return v;
+    }
+
+    static void store64(uint8_t *p, uint64_t v) {
+        for(int i = 0; i < 8; i++)
+            p[i] = (uint8_t) (v >> (56 - 8 * i));
+    }
+
+    void clear() {
+        memset(_hl, 0, sizeof(_hl));
+        memset(_hh, 0, sizeof(_hh));
+        memset(_hp, 0, sizeof(_hp));
+    }
+
+    /**
+     * Portable: x = (x ^ block) * H for each block, the last one padded.
+     */
+    void absorb(uint8_t x[AES_CTR_BLOCK], const uint8_t *buf,
+                size_t len) const {
+        for(size_t off = 0; off < len; off += AES_CTR_BLOCK) {
+            size_t n = len - off < AES_CTR_BLOCK ? len - off : AES_CTR_BLOCK;
+            for(size_t i = 0; i < n; i++)
+                x[i] ^= buf[off + i];
+            mult(x);
+        }
+    }
+
+    /**
+     * Portable: x = x * H, 4 bits at a time starting from the last ones.
+     */
+    void mult(uint8_t x[AES_CTR_BLOCK]) const {
+        static const uint64_t last4[16] = {
+            0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+            0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0 };
+
+        uint8_t lo = x[15] & 0xf;
+        uint64_t zh = _hh[lo];
+        uint64_t zl = _hl[lo];
+        for(int i = 15; i >= 0; i--) {
+            lo = x[i] & 0xf;
+            uint8_t hi = x[i] >> 4;
+            uint8_t rem;
+            if(i != 15) {
+                rem = (uint8_t) (zl & 0xf);
+                zl = (zh << 60) | (zl >> 4);
+                zh = (zh >> 4) ^ (last4[rem] << 48);
+                zh ^= _hh[lo];
+                zl ^= _hl[lo];
+            }
+            rem = (uint8_t) (zl & 0xf);
+            zl = (zh << 60) | (zl >> 4);
+            zh = (zh >> 4) ^ (last4[rem] << 48);
+            zh ^= _hh[hi];
+            zl ^= _hl[hi];
+        }
+        store64(x, zh);
+        store64(x + 8, zl);
+    }
+
+#ifdef SMOKE_HAVE_AESNI
+    /**
+     * Gets a block with its bytes reversed, as PCLMULQDQ wants it.
+     */
+    __attribute__((target("pclmul,sse4.1")))
+    static __m128i reflect(__m128i b) {
+        return _mm_shuffle_epi8(b, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8,
+                                                9, 10, 11, 12, 13, 14, 15));
+    }
+
+    /**
+     * Loads the last n (< 16) bytes of a buffer padded with zeros. Built
+     * inside the registers: a block copied on the stack and loaded would
+     * wait for the bytes stored (no store forwarding).
+     */
+    __attribute__((target("pclmul,sse4.1")))
+    static __m128i partial(const uint8_t *p, size_t n) {
+        uint64_t lo = 0;
+        uint64_t hi = 0;
+        for(size_t i = n; i > 8; i--)
+            hi = (hi << 8) | p[i - 1];
+        for(size_t i = n < 8 ? n : 8; i > 0; i--)
+            lo = (lo << 8) | p[i - 1];
+        return _mm_set_epi64x((long long) hi, (long long) lo);
+    }
+
+    /**
+     * Adds the 256 bits product a * b (not reduced) to lo and hi.
+     */
+    __attribute__((target("pclmul,sse4.1")))
+    static void clmul(__m128i a, __m128i b, __m128i &lo, __m128i &hi) {
+        __m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10),
+                                    _mm_clmulepi64_si128(a, b, 0x01));
+        lo = _mm_xor_si128(lo, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x00),
+                                             _mm_slli_si128(mid, 8)));
+        hi = _mm_xor_si128(hi, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x11),
+                                             _mm_srli_si128(mid, 8)));
+    }
+
+    /**
+     * Reduces a product modulo x^128 + x^7 + x^2 + x + 1. The bits are
+     * reflected, so the product is shifted left by one first.
+     */
+    __attribute__((target("pclmul,sse4.1")))
+    static __m128i reduce(__m128i lo, __m128i hi) {
+        __m128i carryLo = _mm_srli_epi32(lo, 31);
+        __m128i carryHi = _mm_srli_epi32(hi, 31);
+        lo = _mm_slli_epi32(lo, 1);
+        hi = _mm_slli_epi32(hi, 1);
+        __m128i cross = _mm_srli_si128(carryLo, 12);
+        lo = _mm_or_si128(lo, _mm_slli_si128(carryLo, 4));
+        hi = _mm_or_si128(hi, _mm_slli_si128(carryHi, 4));
+        hi = _mm_or_si128(hi, cross);
+
+        __m128i t = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31),
+                                                _mm_slli_epi32(lo, 30)),
+                                  _mm_slli_epi32(lo, 25));
+        __m128i rest = _mm_srli_si128(t, 4);
+        lo = _mm_xor_si128(lo, _mm_slli_si128(t, 12));
+        __m128i u = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1),
+                                                _mm_srli_epi32(lo, 2)),
+                                  _mm_srli_epi32(lo, 7));
+        u = _mm_xor_si128(u, rest);
+        return _mm_xor_si128(hi, _mm_xor_si128(lo, u));
+    }
+
+    __attribute__((target("pclmul,sse4.1")))
+    static __m128i gfmul(__m128i a, __m128i b) {
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+        clmul(a, b, lo, hi);
+        return reduce(lo, hi);
+    }
+
+    /**
+     * Saves H, H^2 ... H^GHASH_AGGREGATE (reflected).
+     */
+    __attribute__((target("pclmul,sse4.1")))
+    void powers(uint64_t vh, uint64_t vl) {
+        __m128i h = _mm_set_epi64x((long long) vh, (long long) vl);
+        __m128i p = h;
+        for(int i = 0; i < GHASH_AGGREGATE; i++) {
+            _mm_storeu_si128((__m128i *) _hp[i], p);
+            p = gfmul(p, h);
+        }
+    }
+
+    /**
+     * Hashes m blocks: x = (x ^ b0) * H^m ^ b1 * H^(m-1) ... ^ bm-1 * H,
+     * the products are independent and reduced once.
+     */
+    __attribute__((target("pclmul,sse4.1")))
+    static __m128i fold(__m128i x, const __m128i *b, int m,
+                        const __m128i *hp) {
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+        clmul(_mm_xor_si128(b[0], x), hp[m - 1], lo, hi);
+        for(int i = 1; i < m; i++)
+            clmul(b[i], hp[m - 1 - i], lo, hi);
+        return reduce(lo, hi);
+    }
+
+    /**
+     * The blocks of the additional data, of the ciphertext and of the
+     * lengths are folded together, GHASH_AGGREGATE at a time: a telegram
+     * is a single fold.
+     */
+    __attribute__((target("pclmul,sse4.1")))
+    void digestClmul(const uint8_t *aad, size_t aadLen, const uint8_t *buf,
+                     size_t len, uint8_t out[AES_CTR_BLOCK]) const {
+        const uint8_t *data[2] = { aad, buf };
+        const size_t size[2] = { aadLen, len };
+        __m128i hp[GHASH_AGGREGATE];
+        for(int i = 0; i < GHASH_AGGREGATE; i++)
+            hp[i] = _mm_loadu_si128((const __m128i *) _hp[i]);
+
+        __m128i x = _mm_setzero_si128();
+        __m128i b[GHASH_AGGREGATE];
+        int m = 0;
+        for(int s = 0; s < 2; s++) {
+            const uint8_t *p = data[s];
+            size_t off = 0;
+            for(; off + AES_CTR_BLOCK <= size[s]; off += AES_CTR_BLOCK) {
+                b[m++] = reflect(_mm_loadu_si128((const __m128i *) (p + off)));
+                if(m == GHASH_AGGREGATE) {
+                    x = fold(x, b, m, hp);
+                    m = 0;
+                }
+            }
+            if(off < size[s]) {
+                b[m++] = reflect(partial(p + off, size[s] - off));
+                if(m == GHASH_AGGREGATE) {
+                    x = fold(x, b, m, hp);
+                    m = 0;
+                }
+            }
+        }
+        // The lengths in bits, already reflected
+        b[m++] = _mm_set_epi64x((long long) aadLen * 8, (long long) len * 8);
+        x = fold(x, b, m, hp);
+        _mm_storeu_si128((__m128i *) out, reflect(x));
+    }
+#endif
+
+    /**
+     * Used to save the tables of the portable code.
+     */
+    uint64_t _hl[16];
+    uint64_t _hh[16];
+    /**
+     * Used to save the powers of H used with PCLMULQDQ.
+     */
+    uint64_t _hp[GHASH_AGGREGATE][2];
+    /**
+     * Used to check if PCLMULQDQ is used.
+     */
+    const bool _hw;
+};
+
+#endif //LIBSMOKE_GCM_H
@@ -0,0 +1,173 @@
+#ifndef LIBSMOKE_GROUP_H
+#define LIBSMOKE_GROUP_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "libsmoke_history.h"
+
+#define MAX_GROUPS 4096
+#define MAX_REACTORS 64
+
+/**
+ * Table telling which reactor owns each KNX address of a group.
+ * It's learned from the source addresses of the received telegrams and
+ * read by every reactor without locks.
+ */
+class RouteTable {
+public:
+
+    /**
+     * Constructor of the table. No address is owned by any shard.
+     */
+    RouteTable() {
+        for(std::atomic<int8_t> &o : _owner)
+            o.store(-1, std::memory_order_relaxed);
+    }
+
+
+    /**
+     * Gets the shard owning an address.
+     *
+     * @param addr - the KNX address.
+     * @return the id of the reactor, -1 if the address is unknown.
+     */
+    int owner(uint16_t addr) const {
+        return _owner[addr].load(std::memory_order_relaxed);
+    }
+
+
+    /**
+     * Sets the shard owning an address.
+     */
+    void learn(uint16_t addr, int shard) {
+        _owner[addr].store((int8_t) shard, std::memory_order_relaxed);
+    }
+
+
+    /**
+     * Forgets an address, if it's still owned by the given shard.
+     */
+    void forget(uint16_t addr, int shard) {
+        int8_t expected = (int8_t) shard;
+        _owner[addr].compare_exchange_strong(expected, -1,
+                                             std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<int8_t> _owner[65536];
+};
+
+/**
+ * Broadcast domain of the server. Telegrams sent by a member reach only
+ * the other members of the same group.
+ */
+struct Group {
+    uint16_t id;
+    std::string name;
+    /**
+     * Bitmap of the reactors having at least one member of the group.
+     */
+    std::atomic<uint64_t> shards;
+    /**
+     * Addresses owned by each reactor, NULL if there's a single reactor.
+     */
+    RouteTable *routes;
+    /**
+     * Recent telegrams of the group, NULL if the History is disabled.
+     */
+    HistoryRing *history;
+
+    Group(uint16_t i, const std::string &n, bool shared, const History &h) :
+            id(i), name(n), shards(0),
+            routes(shared ? new RouteTable() : NULL),
+            history(h.enabled() ? new HistoryRing(h) : NULL) {}
+
+    ~Group() {
+        delete routes;
+        delete history;
+    }
+};
+
+/**
+ * Registry of the groups of the server, shared by all the reactors.
+ * Groups are created the first time a client joins them and live until
+ * the table is destroyed. Only join() takes a lock, so it's never used
+ * while broadcasting.
+ */
+class GroupTable {
+public:
+
+    /**
+     * Constructor of the table. Creates the default group (id 0, empty
+     * name), joined by the clients that don't ask for a group.
+     *
+     * @param shared - TRUE if the groups are shared by more reactors.
+     * @param history - the recent telegrams kept for each group.
+     */
+    GroupTable(bool shared, const History &history) :
+            _shared(shared), _history(history), _count(0) {
+        for(std::atomic<Group *> &g : _groups)
+            g.store(NULL, std::memory_order_relaxed);
+        join("", 0);
+    }
+
+
+    /**
+     * Destructor of the table. Deletes all the groups.
+     */
+    ~GroupTable() {
+        for(size_t i = 0; i < _count; i++)
+            delete _groups[i].load(std::memory_order_relaxed);
+    }
+
+
+    /**
+     * Gets a group by name, creating it if it doesn't exist.
+     * Can be called by any thread.
+     *
+     * @param name - the name of the group (not NULL terminated).
+     * @param len - the length of the name.
+     * @return the group, NULL if there are already MAX_GROUPS groups.
+     */
+    Group *join(const char *name, size_t len) {
+        std::string key(name, len);
+        std::lock_guard<std::mutex> l(_lock);
+
+        auto it = _byName.find(key);
+        if(it != _byName.end())
+            return it->second;
+
+        if(_count == MAX_GROUPS)
+            return NULL;
+
+        Group *g = new Group((uint16_t) _count, key, _shared, _history);
+        _byName[key] = g;
+        _groups[_count++].store(g, std::memory_order_release);
+        return g;
+    }
+
+
+    /**
+     * Gets a group by id. Can be called by any thread.
+     *
+     * @param id - the id of an existing group.
+     * @return the group.
+     */
+    Group *get(uint16_t id) const {
+        return _groups[id].load(std::memory_order_acquire);
+    }
+
+private:
+    const bool _shared;
+    const History _history;
+    std::mutex _lock;
+    std::unordered_map<std::string, Group *> _byName;
+    std::atomic<Group *> _groups[MAX_GROUPS];
+    size_t _count;
+};
+
+#endif //LIBSMOKE_GROUP_H
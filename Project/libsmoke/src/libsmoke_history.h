@@ -0,0 +1,121 @@
+#ifndef LIBSMOKE_HISTORY_H
+#define LIBSMOKE_HISTORY_H
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include <sknx/src/shared/knx/telegram.h>
+
+#define HISTORY_TELEGRAMS 64
+
+/**
+ * Recent telegrams kept by the server for each group, so a client that
+ * (re)connects can ask for them instead of waiting for the other members
+ * to send their state again. Only the telegrams that reach the whole
+ * group are kept, not the ones addressed to a single node.
+ * Disabled (0 telegrams) by default.
+ */
+struct History {
+    /**
+     * Telegrams kept for each group, the oldest are overwritten.
+     */
+    size_t telegrams;
+    /**
+     * Telegrams older than this are not sent anymore, 0 for no limit.
+     */
+    uint32_t maxAgeMs;
+
+    History() : telegrams(0), maxAgeMs(0) {}
+
+    /**
+     * Checks if the telegrams are kept.
+     */
+    bool enabled() const {
+        return telegrams > 0;
+    }
+};
+
+/**
+ * A telegram inside a HistoryRing.
+ */
+struct HistoryEntry {
+    uint64_t time;
+    uint8_t len;
+    uint8_t data[KNX::tg_size::max];
+};
+
+/**
+ * Bounded history of a group, written by the reactor receiving each
+ * telegram and read by the one serving a catch-up. The lock is held only
+ * to copy a telegram in or the entries out, never while sending.
+ */
+class HistoryRing {
+public:
+
+    /**
+     * Constructor of the ring. All the memory is allocated here.
+     *
+     * @param h - #Telegrams kept and their max age.
+     */
+    explicit HistoryRing(const History &h) :
+            _entries(h.telegrams > 0 ? h.telegrams : 1),
+            _maxAgeUs(h.maxAgeMs * 1000ULL), _next(0), _count(0) {}
+
+
+    /**
+     * Adds a telegram, overwriting the oldest one if the ring is full.
+     * Can be called by any thread.
+     *
+     * @param raw - the telegram.
+     * @param len - the length of the telegram.
+     * @param now - when the telegram has been received (monotonicUs()).
+     */
+    void push(const uint8_t *raw, uint8_t len, uint64_t now) {
+        if(len > KNX::tg_size::max)
+            return;
+
+        std::lock_guard<std::mutex> l(_lock);
+        HistoryEntry &e = _entries[_next];
+        e.time = now;
+        e.len = len;
+        memcpy(e.data, raw, len);
+        _next = (_next + 1) % _entries.size();
+        if(_count < _entries.size())
+            _count++;
+    }
+
+
+    /**
+     * Copies the telegrams not older than the max age, oldest first.
+     * Can be called by any thread.
+     *
+     * @param out - where to copy them, cleared first.
+     * @param now - the current time (monotonicUs()).
+     */
+    void snapshot(std::vector<HistoryEntry> &out, uint64_t now) {
+        uint64_t since = (_maxAgeUs > 0 && now > _maxAgeUs) ?
+                         now - _maxAgeUs : 0;
+        out.clear();
+        std::lock_guard<std::mutex> l(_lock);
+        size_t first = (_next + _entries.size() - _count) % _entries.size();
+        for(size_t i = 0; i < _count; i++) {
+            const HistoryEntry &e = _entries[(first + i) % _entries.size()];
+            if(e.time >= since)
+                out.push_back(e);
+        }
+    }
+
+private:
+    std::mutex _lock;
+    std::vector<HistoryEntry> _entries;
+    const uint64_t _maxAgeUs;
+    /**
+     * Position of the next telegram, and #Telegrams inside the ring.
+     */
+    size_t _next;
+    size_t _count;
+};
+
+#endif //LIBSMOKE_HISTORY_H
@@ -0,0 +1,209 @@
+#ifndef LIBSMOKE_KEYSTREAM_H
+#define LIBSMOKE_KEYSTREAM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+
+/* Bytes of the nonce (the counter of the sender) in front of every
+ * encrypted message */
+#define NONCE_SIZE 8
+/* Keystream prepared for each message, the rest (if any) is computed
+ * when it's used. A multiple of the block of the cipher. */
+#define KEYSTREAM_BYTES 64
+/* Messages of this node whose keystream is prepared in advance */
+#define KEYSTREAM_AHEAD 16
+
+/**
+ * Keystreams of the messages about to be sent or received, prepared
+ * while the node is idle so encrypting or decrypting a message is a
+ * single XOR.
+ * Every message is encrypted with its own 96 bits nonce, so no keystream
+ * is ever used twice with the same key: the id of the sender and a
+ * counter of its messages (the nonce, sent with the message). The
+ * counters restart from 0 with every key.
+ * Not thread-safe, it belongs to a single client.
+ *
+ * @tparam Stream - the cipher: AesCtr (whose counter blocks are the ones
+ *                  of AES-GCM) or ChaCha20, with BLOCK and
+ *                  xcrypt(nonce, block, buf, len).
+ * @tparam BYTES - the keystream prepared for each message.
+ */
+template<class Stream, size_t BYTES = KEYSTREAM_BYTES>
+class KeystreamPool {
+    static_assert(BYTES % Stream::BLOCK == 0,
+                  "The keystream prepared must be made of whole blocks");
+public:
+
+    /**
+     * Constructor of the pool, empty until reset().
+     *
+     * @param stream - the cipher, with the key set.
+     * @param first - the counter of the first block of each keystream.
+     */
+    explicit KeystreamPool(Stream &stream, uint32_t first = 0) :
+            _stream(stream), _first(first), _self(0), _next(0) {}
+
+
+    /**
+     * Drops every keystream, to be called when the key changes.
+     *
+     * @param self - the id of this node.
+     */
+    void reset(uint16_t self) {
+        _self = self;
+        _next = 0;
+        for(Slot &s : _ahead)
+            s.ready = false;
+        _peers.clear();
+    }
+
+
+    /**
+     * Gets the nonce of the next message sent by this node.
+     */
+    uint64_t next() {
+        return _next++;
+    }
+
+
+    /**
+     * Gets the first BYTES bytes of the keystream of a message, the ones
+     * already prepared if there are, and releases them.
+     *
+     * @param src - the id of the sender.
+     * @param nonce - the nonce of the message.
+     * @return the keystream, valid until the next take() or refill().
+     */
+    const uint8_t *take(uint16_t src, uint64_t nonce) {
+        Slot *s = src == _self ? &_ahead[nonce % KEYSTREAM_AHEAD]
+                               : &_peers[src];
+        if(!s->ready || s->nonce != nonce) {
+            s->nonce = nonce;
+            prepare(*s, src);
+        }
+
+        s->ready = false;
+        // The next message of a peer is expected to follow this one
+        if(src != _self)
+            s->nonce = nonce + 1;
+        return s->ks;
+    }
+
+
+    /**
+     * Encrypts (or decrypts) a part of a message in place.
+     *
+     * @param src - the id of the sender.
+     * @param nonce - the nonce of the message.
+     * @param ks - the keystream got by take().
+     * @param from - the offset of the part inside the keystream, a
+     *               multiple of the block when it's past BYTES.
+     * @param buf - the part.
+     * @param len - the length of the part.
+     */
+    void xcrypt(uint16_t src, uint64_t nonce, const uint8_t *ks, size_t from,
+                uint8_t *buf, size_t len) {
+        size_t done = 0;
+        if(from < BYTES) {
+            done = len < BYTES - from ? len : BYTES - from;
+            for(size_t i = 0; i < done; i++)
+                buf[i] ^= ks[from + i];
+        }
+        if(done < len) {
+            uint8_t iv[12];
+            counter(iv, src, nonce);
+            uint32_t block = (uint32_t) ((from + done) / Stream::BLOCK);
+            _stream.xcrypt(iv, _first + block, buf + done, len - done);
+        }
+    }
+
+
+    /**
+     * Encrypts (or decrypts) a message in place, with the keystream
+     * already prepared if there's one.
+     *
+     * @param src - the id of the sender.
+     * @param nonce - the nonce of the message.
+     * @param buf - the message.
+     * @param len - the length of the message.
+     */
+    void xcrypt(uint16_t src, uint64_t nonce, uint8_t *buf, size_t len) {
+        xcrypt(src, nonce, take(src, nonce), 0, buf, len);
+    }
+
+
+    /**
+     * Prepares some keystreams: the ones of the next messages of this node
+     * first, then the ones of the next message of each peer.
+     *
+     * @param max - max #Keystreams prepared by this call.
+     * @return #Keystreams prepared.
+     */
+    size_t refill(size_t max) {
+        size_t n = 0;
+        for(uint64_t c = _next; c < _next + KEYSTREAM_AHEAD && n < max; c++) {
+            Slot &s = _ahead[c % KEYSTREAM_AHEAD];
+            if(s.ready && s.nonce == c)
+                continue;
+            s.nonce = c;
+            prepare(s, _self);
+            n++;
+        }
+        for(auto it = _peers.begin(); it != _peers.end() && n < max; ++it) {
+            if(it->second.ready)
+                continue;
+            prepare(it->second, it->first);
+            n++;
+        }
+        return n;
+    }
+
+private:
+    struct Slot {
+        uint64_t nonce;
+        bool ready;
+        uint8_t ks[BYTES];
+
+        Slot() : nonce(0), ready(false) {}
+    };
+
+    /**
+     * Builds the nonce of the cipher: the sender and its counter.
+     */
+    static void counter(uint8_t iv[12], uint16_t src, uint64_t nonce) {
+        iv[0] = (uint8_t) (src >> 8);
+        iv[1] = (uint8_t) src;
+        for(int i = 0; i < 8; i++)
+            iv[2 + i] = (uint8_t) (nonce >> (56 - 8 * i));
+        iv[10] = iv[11] = 0;
+    }
+
+    void prepare(Slot &s, uint16_t src) {
+        uint8_t iv[12];
+        counter(iv, src, s.nonce);
+        memset(s.ks, 0, sizeof(s.ks));
+        _stream.xcrypt(iv, _first, s.ks, sizeof(s.ks));
+        s.ready = true;
+    }
+
+    /**
+     * Used to encrypt the keystreams, from the block _first.
+     */
+    Stream &_stream;
+    const uint32_t _first;
+    /**
+     * Used to save the id of this node and the nonce of its next message.
+     */
+    uint16_t _self;
+    uint64_t _next;
+    /**
+     * Used to save the keystreams of the next messages of this node, and
+     * of the next message of each peer.
+     */
+    Slot _ahead[KEYSTREAM_AHEAD];
+    std::unordered_map<uint16_t, Slot> _peers;
+};
+
+#endif //LIBSMOKE_KEYSTREAM_H
@@ -0,0 +1,142 @@
+#ifndef LIBSMOKE_LINK_H
+#define LIBSMOKE_LINK_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <sknx/src/shared/knx/telegram.h>
+#include <sknx/src/shared/knx/backend/linux-tcp.h>
+
+/**
+ * Wire format of the links between federated servers, carried by a plain
+ * TCP connection to the port of the clients. Like TCP_JOIN_MAGIC, the
+ * magic bytes are not valid ctrl bytes, so they can't be confused with a
+ * telegram.
+ *
+ * Hello, sent by both ends as soon as they know it's a link:
+ *     LINK_HELLO_MAGIC, server id (4 bytes, big endian), secret
+ *     (LINK_SECRET_SIZE bytes)
+ * A connection becomes a link only after a hello carrying the secret of
+ * this server, and it's dropped otherwise: a client can't get the
+ * telegrams of all the groups, nor forge their origin. The secret is
+ * sent in clear like the telegrams, so the links belong to a trusted
+ * network.
+ * Every telegram:
+ *     LINK_FRAME_MAGIC, id of the origin server (4 bytes, big endian),
+ *     hops left, group name length, group name, telegram
+ */
+#define LINK_HELLO_MAGIC 0x50
+#define LINK_FRAME_MAGIC 0x51
+#define LINK_SECRET_SIZE 32
+#define LINK_HELLO_SIZE (5 + LINK_SECRET_SIZE)
+#define LINK_HDR_MAX (7 + TCP_GROUP_NAME_MAX)
+/* Max hops that can be set, the whole budget fits inside a byte */
+#define LINK_MAX_HOPS 15
+/* Delay between the attempts to connect to a peer server */
+#define LINK_RETRY_US 1000000
+
+/**
+ * State of the federation shared by the reactors of a server.
+ */
+struct Federation {
+    /**
+     * Random id of the server, used to drop the telegrams coming back.
+     */
+    uint32_t id;
+    /**
+     * Servers a telegram can cross after the first one: 0 for a full mesh
+     * of servers, otherwise its diameter - 1 (loops are cut only by this
+     * budget and by the origin id, so the topology should be a tree).
+     */
+    uint8_t hops;
+    /**
+     * Bitmap of the reactors having at least one link.
+     */
+    std::atomic<uint64_t> shards;
+    /**
+     * Secret of the hellos, zero padded, and TRUE if it has been set:
+     * without one no link is accepted.
+     */
+    uint8_t secret[LINK_SECRET_SIZE];
+    bool secured;
+
+    Federation() : id(0), hops(0), shards(0), secured(false) {
+        memset(secret, 0, sizeof(secret));
+    }
+};
+
+/**
+ * Writes a server id, big endian, after a magic byte.
+ */
+static inline void linkId(uint8_t *out, uint8_t magic, uint32_t id) {
+    out[0] = magic;
+    out[1] = (uint8_t) (id >> 24);
+    out[2] = (uint8_t) (id >> 16);
+    out[3] = (uint8_t) (id >> 8);
+    out[4] = (uint8_t) id;
+}
+
+/**
+ * Writes the hello of a server.
+ *
+ * @param out - buffer of at least LINK_HELLO_SIZE bytes.
+ * @param id - id of the server.
+ * @param secret - secret of the links, LINK_SECRET_SIZE bytes.
+ * @return #Bytes written.
+ */
+static inline size_t linkHello(uint8_t *out, uint32_t id,
+                               const uint8_t *secret) {
+    linkId(out, LINK_HELLO_MAGIC, id);
+    memcpy(out + 5, secret, LINK_SECRET_SIZE);
+    return LINK_HELLO_SIZE;
+}
+
+/**
+ * Checks the secret of a hello, in a time that doesn't depend on where
+ * it differs.
+ *
+ * @param hello - the hello, LINK_HELLO_SIZE bytes.
+ * @param secret - secret of the links, LINK_SECRET_SIZE bytes.
+ * @return TRUE - if the secrets are the same.
+ *         FALSE - otherwise.
+ */
+static inline bool linkTrusted(const uint8_t *hello, const uint8_t *secret) {
+    uint8_t diff = 0;
+    for(size_t i = 0; i < LINK_SECRET_SIZE; i++)
+        diff |= (uint8_t) (hello[5 + i] ^ secret[i]);
+    return diff == 0;
+}
+
+/**
+ * Writes a telegram in the format of the links.
+ *
+ * @param out - buffer of at least LINK_HDR_MAX + KNX::tg_size::max bytes.
+ * @param server - id of the server the telegram comes from.
+ * @param hops - hops the telegram can still do after the next server.
+ * @param group - name of the group of the telegram.
+ * @param raw - the telegram.
+ * @param len - the length of the telegram.
+ * @return #Bytes written.
+ */
+static inline size_t linkFrame(uint8_t *out, uint32_t server, uint8_t hops,
+                               const std::string &group, const uint8_t *raw,
+                               size_t len) {
+    linkId(out, LINK_FRAME_MAGIC, server);
+    out[5] = hops;
+    out[6] = (uint8_t) group.size();
+    memcpy(out + 7, group.data(), group.size());
+    memcpy(out + 7 + group.size(), raw, len);
+    return 7 + group.size() + len;
+}
+
+/**
+ * Reads the server id of a hello or of a frame.
+ */
+static inline uint32_t linkServer(const uint8_t *data) {
+    return ((uint32_t) data[1] << 24) | ((uint32_t) data[2] << 16) |
+           ((uint32_t) data[3] << 8) | data[4];
+}
+
+#endif //LIBSMOKE_LINK_H
@@ -0,0 +1,253 @@
+#ifndef LIBSMOKE_LOG_H
+#define LIBSMOKE_LOG_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <arpa/inet.h>
+
+#define SMOKE_LOG_TRACE 0
+#define SMOKE_LOG_DEBUG 1
+#define SMOKE_LOG_INFO  2
+#define SMOKE_LOG_WARN  3
+#define SMOKE_LOG_ERROR 4
+#define SMOKE_LOG_OFF   5
+
+/**
+ * Sites below this level are removed at compile time.
+ */
+#ifndef SMOKE_LOG_LEVEL
+#define SMOKE_LOG_LEVEL SMOKE_LOG_INFO
+#endif
+
+#define LOG_RING_SIZE 1024
+#define LOG_MSG_SIZE 120
+
+/**
+ * Asynchronous logger shared by ServerSmoke and ClientSmoke.
+ * Messages are formatted by the caller directly inside a slot of a bounded
+ * lock-free ring, and written to stdout/stderr by a background thread, so a
+ * log site never waits for the console. When the ring is full the message
+ * is dropped (and counted) instead of blocking.
+ */
+class Logger {
+public:
+
+    /**
+     * Gets the logger, starting its thread on the first call.
+     */
+    static Logger &instance() {
+        static Logger l;
+        return l;
+    }
+
+
+    /**
+     * Checks the runtime level.
+     *
+     * @param level - level of the message.
+     * @return TRUE - if messages of this level must be logged.
+     */
+    static bool enabled(int level) {
+        return level >= runtimeLevel().load(std::memory_order_relaxed);
+    }
+
+
+    /**
+     * Sets the runtime level. Sites below SMOKE_LOG_LEVEL are never logged.
+     *
+     * @param level - one of the SMOKE_LOG_* levels.
+     */
+    static void setLevel(int level) {
+        runtimeLevel().store(level, std::memory_order_relaxed);
+    }
+
+
+    /**
+     * Formats a message inside the ring. Can be called by any thread.
+     *
+     * @param level - level of the message.
+     * @param fmt - printf-like format.
+     */
+    void log(int level, const char *fmt, ...)
+            __attribute__((format(printf, 3, 4))) {
+        Slot *s = claim();
+        if(s == NULL) return;
+
+        va_list a;
+        va_start(a, fmt);
+        vsnprintf(s->msg, LOG_MSG_SIZE, fmt, a);
+        va_end(a);
+        publish(s, level);
+    }
+
+
+    /**
+     * Formats a label followed by a buffer in hex, like Debug::printArray.
+     *
+     * @param level - level of the message.
+     * @param label - text printed before the buffer.
+     * @param buf - the buffer.
+     * @param len - the length of the buffer.
+     */
+    void hex(int level, const char *label, const uint8_t *buf, size_t len) {
+        static const char digits[] = "0123456789abcdef";
+        Slot *s = claim();
+        if(s == NULL) return;
+
+        int n = snprintf(s->msg, LOG_MSG_SIZE, "%s [", label);
+        size_t p = (n > 0 && n < LOG_MSG_SIZE) ? (size_t) n : 0;
+        for(size_t i = 0; i < len && p + 4 < LOG_MSG_SIZE; i++) {
+            s->msg[p++] = digits[buf[i] >> 4];
+            s->msg[p++] = digits[buf[i] & 0x0f];
+        }
+        s->msg[p++] = ']';
+        s->msg[p] = '\0';
+        publish(s, level);
+    }
+
+
+    /**
+     * Gets the #Messages dropped because the ring was full.
+     */
+    uint64_t dropped() const {
+        return _dropped.load(std::memory_order_relaxed);
+    }
+
+
+    /**
+     * Destructor of the logger. Writes what is left inside the ring.
+     */
+    ~Logger() {
+        _running.store(false, std::memory_order_relaxed);
+        if(_thread.joinable())
+            _thread.join();
+        drain();
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        int level;
+        char msg[LOG_MSG_SIZE];
+    };
+
+    Logger() : _head(0), _tail(0), _dropped(0), _running(true) {
+        for(size_t i = 0; i < LOG_RING_SIZE; i++)
+            _ring[i].seq.store(i, std::memory_order_relaxed);
+        _thread = std::thread([this]() {
+            while(_running.load(std::memory_order_relaxed)) {
+                if(!drain())
+                    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        });
+    }
+
+    Logger(const Logger &) = delete;
+    void operator=(const Logger &) = delete;
+
+    static std::atomic<int> &runtimeLevel() {
+        static std::atomic<int> level(SMOKE_LOG_LEVEL);
+        return level;
+    }
+
+    /**
+     * Reserves the next free slot (bounded MPMC ring with sequence numbers).
+     */
+    Slot *claim() {
+        size_t pos = _head.load(std::memory_order_relaxed);
+        while(true) {
+            Slot *s = &_ring[pos % LOG_RING_SIZE];
+            size_t seq = s->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+            if(diff == 0) {
+                if(_head.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed))
+                    return s;
+            } else if(diff < 0) {
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+                return NULL;
+            } else {
+                pos = _head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void publish(Slot *s, int level) {
+        s->level = level;
+        size_t seq = s->seq.load(std::memory_order_relaxed);
+        s->seq.store(seq + 1, std::memory_order_release);
+    }
+
+    /**
+     * Writes all the published messages. Only the logger thread (or the
+     * destructor, once the thread is stopped) calls it.
+     *
+     * @return TRUE - if at least a message has been written.
+     */
+    bool drain() {
+        bool any = false;
+        while(true) {
+            Slot *s = &_ring[_tail % LOG_RING_SIZE];
+            if(s->seq.load(std::memory_order_acquire) != _tail + 1)
+                break;
+
+            FILE *out = (s->level >= SMOKE_LOG_WARN) ? stderr : stdout;
+            fputs(s->msg, out);
+            fputc('\n', out);
+            s->seq.store(_tail + LOG_RING_SIZE, std::memory_order_release);
+            _tail++;
+            any = true;
+        }
+        if(any)
+            fflush(stdout);
+        return any;
+    }
+
+    Slot _ring[LOG_RING_SIZE];
+    std::atomic<size_t> _head;
+    size_t _tail;
+    std::atomic<uint64_t> _dropped;
+    std::atomic<bool> _running;
+    std::thread _thread;
+};
+
+/**
+ * Log sites: below SMOKE_LOG_LEVEL the condition is a constant false,
+ * so neither the call nor its arguments are compiled in.
+ */
+#define SMOKE_LOG(level, ...)                                              \
+    do {                                                                   \
+        if((level) >= SMOKE_LOG_LEVEL && Logger::enabled(level))           \
+            Logger::instance().log(level, __VA_ARGS__);                    \
+    } while(0)
+
+#define SMOKE_LOG_HEX(level, label, buf, len)                              \
+    do {                                                                   \
+        if((level) >= SMOKE_LOG_LEVEL && Logger::enabled(level))           \
+            Logger::instance().hex(level, label, buf, len);                \
+    } while(0)
+
+#define SMOKE_TRACE(...) SMOKE_LOG(SMOKE_LOG_TRACE, __VA_ARGS__)
+#define SMOKE_DEBUG(...) SMOKE_LOG(SMOKE_LOG_DEBUG, __VA_ARGS__)
+#define SMOKE_INFO(...)  SMOKE_LOG(SMOKE_LOG_INFO, __VA_ARGS__)
+#define SMOKE_WARN(...)  SMOKE_LOG(SMOKE_LOG_WARN, __VA_ARGS__)
+#define SMOKE_ERROR(...) SMOKE_LOG(SMOKE_LOG_ERROR, __VA_ARGS__)
+
+/**
+ * Arguments for a "%u.%u.%u.%u:%u" format, replacing inet_ntoa()
+ * (which is neither thread safe nor cheap).
+ */
+#define SMOKE_ADDR_FMT "%u.%u.%u.%u:%u"
+#define SMOKE_ADDR_ARGS(in)                                                \
+    ((const uint8_t *) &(in).sin_addr.s_addr)[0],                          \
+    ((const uint8_t *) &(in).sin_addr.s_addr)[1],                          \
+    ((const uint8_t *) &(in).sin_addr.s_addr)[2],                          \
+    ((const uint8_t *) &(in).sin_addr.s_addr)[3],                          \
+    (unsigned) ntohs((in).sin_port)
+
+#endif //LIBSMOKE_LOG_H
@@ -0,0 +1,451 @@
+#ifndef LIBSMOKE_METRICS_H
+#define LIBSMOKE_METRICS_H
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <string>
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * #Buckets of a latency histogram: bucket i counts the samples up to
+ * 2^i microseconds, the last one the slower ones (about 1s and more).
+ */
+#define LATENCY_BUCKETS 22
+
+/**
+ * Gets a monotonic timestamp in microseconds.
+ */
+static inline uint64_t monotonicUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+/**
+ * Monotonic counter written by a single thread and read by any thread.
+ * Since there's a single writer, no locked instruction is needed.
+ */
+class Counter {
+public:
+    Counter() : _value(0) {}
+
+    void inc(uint64_t n = 1) {
+        _value.store(_value.load(std::memory_order_relaxed) + n,
+                     std::memory_order_relaxed);
+    }
+
+    uint64_t get() const {
+        return _value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> _value;
+};
+
+/**
+ * Value that can go up and down, written by a single thread and read by
+ * any thread.
+ */
+class Gauge {
+public:
+    Gauge() : _value(0) {}
+
+    void add(int64_t n) {
+        _value.store(_value.load(std::memory_order_relaxed) + n,
+                     std::memory_order_relaxed);
+    }
+
+    int64_t get() const {
+        return _value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<int64_t> _value;
+};
+
+/**
+ * Latency histogram with fixed power of two buckets, written by a single
+ * thread and read by any thread. Recording a sample is O(1).
+ */
+class Histogram {
+public:
+    Histogram() : _count(0), _sum(0) {
+        for(std::atomic<uint64_t> &b : _buckets)
+            b.store(0, std::memory_order_relaxed);
+    }
+
+    /**
+     * Records a sample.
+     *
+     * @param us - the latency in microseconds.
+     */
+    void record(uint64_t us) {
+        size_t i = (us <= 1) ? 0 : (size_t) (64 - __builtin_clzll(us - 1));
+        if(i >= LATENCY_BUCKETS)
+            i = LATENCY_BUCKETS - 1;
+        bump(_buckets[i], 1);
+        bump(_count, 1);
+        bump(_sum, us);
+    }
+
+    uint64_t bucket(size_t i) const {
+        return _buckets[i].load(std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+        return _count.load(std::memory_order_relaxed);
+    }
+
+    uint64_t sum() const {
+        return _sum.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Gets the upper bound (in microseconds) of a bucket, 0 for the last one.
+     */
+    static uint64_t upperBound(size_t i) {
+        return (i + 1 < LATENCY_BUCKETS) ? (1ULL << i) : 0;
+    }
+
+private:
+    static void bump(std::atomic<uint64_t> &v, uint64_t n) {
+        v.store(v.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> _buckets[LATENCY_BUCKETS];
+    std::atomic<uint64_t> _count;
+    std::atomic<uint64_t> _sum;
+};
+
+/**
+ * Why a client has been disconnected.
+ */
+enum DisconnectReason {
+    /** The client closed the connection. */
+    DISC_PEER_CLOSED,
+    /** recv() failed. */
+    DISC_RECV_ERROR,
+    /** sendmsg() failed. */
+    DISC_SEND_ERROR,
+    /** The client sent an invalid join preamble. */
+    DISC_PROTOCOL,
+    /** The SHED_DISCONNECT Backpressure policy. */
+    DISC_SHED,
+    /** A keepalive probe or a handshake deadline expired. */
+    DISC_TIMEOUT,
+    DISC_REASONS
+};
+
+/**
+ * Metrics of a single reactor. Every field is written only by the thread
+ * of the reactor and can be read at any time by any thread.
+ */
+struct Metrics {
+    /** Connections accepted, and still open. */
+    Counter accepted;
+    Gauge connections;
+    Counter disconnects[DISC_REASONS];
+    /** Bytes received from and sent to the clients. */
+    Counter bytesIn;
+    Counter bytesOut;
+    /** Telegrams received, and the invalid ones discarded. */
+    Counter telegramsIn;
+    Counter telegramsInvalid;
+    /** Telegrams handed to the other reactors. */
+    Counter telegramsForwarded;
+    /** Frames queued to a client (one per recipient). */
+    Counter deliveries;
+    /** sendmsg() calls, and the ones that didn't send everything. */
+    Counter sendCalls;
+    Counter shortWrites;
+    /** Keepalive probes sent to the silent clients. */
+    Counter keepaliveProbes;
+    /** Telegrams over the RateLimit of their sender, dropped or delayed. */
+    Counter rateDropped;
+    Counter rateDelayed;
+    /** Telegrams of the History sent to the clients catching up. */
+    Counter catchupTelegrams;
+    /** Bytes and frames waiting inside the outbound queues. */
+    Gauge queuedBytes;
+    Gauge queuedFrames;
+    /** Source addresses learned, each owned by a single connection. */
+    Gauge learnedAddrs;
+    /**
+     * Time from the recv() of a telegram to the send of its last copy.
+     */
+    Histogram fanoutLatency;
+};
+
+/**
+ * Sum of the Metrics of all the reactors, taken at a given time.
+ */
+struct MetricsSnapshot {
+    size_t reactors;
+    uint64_t accepted;
+    int64_t connections;
+    uint64_t disconnects[DISC_REASONS];
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    uint64_t telegramsIn;
+    uint64_t telegramsInvalid;
+    uint64_t telegramsForwarded;
+    uint64_t deliveries;
+    uint64_t sendCalls;
+    uint64_t shortWrites;
+    uint64_t keepaliveProbes;
+    uint64_t rateDropped;
+    uint64_t rateDelayed;
+    uint64_t catchupTelegrams;
+    int64_t queuedBytes;
+    int64_t queuedFrames;
+    int64_t learnedAddrs;
+    uint64_t latencyBuckets[LATENCY_BUCKETS];
+    uint64_t latencyCount;
+    uint64_t latencySum;
+
+    MetricsSnapshot() {
+        memset(this, 0, sizeof(*this));
+    }
+
+    /**
+     * Adds the metrics of a reactor.
+     *
+     * @param m - the metrics to add.
+     */
+    void add(const Metrics &m) {
+        reactors++;
+        accepted += m.accepted.get();
+        connections += m.connections.get();
+        for(size_t i = 0; i < DISC_REASONS; i++)
+            disconnects[i] += m.disconnects[i].get();
+        bytesIn += m.bytesIn.get();
+        bytesOut += m.bytesOut.get();
+        telegramsIn += m.telegramsIn.get();
+        telegramsInvalid += m.telegramsInvalid.get();
+        telegramsForwarded += m.telegramsForwarded.get();
+        deliveries += m.deliveries.get();
+        sendCalls += m.sendCalls.get();
+        shortWrites += m.shortWrites.get();
+        keepaliveProbes += m.keepaliveProbes.get();
+        rateDropped += m.rateDropped.get();
+        rateDelayed += m.rateDelayed.get();
+        catchupTelegrams += m.catchupTelegrams.get();
+        queuedBytes += m.queuedBytes.get();
+        queuedFrames += m.queuedFrames.get();
+        learnedAddrs += m.learnedAddrs.get();
+        for(size_t i = 0; i < LATENCY_BUCKETS; i++)
+            latencyBuckets[i] += m.fanoutLatency.bucket(i);
+        latencyCount += m.fanoutLatency.count();
+        latencySum += m.fanoutLatency.sum();
+    }
+
+    /**
+     * Renders the snapshot in the Prometheus plain-text format.
+     *
+     * @param out - where to append the text.
+     */
+    void render(std::string &out) const {
+        static const char *reasons[DISC_REASONS] = {
+                "peer_closed", "recv_error", "send_error", "protocol", "shed",
+                "timeout"
+        };
+
+        line(out, "# TYPE smoke_reactors gauge\nsmoke_reactors %zu\n", reactors);
+        line(out, "# TYPE smoke_accepted_total counter\n"
+                  "smoke_accepted_total %llu\n", ull(accepted));
+        line(out, "# TYPE smoke_connections gauge\n"
+                  "smoke_connections %lld\n", (long long) connections);
+        out += "# TYPE smoke_disconnects_total counter\n";
+        for(size_t i = 0; i < DISC_REASONS; i++)
+            line(out, "smoke_disconnects_total{reason=\"%s\"} %llu\n",
+                 reasons[i], ull(disconnects[i]));
+        counter(out, "smoke_bytes_in_total", bytesIn);
+        counter(out, "smoke_bytes_out_total", bytesOut);
+        counter(out, "smoke_telegrams_in_total", telegramsIn);
+        counter(out, "smoke_telegrams_invalid_total", telegramsInvalid);
+        counter(out, "smoke_telegrams_forwarded_total", telegramsForwarded);
+        counter(out, "smoke_deliveries_total", deliveries);
+        counter(out, "smoke_send_calls_total", sendCalls);
+        counter(out, "smoke_short_writes_total", shortWrites);
+        counter(out, "smoke_keepalive_probes_total", keepaliveProbes);
+        line(out, "# TYPE smoke_rate_limited_total counter\n"
+                  "smoke_rate_limited_total{action=\"dropped\"} %llu\n"
+                  "smoke_rate_limited_total{action=\"delayed\"} %llu\n",
+             ull(rateDropped), ull(rateDelayed));
+        counter(out, "smoke_catchup_telegrams_total", catchupTelegrams);
+        line(out, "# TYPE smoke_queued_bytes gauge\n"
+                  "smoke_queued_bytes %lld\n", (long long) queuedBytes);
+        line(out, "# TYPE smoke_queued_frames gauge\n"
+                  "smoke_queued_frames %lld\n", (long long) queuedFrames);
+        line(out, "# TYPE smoke_learned_addresses gauge\n"
+                  "smoke_learned_addresses %lld\n", (long long) learnedAddrs);
+
+        out += "# TYPE smoke_fanout_latency_us histogram\n";
+        uint64_t cumulative = 0;
+        for(size_t i = 0; i < LATENCY_BUCKETS; i++) {
+            cumulative += latencyBuckets[i];
+            if(Histogram::upperBound(i) != 0)
+                line(out, "smoke_fanout_latency_us_bucket{le=\"%llu\"} %llu\n",
+                     ull(Histogram::upperBound(i)), ull(cumulative));
+            else
+                line(out, "smoke_fanout_latency_us_bucket{le=\"+Inf\"} %llu\n",
+                     ull(cumulative));
+        }
+        line(out, "smoke_fanout_latency_us_sum %llu\n", ull(latencySum));
+        line(out, "smoke_fanout_latency_us_count %llu\n", ull(latencyCount));
+    }
+
+private:
+    static unsigned long long ull(uint64_t v) {
+        return (unsigned long long) v;
+    }
+
+    static void counter(std::string &out, const char *name, uint64_t v) {
+        line(out, "# TYPE %s counter\n%s %llu\n", name, name, ull(v));
+    }
+
+    static void line(std::string &out, const char *fmt, ...)
+            __attribute__((format(printf, 2, 3))) {
+        char buf[256];
+        va_list a;
+        va_start(a, fmt);
+        int n = vsnprintf(buf, sizeof(buf), fmt, a);
+        va_end(a);
+        if(n > 0)
+            out.append(buf, (size_t) n < sizeof(buf) ? (size_t) n : sizeof(buf) - 1);
+    }
+};
+
+/**
+ * Plain-text scrape endpoint, served by its own thread so the reactors
+ * never wait for it. Every connection gets the current text (with a
+ * minimal HTTP header, so it can be scraped by Prometheus or read with
+ * curl) and is closed.
+ */
+class StatsEndpoint {
+public:
+
+    /**
+     * Constructor of the endpoint. Nothing is listening until start().
+     */
+    StatsEndpoint() : _sock(-1), _running(false) {}
+
+
+    /**
+     * Destructor of the endpoint. It just calls the stop() method.
+     */
+    ~StatsEndpoint() {
+        stop();
+    }
+
+
+    /**
+     * Starts listening and serving the text.
+     *
+     * @param addr - IP addr to listen on, usually 127.0.0.1.
+     * @param port - PORT to listen on.
+     * @param text - called on every scrape to get the text to send.
+     * @return TRUE - if the endpoint is listening.
+     *         FALSE - otherwise.
+     */
+    bool start(const char *addr, int port, std::function<std::string()> text) {
+        if(_running)
+            return false;
+
+        struct sockaddr_in in;
+        memset(&in, 0, sizeof(in));
+        in.sin_family = AF_INET;
+        in.sin_port = htons(port);
+        in.sin_addr.s_addr = inet_addr(addr);
+
+        _sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(_sock < 0)
+            return false;
+
+        int one = 1;
+        setsockopt(_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(bind(_sock, (struct sockaddr *) &in, sizeof(in)) < 0 ||
+           listen(_sock, 16) < 0) {
+            close(_sock);
+            _sock = -1;
+            return false;
+        }
+
+        _text = text;
+        _running = true;
+        _thread = std::thread([this]() { serve(); });
+        return true;
+    }
+
+
+    /**
+     * Stops the thread and closes the socket.
+     */
+    void stop() {
+        _running = false;
+        if(_thread.joinable())
+            _thread.join();
+        if(_sock >= 0)
+            close(_sock);
+        _sock = -1;
+    }
+
+private:
+    void serve() {
+        while(_running.load(std::memory_order_relaxed)) {
+            struct pollfd p;
+            p.fd = _sock;
+            p.events = POLLIN;
+            if(::poll(&p, 1, 100) <= 0)
+                continue;
+
+            int c = accept4(_sock, NULL, NULL, SOCK_CLOEXEC);
+            if(c < 0)
+                continue;
+
+            // Consume the request, if any, without waiting for too long
+            struct timeval tv = {0, 100000};
+            setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            char req[1024];
+            if(recv(c, req, sizeof(req), MSG_DONTWAIT) < 0) {}
+
+            std::string body = _text();
+            char hdr[128];
+            int n = snprintf(hdr, sizeof(hdr),
+                             "HTTP/1.0 200 OK\r\n"
+                             "Content-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %zu\r\n\r\n", body.size());
+            std::string out(hdr, (size_t) n);
+            out += body;
+
+            size_t off = 0;
+            while(off < out.size()) {
+                ssize_t s = send(c, out.data() + off, out.size() - off,
+                                 MSG_NOSIGNAL);
+                if(s <= 0)
+                    break;
+                off += (size_t) s;
+            }
+            close(c);
+        }
+    }
+
+    int _sock;
+    std::atomic<bool> _running;
+    std::thread _thread;
+    std::function<std::string()> _text;
+};
+
+#endif //LIBSMOKE_METRICS_H
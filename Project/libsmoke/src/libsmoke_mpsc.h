@@ -0,0 +1,119 @@
+#ifndef LIBSMOKE_MPSC_H
+#define LIBSMOKE_MPSC_H
+
+#include <atomic>
+#include <utility>
+
+/**
+ * Unbounded lock-free Multi-Producer Single-Consumer queue.
+ * Producers only do an atomic exchange on the tail, so push() never blocks
+ * and never takes a lock. Only the owner thread is allowed to call pop().
+ *
+ * @tparam T - type of the elements stored in the queue.
+ */
+template<typename T>
+class MPSCQueue {
+public:
+
+    /**
+     * Constructor of the queue.
+     * Both head and tail point to a stub node, so the queue is never empty
+     * from the producers point of view.
+     */
+    MPSCQueue() : _head(&_stub), _tail(&_stub) {
+        _stub.next.store(nullptr, std::memory_order_relaxed);
+    }
+
+
+    /**
+     * Destructor of the queue.
+     * Deletes all the elements that have not been consumed.
+     */
+    ~MPSCQueue() {
+        T tmp;
+        while(pop(tmp)) {}
+    }
+
+
+    /**
+     * Appends a new element to the queue. Can be called by any thread.
+     *
+     * @param value - the element to append.
+     */
+    void push(T value) {
+        Node *n = new Node(std::move(value));
+        enqueue(n);
+    }
+
+
+    /**
+     * Removes the oldest element from the queue. Must be called only by the
+     * consumer thread.
+     *
+     * @param value - used to pass the removed element.
+     * @return TRUE - if an element has been removed.
+     *         FALSE - if the queue is empty (or a producer is in the middle
+     *                 of a push, the element will be seen by the next call).
+     */
+    bool pop(T &value) {
+        Node *head = _head;
+        Node *next = head->next.load(std::memory_order_acquire);
+
+        // Skip the stub node
+        if(head == &_stub) {
+            if(next == nullptr)
+                return false;
+            _head = next;
+            head = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+
+        if(next != nullptr) {
+            _head = next;
+            value = std::move(head->value);
+            delete head;
+            return true;
+        }
+
+        // Last element: put back the stub before detaching it
+        if(head != _tail.load(std::memory_order_acquire))
+            return false;
+
+        enqueue(&_stub);
+        next = head->next.load(std::memory_order_acquire);
+        if(next == nullptr)
+            return false;
+
+        _head = next;
+        value = std::move(head->value);
+        delete head;
+        return true;
+    }
+
+private:
+    struct Node {
+        std::atomic<Node *> next;
+        T value;
+
+        Node() : next(nullptr) {}
+        explicit Node(T &&v) : next(nullptr), value(std::move(v)) {}
+    };
+
+    void enqueue(Node *n) {
+        n->next.store(nullptr, std::memory_order_relaxed);
+        Node *prev = _tail.exchange(n, std::memory_order_acq_rel);
+        prev->next.store(n, std::memory_order_release);
+    }
+
+    /**
+     * Only touched by the consumer.
+     */
+    Node *_head;
+    /**
+     * Shared between all the producers.
+     */
+    std::atomic<Node *> _tail;
+    Node _stub;
+};
+
+#endif //LIBSMOKE_MPSC_H
@@ -0,0 +1,107 @@
+#ifndef LIBSMOKE_RATELIMIT_H
+#define LIBSMOKE_RATELIMIT_H
+
+#include <cstdint>
+
+/* Tokens are counted in millionths, so a rate in telegrams/s refills
+ * rate units every microsecond */
+#define TOKEN_UNIT 1000000ULL
+#define RATE_HELD_MAX 256
+
+/**
+ * What to do with the telegrams of a sender over its rate.
+ */
+enum RateAction {
+    /** Drop them. */
+    RATE_DROP,
+    /**
+     * Hold them (up to maxHeld per connection, then drop them) and
+     * broadcast them as soon as the sender has tokens again.
+     */
+    RATE_DELAY,
+};
+
+/**
+ * Limits of the telegrams each sender can broadcast, enforced by token
+ * buckets before the telegrams are queued: a sender can send burst
+ * telegrams at once, then rate telegrams/s. The connection limit applies
+ * to every connection but the links to other servers, the source one
+ * to every KNX source address (scoped by group) of a shard.
+ * A rate of 0 disables the limit, they are all disabled by default.
+ */
+struct RateLimit {
+    uint32_t rate;
+    uint32_t burst;
+    uint32_t sourceRate;
+    uint32_t sourceBurst;
+    RateAction action;
+    size_t maxHeld;
+
+    RateLimit() : rate(0), burst(0), sourceRate(0), sourceBurst(0),
+                  action(RATE_DROP), maxHeld(RATE_HELD_MAX) {}
+
+    /**
+     * Checks if any limit is set.
+     */
+    bool enabled() const {
+        return rate > 0 || sourceRate > 0;
+    }
+};
+
+/**
+ * Token bucket refilled lazily when it's used, so an idle sender costs
+ * nothing. A new bucket is full.
+ */
+struct TokenBucket {
+    uint64_t tokens;
+    uint64_t last;
+
+    TokenBucket() : tokens(0), last(0) {}
+
+    /**
+     * Adds the tokens earned since the last call.
+     *
+     * @param rate - tokens per second, 0 for no limit.
+     * @param burst - max tokens.
+     * @param now - the current time (monotonicUs()).
+     */
+    void refill(uint32_t rate, uint32_t burst, uint64_t now) {
+        uint64_t cap = (burst > 0 ? burst : 1) * TOKEN_UNIT;
+        if(last == 0 || rate == 0) {
+            tokens = cap;
+        } else if(now > last) {
+            uint64_t elapsed = now - last;
+            tokens = elapsed >= cap / rate ? cap : tokens + elapsed * rate;
+            if(tokens > cap)
+                tokens = cap;
+        }
+        last = now;
+    }
+
+    /**
+     * Checks if a token is available, after refill().
+     */
+    bool ready() const {
+        return tokens >= TOKEN_UNIT;
+    }
+
+    /**
+     * Takes a token, that must be available.
+     */
+    void take() {
+        tokens -= TOKEN_UNIT;
+    }
+
+    /**
+     * Gets the time (us) until the next token, after refill().
+     *
+     * @param rate - tokens per second, not 0.
+     */
+    uint64_t wait(uint32_t rate) const {
+        if(ready())
+            return 0;
+        return (TOKEN_UNIT - tokens + rate - 1) / rate;
+    }
+};
+
+#endif //LIBSMOKE_RATELIMIT_H
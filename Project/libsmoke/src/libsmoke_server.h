@@ -1,31 +1,2356 @@
 #ifndef LIBSMOKE_SERVER_H
 #define LIBSMOKE_SERVER_H
 
+#include <atomic>
+#include <cerrno>
+#include <climits>
 #include <cstdio>
+#include <deque>
 #include <queue>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
-#define BUFSZ 512
+#include <sknx/src/shared/knx/capture.h>
+#include <sknx/src/shared/knx/telegram.h>
+#include <sknx/src/shared/knx/backend/linux-tcp.h>
+#include <sknx/src/shared/knx/backend/linux-unix.h>
+
+#include "libsmoke_frame.h"
+#include "libsmoke_group.h"
+#include "libsmoke_history.h"
+#include "libsmoke_link.h"
+#include "libsmoke_log.h"
+#include "libsmoke_metrics.h"
+#include "libsmoke_mpsc.h"
+#include "libsmoke_ratelimit.h"
+#include "libsmoke_timer.h"
+#include "libsmoke_uring.h"
+
+#define MAX_EVENTS 256
+#define MAX_IOV 512
+#define RECV_BUFSZ 4096
+#define LISTEN_BACKLOG SOMAXCONN
+
+#define URING_ENTRIES 1024
+#define URING_CQ_ENTRIES 8192
+#define URING_BUFFERS 256
+#define URING_BUFSZ (RECV_BUFSZ - FRAME_MAX)
+#define URING_IOV 256
+
+#define OUTQ_MAX_BYTES (1024 * 1024)
+#define OUTQ_MAX_FRAMES 4096
+#define OUTQ_HIGH_WATERMARK (512 * 1024)
+#define OUTQ_LOW_WATERMARK (128 * 1024)
+
+#define KEEPALIVE_PROBE_MS 5000
+#define KEEPALIVE_HANDSHAKE_MS 10000
 
 using std::vector;
 using std::queue;
 
-/**
- * Used in case of errors to stop the server.
- */
-static volatile bool mustStop = false;
-/**
- * Used to save all connected Clients.
- */
-struct Client {
-    int sock;
-    struct sockaddr_in in;
-    bool mustDelete;
+/**
+ * Used in case of errors to stop the server.
+ */
+static volatile bool mustStop = false;
+/**
+ * What to do when the outbound queue of a client exceeds its limits.
+ */
+enum ShedPolicy {
+    /** Drop the oldest queued frames. */
+    SHED_DROP_OLDEST,
+    /** Drop the frames that are not alarm or system telegrams first. */
+    SHED_DROP_LOW_PRIORITY,
+    /** Close the connection with the client. */
+    SHED_DISCONNECT,
+};
+
+/**
+ * I/O engine used by the reactors.
+ */
+enum IoEngine {
+    /** epoll and non-blocking syscalls, a syscall per socket. */
+    ENGINE_EPOLL,
+    /**
+     * io_uring (Linux 6.0 or newer): multishot accept and recv on provided
+     * buffers, and all the sends of an iteration submitted together.
+     * Falls back to ENGINE_EPOLL when it's not available.
+     */
+    ENGINE_URING,
+};
+
+/**
+ * Limits applied to the outbound queue of every client.
+ * A client whose queue goes over highWatermark bytes is congested until it
+ * drains under lowWatermark: meanwhile, with SHED_DROP_LOW_PRIORITY, its new
+ * low priority frames are shed immediately. maxBytes and maxFrames are never
+ * exceeded, the policy is applied to make room for a new frame.
+ */
+struct Backpressure {
+    size_t maxBytes;
+    size_t maxFrames;
+    size_t highWatermark;
+    size_t lowWatermark;
+    ShedPolicy policy;
+
+    Backpressure() : maxBytes(OUTQ_MAX_BYTES), maxFrames(OUTQ_MAX_FRAMES),
+                     highWatermark(OUTQ_HIGH_WATERMARK),
+                     lowWatermark(OUTQ_LOW_WATERMARK),
+                     policy(SHED_DROP_OLDEST) {}
+};
+
+/**
+ * Counters of what has been shed because of the Backpressure limits.
+ */
+struct ShedStats {
+    uint64_t oldestFrames;
+    uint64_t lowPriorityFrames;
+    uint64_t bytes;
+    uint64_t disconnects;
+
+    ShedStats() : oldestFrames(0), lowPriorityFrames(0), bytes(0),
+                  disconnects(0) {}
+};
+
+/**
+ * Deadlines of the connections, checked by the timer wheel of each reactor.
+ * A client silent for idleMs gets a keepalive probe (TCP_KEEPALIVE_PING),
+ * and it's disconnected if it doesn't send anything within probeMs.
+ * A link must send its hello, and a client its whole join preamble (once
+ * it has started), within handshakeMs from the connection.
+ * 0 disables the deadline; by default only the handshake one is set.
+ */
+struct Keepalive {
+    uint32_t idleMs;
+    uint32_t probeMs;
+    uint32_t handshakeMs;
+
+    Keepalive() : idleMs(0), probeMs(KEEPALIVE_PROBE_MS),
+                  handshakeMs(KEEPALIVE_HANDSHAKE_MS) {}
+};
+
+/**
+ * Deadline the timer of a client is waiting for.
+ */
+enum Deadline {
+    DEADLINE_HANDSHAKE,
+    DEADLINE_IDLE,
+    DEADLINE_PROBE,
+};
+
+struct Client;
+
+/**
+ * Server this one connects to, again and again while it's unreachable.
+ */
+struct LinkTarget {
+    struct sockaddr_in in;
+    /**
+     * The link while it's connected, NULL otherwise.
+     */
+    Client *c;
+    /**
+     * When to try again to connect (monotonicUs()).
+     */
+    uint64_t retryAt;
+};
+
+/**
+ * Used to save all connected Clients.
+ */
+struct Client {
+    int sock;
+    /**
+     * Id of the connection, unique inside the server: a sequence number
+     * of the reactor and its id (the low 6 bits).
+     */
+    uint32_t id;
+    /**
+     * Address of the peer, sin_family is AF_UNIX for local clients.
+     */
+    struct sockaddr_in in;
+    bool mustDelete;
+    /**
+     * TRUE for a SOCK_SEQPACKET connection: every record holds whole
+     * telegrams, at most UNIX_RECORD_MAX bytes.
+     */
+    bool packet;
+    /**
+     * Position inside the clients vector, used to remove it in O(1).
+     */
+    size_t idx;
+    /**
+     * Group joined by the client and its position inside the members
+     * of the group handled by the reactor.
+     */
+    Group *group;
+    size_t gidx;
+    /**
+     * TRUE once the first bytes (the optional join preamble) are received.
+     */
+    bool greeted;
+    /**
+     * KNX source addresses owned by this connection (keys of the addrs map
+     * of the reactor, scoped by group), each listed once.
+     */
+    std::unordered_set<uint32_t> addrs;
+    /**
+     * TRUE if the connection is a link to another server, that is not a
+     * member of any group and sends (and gets) telegrams of all of them.
+     * server is the id of the other server (0 until its hello), target
+     * is NULL if the link has been accepted instead of connected.
+     */
+    bool link;
+    uint32_t server;
+    bool helloSent;
+    LinkTarget *target;
+    /**
+     * Timer of the next deadline of the client, and when it last sent
+     * something (monotonicUs()): the timer is moved only when it fires,
+     * never by the data received.
+     */
+    Timer timer;
+    Deadline deadline;
+    uint64_t lastRx;
+    uint64_t probedAt;
+    /**
+     * Tokens of the connection, and its telegrams over the RateLimit held
+     * with RATE_DELAY until rateTimer finds tokens for them.
+     */
+    TokenBucket bucket;
+    std::deque<Frame *> held;
+    Timer rateTimer;
+    /**
+     * Bytes of a telegram (or of a link frame) not yet completely received.
+     */
+    uint8_t partial[FRAME_MAX];
+    static_assert(2 + TCP_GROUP_NAME_MAX <= FRAME_MAX,
+                  "The join preamble must fit inside partial");
+    static_assert(LINK_HELLO_SIZE <= FRAME_MAX,
+                  "The link hello must fit inside partial");
+    uint8_t partialLen;
+    /**
+     * Frames waiting to be sent to the client.
+     */
+    std::deque<Frame *> outq;
+    /**
+     * Bytes of the first frame of outq already sent.
+     */
+    size_t outOffset;
+    /**
+     * Bytes of all the frames inside outq.
+     */
+    size_t outBytes;
+    /**
+     * TRUE if outBytes went over the high watermark and not yet under the low one.
+     */
+    bool congested;
+    /**
+     * TRUE if the socket is full and EPOLLOUT is armed.
+     */
+    bool waitingOut;
+    /**
+     * TRUE if the client is inside the list of the ones to flush.
+     */
+    bool dirty;
+    /**
+     * io_uring requests of the client owned by the kernel: the client
+     * can't be deleted until they are completed.
+     */
+    unsigned ops;
+    bool closing;
+    /**
+     * Frames of outq referenced by the io_uring send in flight, and the
+     * message describing them (allocated on the first send).
+     */
+    size_t inflight;
+    struct iovec *iov;
+    struct msghdr msg;
+    size_t msgBytes;
+
+    Client() : sock(0), mustDelete(false), packet(false), idx(0), group(NULL), gidx(0),
+               greeted(false), link(false), server(0), helloSent(false),
+               target(NULL), deadline(DEADLINE_HANDSHAKE), lastRx(0),
+               probedAt(0), partialLen(0),
+               outOffset(0), outBytes(0),
+               congested(false), waitingOut(false), dirty(false),
+               ops(0), closing(false), inflight(0), iov(NULL), msg(),
+               msgBytes(0) {}
+
+    ~Client() {
+        delete[] iov;
+    }
+};
+
+/**
+ * Event loop owning a shard of the connected clients.
+ * Every reactor has its own listening socket (bound with SO_REUSEPORT when
+ * there's more than one), its own epoll instance and its own clients.
+ * Every client is a member of a Group, and its telegrams reach only the
+ * other members. Pkts received on a shard are handed to the other shards
+ * having members of the same group through their lock-free inbox, so no
+ * global lock is ever taken.
+ * The TCP stream of each client is split into KNX telegrams, and only the
+ * complete and valid ones are broadcasted. Each one is stored inside a
+ * refcounted Frame, referenced (never copied) by the outbound queue of
+ * each recipient. Individually addressed telegrams reach only the
+ * connection owning the destination address, and no telegram is ever
+ * sent back to its sender.
+ * Outbound queues are bounded by the Backpressure limits, so a slow client
+ * never blocks the others.
+ * Dead peers are found by the Keepalive deadlines, kept inside a timer
+ * wheel: each iteration only touches the clients whose deadline expired.
+ * The telegrams of each sender are limited by token buckets before being
+ * queued, so a noisy one can't make the others pay for its fan-out.
+ * Links to other servers get the telegrams of every group (once per
+ * server, however many clients it has) and hand theirs to the local
+ * members, so a group can span several servers.
+ * Sockets are driven either by epoll or, with ENGINE_URING, by an
+ * io_uring instance: then each iteration costs a single io_uring_enter(),
+ * submitting the sends of all the recipients and collecting the accepted
+ * connections and the received data.
+ */
+class Reactor {
+public:
+
+    /**
+     * Constructor of the Reactor.
+     *
+     * @param id - index of the reactor inside peers.
+     * @param peers - all the reactors of the server (this one included).
+     * @param groups - the groups of the server.
+     * @param fed - the federation state of the server.
+     * @param bp - limits of the outbound queues of the clients.
+     * @param ka - deadlines of the clients.
+     * @param rl - limits of the telegrams of each sender.
+     */
+    Reactor(int id, vector<Reactor *> &peers, GroupTable &groups,
+            Federation &fed, const Backpressure &bp, const Keepalive &ka,
+            const RateLimit &rl) :
+            _id(id), _peers(peers), _groups(groups), _fed(fed), _bp(bp),
+            _ka(ka), _rl(rl), _held(0), _capture(NULL), _seq(0),
+            _sock(-1), _usock(-1), _utype(0), _epfd(-1), _evfd(-1),
+            _uring(false), _evcount(0),
+            _signaled(false), _shedOldest(0), _shedLowPriority(0),
+            _shedBytes(0), _shedDisconnects(0) {}
+
+
+    /**
+     * Destructor of the Reactor. Closes all sockets.
+     */
+    ~Reactor() {
+        shutdown();
+    }
+
+
+    /**
+     * Creates the listening socket of the shard and the epoll (or io_uring)
+     * instance.
+     *
+     * @param in - IP addr and PORT of the socket to create.
+     * @param backlog - max length of the queue of pending connections.
+     * @param reusePort - TRUE if the PORT is shared with other reactors.
+     * @param engine - the I/O engine to use, if available.
+     * @return TRUE - if socket is created with no errors and is listening.
+     *         FALSE - otherwise.
+     */
+    bool init(const struct sockaddr_in &in, int backlog, bool reusePort,
+              IoEngine engine) {
+        _timers.start(monotonicUs());
+        _uring = engine == ENGINE_URING && initUring();
+        if(engine == ENGINE_URING && !_uring)
+            SMOKE_WARN("io_uring not available, falling back to epoll");
+
+        // io_uring waits for the sockets by itself, they stay blocking
+        int nonblock = _uring ? 0 : SOCK_NONBLOCK;
+        _sock = socket(AF_INET, SOCK_STREAM | nonblock | SOCK_CLOEXEC, 0);
+        if(_sock < 0) {
+            SMOKE_ERROR("Cannot create server socket");
+            return false;
+        }
+
+        // A restarted server must not wait for the links in TIME_WAIT
+        int one = 1;
+        setsockopt(_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(reusePort &&
+           setsockopt(_sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+            SMOKE_ERROR("Cannot enable SO_REUSEPORT");
+            shutdown();
+            return false;
+        }
+
+        if(bind(_sock, (struct sockaddr *)&in, sizeof(in)) < 0) {
+            SMOKE_ERROR("Cannot bind on port %u", ntohs(in.sin_port));
+            shutdown();
+            return false;
+        }
+
+        if(listen(_sock, backlog) < 0) {
+            SMOKE_ERROR("Cannot start listening");
+            shutdown();
+            return false;
+        }
+
+        _evfd = eventfd(0, (_uring ? 0 : EFD_NONBLOCK) | EFD_CLOEXEC);
+        if(_evfd < 0) {
+            SMOKE_ERROR("Cannot create wakeup eventfd");
+            shutdown();
+            return false;
+        }
+
+        if(_uring) {
+            armAccept(URING_ACCEPT);
+            armEvent();
+            return true;
+        }
+
+        _epfd = epoll_create1(EPOLL_CLOEXEC);
+        if(_epfd < 0) {
+            SMOKE_ERROR("Cannot create epoll instance");
+            shutdown();
+            return false;
+        }
+
+        // Listening socket and eventfd are registered with a fake ptr
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &_sock;
+        if(epoll_ctl(_epfd, EPOLL_CTL_ADD, _sock, &ev) < 0) {
+            SMOKE_ERROR("Cannot register server socket");
+            shutdown();
+            return false;
+        }
+
+        ev.data.ptr = &_evfd;
+        if(epoll_ctl(_epfd, EPOLL_CTL_ADD, _evfd, &ev) < 0) {
+            SMOKE_ERROR("Cannot register wakeup eventfd");
+            shutdown();
+            return false;
+        }
+
+        return true;
+    }
+
+
+    /**
+     * Creates a AF_UNIX listening socket, whose clients are handled by
+     * this shard like the TCP ones. A stale socket file is replaced.
+     *
+     * @param path - path of the socket to create.
+     * @param type - SOCK_SEQPACKET or SOCK_STREAM.
+     * @param backlog - max length of the queue of pending connections.
+     * @return TRUE - if socket is created with no errors and is listening.
+     *         FALSE - otherwise.
+     */
+    bool listenUnix(const char *path, int type, int backlog) {
+        struct sockaddr_un un;
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        if(_usock >= 0 || strlen(path) >= sizeof(un.sun_path) ||
+           (type != SOCK_SEQPACKET && type != SOCK_STREAM)) {
+            SMOKE_ERROR("Cannot listen on %s", path);
+            return false;
+        }
+        strcpy(un.sun_path, path);
+
+        int nonblock = _uring ? 0 : SOCK_NONBLOCK;
+        int sock = socket(AF_UNIX, type | nonblock | SOCK_CLOEXEC, 0);
+        if(sock < 0) {
+            SMOKE_ERROR("Cannot create unix socket");
+            return false;
+        }
+
+        unlink(path);
+        if(bind(sock, (struct sockaddr *) &un, sizeof(un)) < 0 ||
+           listen(sock, backlog) < 0) {
+            SMOKE_ERROR("Cannot listen on %s", path);
+            close(sock);
+            return false;
+        }
+
+        if(!_uring) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = &_usock;
+            if(epoll_ctl(_epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+                SMOKE_ERROR("Cannot register unix socket");
+                close(sock);
+                unlink(path);
+                return false;
+            }
+        }
+
+        _usock = sock;
+        _utype = type;
+        _upath = path;
+        if(_uring)
+            armAccept(URING_ACCEPT_UNIX);
+        return true;
+    }
+
+
+    /**
+     * Links this server to another one, connecting to it now and whenever
+     * the link is lost.
+     *
+     * @param in - IP addr and PORT of the other server.
+     */
+    void connectLink(const struct sockaddr_in &in) {
+        LinkTarget *t = new LinkTarget();
+        t->in = in;
+        t->c = NULL;
+        t->retryAt = 0;
+        _targets.push_back(t);
+        dial(t);
+    }
+
+
+    /**
+     * Handles connections : registering the new ones or deleting the closed ones.
+     * Also used to broadcast messages to all the clients of the shard.
+     * Each call waits at most 100ms and only touches the sockets that epoll
+     * reports as ready, and the clients whose deadline expired, so its cost
+     * does not depend on the #Clients connected (apart from the broadcast
+     * itself). Deadlines can be late by up to 100ms, delayed telegrams by
+     * a tick of the timer wheel.
+     */
+    void poll() {
+        int timeout = _held > 0 ? TIMER_TICK_US / 1000 : 100;
+        if(_uring)
+            waitUring(timeout);
+        else
+            waitEpoll(timeout);
+
+        uint64_t now = monotonicUs();
+        if(_capture)
+            _capture->tick(now);
+        _timers.advance(now, [this, now](Timer *t) {
+            Client *c = (Client *) t->data;
+            if(t == &c->rateTimer)
+                resume(c, now);
+            else
+                expire(c, now);
+        });
+
+        // Reconnect the lost links
+        for(LinkTarget *t : _targets)
+            if(t->c == NULL && now >= t->retryAt)
+                dial(t);
+
+        // Broadcast messages
+        while(!pktQueue.empty()) {
+            Frame *f = pktQueue.front();
+            uint32_t recipients = 0;
+
+            // Unicast to the owner of the destination, if it's known
+            Client *owner = NULL;
+            if(f->unicast) {
+                auto it = addrs.find(addrKey(f->group, f->dest));
+                if(it != addrs.end())
+                    owner = it->second;
+            }
+
+            if(owner != NULL && owner->link) {
+                // Behind another server, if it can still travel
+                if(f->hops >= 0 && owner != f->origin && !owner->mustDelete)
+                    sendLinks(f, owner);
+            } else if(owner != NULL) {
+                if(owner != f->origin && !owner->mustDelete &&
+                   enqueue(owner, f)) {
+                    markDirty(owner);
+                    recipients++;
+                }
+            } else if(f->group < members.size()) {
+                vector<Client *> &group = members[f->group];
+                for(size_t i = 0; i < group.size(); i++) {
+                    Client *c = group[i];
+                    if(c->mustDelete) continue; // Only active clients
+                    if(c == f->origin) continue; // No echo
+
+                    if(!enqueue(c, f)) continue;
+                    markDirty(c);
+                    recipients++;
+                }
+            }
+            if(owner == NULL && f->hops >= 0 && !_links.empty())
+                sendLinks(f, NULL);
+            // References of the recipients replace the one of the shard.
+            // Other shards may have already sent their copies.
+            _metrics.deliveries.inc(recipients);
+            f->ref(recipients);
+            uint64_t rx = f->rxTime;
+            bool delivered = f->delivered.load(std::memory_order_relaxed);
+            if(f->unref() && delivered)
+                _metrics.fanoutLatency.record(monotonicUs() - rx);
+            pktQueue.pop();
+        }
+
+        // Send everything queued, a single syscall per client
+        for(Client *c : dirtyClients) {
+            c->dirty = false;
+            if(!c->mustDelete)
+                flush(c);
+        }
+        dirtyClients.clear();
+
+        // Remove disconnected clients
+        size_t kept = 0;
+        for(Client *c : deadClients) {
+            // io_uring still references the client, make it give it back
+            if(c->ops > 0) {
+                if(!c->closing)
+                    ::shutdown(c->sock, SHUT_RDWR);
+                c->closing = true;
+                deadClients[kept++] = c;
+                continue;
+            }
+
+            SMOKE_INFO("[DISCONN] Say goodbye to " SMOKE_ADDR_FMT,
+                       SMOKE_ADDR_ARGS(c->in));
+            // Closing the socket also removes it from the epoll set
+            if(c->sock > 0) close(c->sock);
+            _timers.cancel(&c->timer);
+            _timers.cancel(&c->rateTimer);
+            for(Frame *f : c->outq)
+                f->unref();
+            dropHeld(c);
+            _metrics.connections.add(-1);
+            _metrics.queuedBytes.add(-(int64_t) c->outBytes);
+            _metrics.queuedFrames.add(-(int64_t) c->outq.size());
+            _metrics.learnedAddrs.add(-(int64_t) c->addrs.size());
+
+            // Forget the addresses still owned by the client
+            for(uint32_t k : c->addrs) {
+                auto it = addrs.find(k);
+                if(it != addrs.end() && it->second == c) {
+                    addrs.erase(it);
+                    _sources.erase(k);
+                    Group *g = _groups.get((uint16_t) (k >> 16));
+                    if(g->routes)
+                        g->routes->forget((uint16_t) k, _id);
+                }
+            }
+            leave(c);
+            if(c->link)
+                dropLink(c);
+
+            // Swap with the last one to erase in O(1)
+            Client *last = clients.back();
+            clients[c->idx] = last;
+            last->idx = c->idx;
+            clients.pop_back();
+            delete c;
+        }
+        deadClients.resize(kept);
+    }
+
+
+    /**
+     * Appends a pkt received by another shard. Can be called by any thread.
+     * The eventfd is written only if the reactor is not already signaled,
+     * so a burst of pkts costs a single wakeup.
+     *
+     * @param f - the pkt to broadcast to the clients of this shard.
+     *            The caller gives its reference to this reactor.
+     */
+    void post(Frame *f) {
+        inbox.push(f);
+        if(!_signaled.exchange(true, std::memory_order_acq_rel)) {
+            uint64_t one = 1;
+            if(write(_evfd, &one, sizeof(one)) < 0) {}
+        }
+    }
+
+
+    /**
+     * Wakes up the reactor if it's blocked inside poll().
+     */
+    void wakeup() {
+        uint64_t one = 1;
+        if(_evfd >= 0 && write(_evfd, &one, sizeof(one)) < 0) {}
+    }
+
+
+    /**
+     * Adds the counters of this shard to the given ones.
+     * Can be called by any thread.
+     *
+     * @param stats - where to add the counters.
+     */
+    void addShedStats(ShedStats &stats) const {
+        stats.oldestFrames += _shedOldest.load(std::memory_order_relaxed);
+        stats.lowPriorityFrames +=
+                _shedLowPriority.load(std::memory_order_relaxed);
+        stats.bytes += _shedBytes.load(std::memory_order_relaxed);
+        stats.disconnects += _shedDisconnects.load(std::memory_order_relaxed);
+    }
+
+
+    /**
+     * Records the telegrams received by the shard. Must be called before
+     * it starts polling.
+     *
+     * @param stream - the producer of the capture owned by the server.
+     */
+    void capture(KNX::CaptureStream *stream) {
+        _capture = stream;
+    }
+
+
+    /**
+     * Checks if the reactor uses io_uring.
+     */
+    bool uring() const {
+        return _uring;
+    }
+
+
+    /**
+     * Adds the metrics of this shard to the given ones.
+     * Can be called by any thread.
+     *
+     * @param snap - where to add the metrics.
+     */
+    void addMetrics(MetricsSnapshot &snap) const {
+        snap.add(_metrics);
+    }
+
+
+    /**
+     * Closes all sockets and clears the vector of the registered clients.
+     */
+    void shutdown() {
+        // Requests in flight fail at once, then the ring cancels them
+        if(_uring) {
+            for(Client *c : clients)
+                ::shutdown(c->sock, SHUT_RDWR);
+            closeUring();
+        }
+        if(_sock >= 0) close(_sock);
+        if(_usock >= 0) {
+            close(_usock);
+            unlink(_upath.c_str());
+        }
+        if(_epfd >= 0) close(_epfd);
+        if(_evfd >= 0) close(_evfd);
+        _sock = _usock = _epfd = _evfd = -1;
+        for(Client* c : clients) {
+            close(c->sock);
+            _timers.cancel(&c->timer);
+            _timers.cancel(&c->rateTimer);
+            for(Frame *f : c->outq)
+                f->unref();
+            dropHeld(c);
+            delete c;
+        }
+        clients.clear();
+        deadClients.clear();
+        dirtyClients.clear();
+        if(!_links.empty())
+            _fed.shards.fetch_and(~(1ULL << _id), std::memory_order_relaxed);
+        _links.clear();
+        for(LinkTarget *t : _targets)
+            delete t;
+        _targets.clear();
+        for(auto &a : addrs) {
+            Group *g = _groups.get((uint16_t) (a.first >> 16));
+            if(g->routes)
+                g->routes->forget((uint16_t) a.first, _id);
+        }
+        addrs.clear();
+        _sources.clear();
+        for(size_t i = 0; i < members.size(); i++)
+            if(!members[i].empty())
+                _groups.get((uint16_t) i)->shards.fetch_and(
+                        ~(1ULL << _id), std::memory_order_relaxed);
+        members.clear();
+        _rxPending.clear();
+        _starved.clear();
+
+        Frame *f;
+        while(inbox.pop(f))
+            f->unref();
+        for(; !pktQueue.empty(); pktQueue.pop())
+            pktQueue.front()->unref();
+    }
+
+private:
+    /**
+     * Waits for the sockets reported as ready by epoll, and handles them.
+     *
+     * @param timeout - max wait (ms).
+     */
+    void waitEpoll(int timeout) {
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(_epfd, events, MAX_EVENTS, timeout);
+
+        for(int i = 0; i < n; i++) {
+            // Handle new connections
+            if(events[i].data.ptr == &_sock ||
+               events[i].data.ptr == &_usock) {
+                acceptAll(*(int *) events[i].data.ptr);
+                continue;
+            }
+
+            // Handle pkts coming from the other shards
+            if(events[i].data.ptr == &_evfd) {
+                drainInbox();
+                continue;
+            }
+
+            Client *c = (Client *) events[i].data.ptr;
+            if(c->mustDelete) continue;
+
+            // Socket is writable again, resume the pending frames
+            if(events[i].events & EPOLLOUT)
+                markDirty(c);
+
+            if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                receive(c);
+        }
+    }
+
+    /**
+     * Accepts all the pending connections, until accept4() returns EAGAIN.
+     * Each new client is registered inside the epoll instance.
+     *
+     * @param lsock - the TCP or the unix listening socket.
+     */
+    void acceptAll(int lsock) {
+        while(true) {
+            struct sockaddr_in in;
+            socklen_t len = sizeof(in);
+            memset(&in, 0, sizeof(in));
+            int sock = accept4(lsock, lsock == _usock ? NULL :
+                               (struct sockaddr *) &in,
+                               lsock == _usock ? NULL : &len,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+            if(sock < 0) {
+                if(errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                if(errno != EAGAIN && errno != EWOULDBLOCK)
+                    SMOKE_ERROR(
+                            "[ERROR] Cannot accept a new connection");
+                return;
+            }
+
+            if(lsock == _usock)
+                in.sin_family = AF_UNIX;
+            addClient(sock, in, lsock == _usock && _utype == SOCK_SEQPACKET);
+        }
+    }
+
+    /**
+     * Registers a new connection, inside the epoll instance or with a
+     * multishot recv, as a member of the default group.
+     *
+     * @param sock - the accepted socket.
+     * @param in - the address of the peer.
+     * @param packet - TRUE if the socket is a SOCK_SEQPACKET one.
+     * @return the new client, NULL if it can't be registered.
+     */
+    Client *addClient(int sock, const struct sockaddr_in &in, bool packet) {
+        Client *c = new Client();
+        c->sock = sock;
+        c->id = (++_seq << 6) | (uint32_t) _id;
+        c->in = in;
+        c->packet = packet;
+
+        // Frames are already coalesced by flush(), send them at once
+        int one = 1;
+        if(in.sin_family == AF_INET)
+            setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if(!_uring) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = c;
+            if(epoll_ctl(_epfd, EPOLL_CTL_ADD, c->sock, &ev) < 0) {
+                SMOKE_ERROR("[ERROR] Cannot register a new connection");
+                close(c->sock);
+                delete c;
+                return NULL;
+            }
+        }
+
+        SMOKE_INFO("[NEWCONN] Say welcome to " SMOKE_ADDR_FMT,
+                   SMOKE_ADDR_ARGS(c->in));
+        _metrics.accepted.inc();
+        _metrics.connections.add(1);
+
+        c->idx = clients.size();
+        clients.push_back(c);
+        // Until it asks for another one, it's in the default group
+        join(c, _groups.get(0));
+
+        uint64_t now = monotonicUs();
+        c->timer.data = c;
+        c->rateTimer.data = c;
+        c->lastRx = now;
+        if(_ka.handshakeMs > 0) {
+            c->deadline = DEADLINE_HANDSHAKE;
+            _timers.schedule(&c->timer, now + _ka.handshakeMs * 1000ULL);
+        } else {
+            idle(c);
+        }
+
+        if(_uring)
+            armRecv(c);
+        return c;
+    }
+
+    /**
+     * Starts a connection to another server, that is a link from the
+     * beginning: the hello is queued at once, and sent as soon as the
+     * connection is established. If it fails, it's tried again later.
+     *
+     * @param t - the server to connect to.
+     */
+    void dial(LinkTarget *t) {
+        t->retryAt = monotonicUs() + LINK_RETRY_US;
+
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          0);
+        if(sock < 0)
+            return;
+        if(connect(sock, (struct sockaddr *) &t->in, sizeof(t->in)) < 0 &&
+           errno != EINPROGRESS) {
+            close(sock);
+            return;
+        }
+
+        Client *c = addClient(sock, t->in, false);
+        if(c == NULL)
+            return;
+        c->target = t;
+        t->c = c;
+        makeLink(c);
+    }
+
+    /**
+     * Turns a connection into a link to another server: it leaves its
+     * group and gets our hello.
+     *
+     * @param c - the connection.
+     */
+    void makeLink(Client *c) {
+        leave(c);
+        c->link = true;
+        c->greeted = true;
+        _links.push_back(c);
+        if(_links.size() == 1)
+            _fed.shards.fetch_or(1ULL << _id, std::memory_order_relaxed);
+
+        uint8_t hello[LINK_HELLO_SIZE];
+        control(c, hello, linkHello(hello, _fed.id, _fed.secret));
+        c->helloSent = true;
+    }
+
+    /**
+     * Queues a message that is not a telegram (a hello or a keepalive)
+     * to a client, with the priority of the system telegrams.
+     *
+     * @param c - the client.
+     * @param data - the message.
+     * @param len - the length of the message.
+     */
+    void control(Client *c, const uint8_t *data, size_t len) {
+        Frame *f = _pool.alloc();
+        memcpy(f->data, data, len);
+        f->len = (uint16_t) len;
+        f->priority = KNX::telegram::level::system;
+        f->rxTime = monotonicUs();
+        if(enqueue(c, f))
+            markDirty(c);
+        else
+            f->unref();
+    }
+
+    /**
+     * Queues the History of the group of a client to it, oldest first,
+     * before any telegram received after the request.
+     *
+     * @param c - the client asking for it.
+     * @param now - when the request has been received.
+     */
+    void catchup(Client *c, uint64_t now) {
+        HistoryRing *h = c->group ? c->group->history : NULL;
+        if(h == NULL)
+            return;
+
+        h->snapshot(_history, now);
+        uint64_t sent = 0;
+        for(const HistoryEntry &e : _history) {
+            Frame *f = _pool.alloc();
+            memcpy(f->data, e.data, e.len);
+            f->len = e.len;
+            f->priority = (e.data[0] >> 2) & 0x03;
+            f->group = c->group->id;
+            f->rxTime = now;
+            if(!enqueue(c, f)) {
+                f->unref();
+                if(c->mustDelete)
+                    return;
+                continue;
+            }
+            sent++;
+        }
+
+        SMOKE_DEBUG("[CATCHUP] %llu telegrams to " SMOKE_ADDR_FMT,
+                    (unsigned long long) sent, SMOKE_ADDR_ARGS(c->in));
+        _metrics.catchupTelegrams.inc(sent);
+        if(sent > 0)
+            markDirty(c);
+    }
+
+    /**
+     * Handles the expired deadline of a client: a handshake not completed
+     * or an unanswered probe disconnect it, a long silence sends a probe.
+     * The data received meanwhile only moves the next deadline.
+     *
+     * @param c - the client.
+     * @param now - the current time.
+     */
+    void expire(Client *c, uint64_t now) {
+        if(c->mustDelete)
+            return;
+
+        switch(c->deadline) {
+        case DEADLINE_HANDSHAKE:
+            if(c->link ? c->server == 0 : (!c->greeted && c->partialLen > 0)) {
+                SMOKE_INFO("[TIMEOUT] No handshake from " SMOKE_ADDR_FMT,
+                           SMOKE_ADDR_ARGS(c->in));
+                remove(c, DISC_TIMEOUT);
+                return;
+            }
+            idle(c);
+            break;
+
+        case DEADLINE_IDLE:
+            if(now < c->lastRx + _ka.idleMs * 1000ULL) {
+                idle(c);
+                break;
+            }
+            {
+                uint8_t ping = TCP_KEEPALIVE_PING;
+                control(c, &ping, 1);
+            }
+            _metrics.keepaliveProbes.inc();
+            c->deadline = DEADLINE_PROBE;
+            c->probedAt = now;
+            _timers.schedule(&c->timer, now + _ka.probeMs * 1000ULL);
+            break;
+
+        case DEADLINE_PROBE:
+            if(c->lastRx <= c->probedAt) {
+                SMOKE_INFO("[TIMEOUT] No answer from " SMOKE_ADDR_FMT,
+                           SMOKE_ADDR_ARGS(c->in));
+                remove(c, DISC_TIMEOUT);
+                return;
+            }
+            idle(c);
+            break;
+        }
+    }
+
+    /**
+     * Waits for the client to be silent for idleMs, if probes are enabled.
+     *
+     * @param c - the client.
+     */
+    void idle(Client *c) {
+        if(_ka.idleMs == 0)
+            return;
+        c->deadline = DEADLINE_IDLE;
+        _timers.schedule(&c->timer, c->lastRx + _ka.idleMs * 1000ULL);
+    }
+
+    /**
+     * Removes a lost link, scheduling a new connection if it was ours.
+     *
+     * @param c - the link.
+     */
+    void dropLink(Client *c) {
+        for(size_t i = 0; i < _links.size(); i++) {
+            if(_links[i] == c) {
+                _links[i] = _links.back();
+                _links.pop_back();
+                break;
+            }
+        }
+        if(_links.empty())
+            _fed.shards.fetch_and(~(1ULL << _id), std::memory_order_relaxed);
+
+        if(c->target) {
+            c->target->c = NULL;
+            c->target->retryAt = monotonicUs() + LINK_RETRY_US;
+        }
+        if(c->server != 0)
+            SMOKE_INFO("[UNLINK] Lost the link to server %08x", c->server);
+        else
+            SMOKE_DEBUG("[UNLINK] Cannot reach the server " SMOKE_ADDR_FMT,
+                        SMOKE_ADDR_ARGS(c->in));
+    }
+
+    /**
+     * Sends a telegram to the links of this shard, encoded once for all
+     * of them. It's never sent back to the link (or the server) it comes
+     * from.
+     *
+     * @param f - the telegram, with hops >= 0.
+     * @param only - the only link to use, NULL for all of them.
+     */
+    void sendLinks(Frame *f, Client *only) {
+        Frame *lf = NULL;
+        uint32_t recipients = 0;
+        for(size_t i = 0; i < _links.size(); i++) {
+            Client *l = only ? only : _links[i];
+            if(l->mustDelete || l == f->origin ||
+               (l->server != 0 && l->server == f->server))
+                continue;
+
+            if(lf == NULL) {
+                lf = _pool.alloc();
+                lf->len = (uint16_t) linkFrame(lf->data, f->server,
+                                               (uint8_t) f->hops,
+                                               _groups.get(f->group)->name,
+                                               f->data, f->len);
+                lf->priority = f->priority;
+                lf->src = f->src;
+                lf->dest = f->dest;
+                lf->unicast = f->unicast;
+                lf->group = f->group;
+                lf->origin = f->origin;
+                lf->server = f->server;
+                lf->hops = f->hops;
+                lf->rxTime = f->rxTime;
+            }
+            if(enqueue(l, lf)) {
+                markDirty(l);
+                recipients++;
+            }
+            if(only)
+                break;
+        }
+
+        if(lf == NULL)
+            return;
+        _metrics.deliveries.inc(recipients);
+        lf->ref(recipients);
+        lf->unref();
+    }
+
+    /**
+     * Adds a client to the members of a group handled by this reactor.
+     * The first local member marks the reactor inside the group, so the
+     * other shards start forwarding the telegrams of the group here.
+     *
+     * @param c - the client, not member of any group.
+     * @param g - the group to join.
+     */
+    void join(Client *c, Group *g) {
+        if(members.size() <= g->id)
+            members.resize(g->id + 1);
+
+        vector<Client *> &group = members[g->id];
+        c->group = g;
+        c->gidx = group.size();
+        group.push_back(c);
+        if(group.size() == 1)
+            g->shards.fetch_or(1ULL << _id, std::memory_order_relaxed);
+    }
+
+    /**
+     * Removes a client from the members of its group.
+     *
+     * @param c - the client.
+     */
+    void leave(Client *c) {
+        if(c->group == NULL)
+            return;
+
+        // Swap with the last one to erase in O(1)
+        vector<Client *> &group = members[c->group->id];
+        Client *last = group.back();
+        group[c->gidx] = last;
+        last->gidx = c->gidx;
+        group.pop_back();
+        if(group.empty())
+            c->group->shards.fetch_and(~(1ULL << _id),
+                                       std::memory_order_relaxed);
+        c->group = NULL;
+    }
+
+    /**
+     * Key of the addrs map: addresses are scoped by group.
+     */
+    static uint32_t addrKey(uint16_t group, uint16_t addr) {
+        return ((uint32_t) group << 16) | addr;
+    }
+
+    /**
+     * Moves the pkts received by the other shards into pktQueue.
+     * The flag is cleared before draining, so a pkt pushed meanwhile
+     * triggers a new wakeup instead of being lost.
+     */
+    void drainInbox() {
+        uint64_t cnt;
+        if(read(_evfd, &cnt, sizeof(cnt)) < 0) {}
+        takeInbox();
+    }
+
+    /**
+     * Moves the pkts received by the other shards into pktQueue, once
+     * the eventfd has been read.
+     */
+    void takeInbox() {
+        _signaled.store(false, std::memory_order_release);
+
+        Frame *f;
+        while(inbox.pop(f))
+            pktQueue.push(f);
+    }
+
+    /**
+     * Hands a pkt received from a local client to the shards that have
+     * to deliver it: only the owner of the destination for a unicast
+     * telegram whose address is known, all the ones with members of the
+     * group otherwise.
+     * The reference of the caller is moved to the recipients.
+     *
+     * @param f - the pkt to forward.
+     * @param g - the group of the sender.
+     */
+    void route(Frame *f, Group *g) {
+        int owner = (f->unicast && g->routes) ? g->routes->owner(f->dest) : -1;
+
+        if(owner >= 0 && owner != _id && (size_t) owner < _peers.size()) {
+            _metrics.telegramsForwarded.inc();
+            _peers[owner]->post(f);
+            return;
+        }
+
+        if(owner < 0) {
+            if(g->history && !f->unicast)
+                g->history->push(f->data, (uint8_t) f->len, f->rxTime);
+            uint64_t shards = g->shards.load(std::memory_order_relaxed);
+            if(f->hops >= 0)
+                shards |= _fed.shards.load(std::memory_order_relaxed);
+            for(size_t i = 0; i < _peers.size(); i++) {
+                if((int) i != _id && (shards & (1ULL << i))) {
+                    _metrics.telegramsForwarded.inc();
+                    f->ref();
+                    _peers[i]->post(f);
+                }
+            }
+        }
+        pktQueue.push(f);
+    }
+
+    /**
+     * Routes a telegram of a local client if its sender has tokens left,
+     * otherwise drops it or, with RATE_DELAY, holds it until it has. While
+     * some telegrams are held the new ones wait behind them, so the order
+     * of the client is kept.
+     *
+     * @param c - the client that sent the telegram.
+     * @param f - the telegram, with the reference of the caller.
+     * @param now - when the telegram has been received.
+     */
+    void admit(Client *c, Frame *f, uint64_t now) {
+        if(!_rl.enabled() || (c->held.empty() && take(c, f, now))) {
+            route(f, c->group);
+            return;
+        }
+
+        if(_rl.action == RATE_DROP || c->held.size() >= _rl.maxHeld) {
+            _metrics.rateDropped.inc();
+            f->unref();
+            return;
+        }
+
+        _metrics.rateDelayed.inc();
+        c->held.push_back(f);
+        _held++;
+        if(!c->rateTimer.pending())
+            _timers.schedule(&c->rateTimer, now + wait(c, f));
+    }
+
+    /**
+     * Routes the telegrams held for a client that have tokens now, and
+     * waits for the tokens of the next one.
+     *
+     * @param c - the client.
+     * @param now - the current time.
+     */
+    void resume(Client *c, uint64_t now) {
+        while(!c->held.empty() && !c->mustDelete) {
+            Frame *f = c->held.front();
+            if(!take(c, f, now)) {
+                _timers.schedule(&c->rateTimer, now + wait(c, f));
+                return;
+            }
+            c->held.pop_front();
+            _held--;
+            route(f, _groups.get(f->group));
+        }
+    }
+
+    /**
+     * Takes a token from the buckets of the connection and of the source
+     * of a telegram, only if both have one. Links never get here: their
+     * telegrams have already been limited by their first server.
+     *
+     * @param c - the client that sent the telegram.
+     * @param f - the telegram.
+     * @param now - the current time.
+     * @return TRUE - if the telegram can be routed.
+     *         FALSE - if its sender is over its rate.
+     */
+    bool take(Client *c, const Frame *f, uint64_t now) {
+        c->bucket.refill(_rl.rate, _rl.burst, now);
+        if(!c->bucket.ready())
+            return false;
+
+        if(_rl.sourceRate > 0) {
+            TokenBucket &b = _sources[addrKey(f->group, f->src)];
+            b.refill(_rl.sourceRate, _rl.sourceBurst, now);
+            if(!b.ready())
+                return false;
+            b.take();
+        }
+        c->bucket.take();
+        return true;
+    }
+
+    /**
+     * Gets the time (us) until the buckets have a token for a telegram,
+     * once take() failed.
+     */
+    uint64_t wait(Client *c, const Frame *f) {
+        uint64_t us = _rl.rate > 0 ? c->bucket.wait(_rl.rate) : 0;
+        if(_rl.sourceRate > 0) {
+            auto it = _sources.find(addrKey(f->group, f->src));
+            if(it != _sources.end() && it->second.wait(_rl.sourceRate) > us)
+                us = it->second.wait(_rl.sourceRate);
+        }
+        return us;
+    }
+
+    /**
+     * Releases the telegrams held for a client.
+     *
+     * @param c - the client.
+     */
+    void dropHeld(Client *c) {
+        _held -= c->held.size();
+        for(Frame *f : c->held)
+            f->unref();
+        c->held.clear();
+    }
+
+    /**
+     * Records that the given address lives behind a client.
+     *
+     * @param c - the client that sent a telegram.
+     * @param g - the group of the telegram.
+     * @param src - the source address of the telegram.
+     */
+    void learn(Client *c, Group *g, uint16_t src) {
+        uint32_t key = addrKey(g->id, src);
+        Client *&owner = addrs[key];
+        if(owner == c)
+            return;
+
+        // The address moved: only its last owner keeps it
+        if(owner != NULL) {
+            owner->addrs.erase(key);
+            _metrics.learnedAddrs.add(-1);
+        }
+        owner = c;
+        c->addrs.insert(key);
+        _metrics.learnedAddrs.add(1);
+        if(g->routes)
+            g->routes->learn(src, _id);
+    }
+
+    /**
+     * Reads the data available on the socket of a client and splits it
+     * into telegrams, using the same header-length rule of LinuxTCP.
+     * Every complete telegram is validated once and copied inside a new
+     * frame, that is queued to be broadcasted. Invalid telegrams are
+     * discarded, and the bytes of an incomplete one are kept for the
+     * next call.
+     * The first bytes sent by a client can be the preamble used by
+     * LinuxTCP to join a group (TCP_JOIN_MAGIC, name length, name).
+     *
+     * @param c - the client to read from.
+     */
+    void receive(Client *c) {
+        memcpy(_rxbuf, c->partial, c->partialLen);
+        ssize_t m = recv(c->sock, _rxbuf + c->partialLen,
+                         RECV_BUFSZ - c->partialLen, 0);
+
+        // Connection closed. Delete the socket
+        if(m <= 0) {
+            if(m < 0 && (errno == EAGAIN || errno == EINTR))
+                return;
+            remove(c, m == 0 ? DISC_PEER_CLOSED : DISC_RECV_ERROR);
+            return;
+        }
+        _metrics.bytesIn.inc((uint64_t) m);
+        parse(c, _rxbuf, c->partialLen + (size_t) m);
+    }
+
+    /**
+     * Same as receive(), for data already received inside a buffer.
+     *
+     * @param c - the client the data comes from.
+     * @param buf - the data (at most URING_BUFSZ bytes).
+     * @param len - the length of the data.
+     */
+    void consume(Client *c, const uint8_t *buf, size_t len) {
+        _metrics.bytesIn.inc(len);
+        if(c->partialLen == 0) {
+            parse(c, buf, len);
+            return;
+        }
+
+        // Rare: a telegram split between two reads
+        memcpy(_rxbuf, c->partial, c->partialLen);
+        memcpy(_rxbuf + c->partialLen, buf, len);
+        parse(c, _rxbuf, c->partialLen + len);
+    }
+
+    /**
+     * Splits the data received from a client into telegrams.
+     *
+     * @param c - the client the data comes from.
+     * @param data - the data, starting with the bytes kept by the last call.
+     * @param len - the length of the data.
+     */
+    void parse(Client *c, const uint8_t *data, size_t len) {
+        uint64_t now = monotonicUs();
+        c->lastRx = now;
+
+        SMOKE_DEBUG("[MSGPUSH] Broadcasting data from " SMOKE_ADDR_FMT,
+                    SMOKE_ADDR_ARGS(c->in));
+
+        size_t off = 0;
+
+        if(c->link || (!c->greeted && data[0] == LINK_HELLO_MAGIC)) {
+            parseLink(c, data, len, now);
+            return;
+        }
+
+        if(!c->greeted && data[0] == TCP_JOIN_MAGIC) {
+            // Checked before keeping anything: the preamble must fit partial
+            if(len >= 2 && data[1] > TCP_GROUP_NAME_MAX) {
+                SMOKE_ERROR("[ERROR] Group name too long");
+                remove(c, DISC_PROTOCOL);
+                return;
+            }
+            // Wait for the whole preamble
+            if(len < 2 || len < 2 + (size_t) data[1]) {
+                c->partialLen = (uint8_t) len;
+                memcpy(c->partial, data, len);
+                return;
+            }
+
+            Group *g = _groups.join((const char *) data + 2, data[1]);
+            if(g == NULL) {
+                SMOKE_ERROR("[ERROR] Cannot join the requested group");
+                remove(c, DISC_PROTOCOL);
+                return;
+            }
+
+            leave(c);
+            join(c, g);
+            off = 2 + data[1];
+        }
+        c->greeted = true;
+
+        while(off < len) {
+            if(keepalive(c, data[off])) {
+                off++;
+                continue;
+            }
+            if(data[off] == TCP_CATCHUP_MAGIC) {
+                catchup(c, now);
+                off++;
+                continue;
+            }
+            if(len - off < KNX::tg_size::hdr + 1)
+                break;
+
+            const uint8_t *raw = data + off;
+            uint8_t size = KNX::telegram::rawSize(raw);
+            if(len - off < size)
+                break;
+
+            if(!KNX::telegram::rawCheck(raw)) {
+                _metrics.telegramsInvalid.inc();
+                // Bad ctrl byte: the stream is out of sync, skip a byte
+                if((raw[0] & 0b11010011) != 0b10010000)
+                    off++;
+                else
+                    off += size;
+                continue;
+            }
+
+            Frame *f = frame(c, c->group, raw, size, now);
+            learn(c, c->group, f->src);
+            admit(c, f, now);
+            off += size;
+        }
+
+        // A record never continues into the next one
+        if(c->packet && off < len) {
+            _metrics.telegramsInvalid.inc();
+            off = len;
+        }
+
+        c->partialLen = (uint8_t) (len - off);
+        memcpy(c->partial, data + off, c->partialLen);
+    }
+
+    /**
+     * Splits the data received from a link into hellos and telegrams.
+     * A connection becomes a link only with the whole hello in and its
+     * secret right, and no frame is taken before the hello of the other
+     * server. The telegrams that come back to this server are dropped,
+     * the others are delivered to the local members of their group
+     * (created if needed) and, while they have hops left, to the other
+     * links.
+     *
+     * @param c - the link (or the connection sending its hello).
+     * @param data - the data, starting with the bytes kept by the last call.
+     * @param len - the length of the data.
+     * @param now - when the data has been received.
+     */
+    void parseLink(Client *c, const uint8_t *data, size_t len, uint64_t now) {
+        if(!c->link) {
+            if(len < LINK_HELLO_SIZE && _fed.secured) {
+                c->partialLen = (uint8_t) len;
+                memcpy(c->partial, data, len);
+                return;
+            }
+            if(!_fed.secured || !linkTrusted(data, _fed.secret)) {
+                SMOKE_ERROR("[ERROR] Link hello refused");
+                remove(c, DISC_PROTOCOL);
+                return;
+            }
+            makeLink(c);
+        }
+
+        size_t off = 0;
+        while(off < len) {
+            const uint8_t *p = data + off;
+            size_t left = len - off;
+
+            if(keepalive(c, p[0])) {
+                off++;
+                continue;
+            }
+
+            if(p[0] == LINK_HELLO_MAGIC) {
+                if(left < LINK_HELLO_SIZE)
+                    break;
+                if(!linkTrusted(p, _fed.secret)) {
+                    SMOKE_ERROR("[ERROR] Link hello refused");
+                    remove(c, DISC_PROTOCOL);
+                    return;
+                }
+                c->server = linkServer(p);
+                if(c->server == _fed.id) {
+                    SMOKE_ERROR("[ERROR] Link to this same server");
+                    remove(c, DISC_PROTOCOL);
+                    return;
+                }
+                SMOKE_INFO("[LINK] Linked to server %08x", c->server);
+                off += LINK_HELLO_SIZE;
+                continue;
+            }
+
+            if(p[0] != LINK_FRAME_MAGIC || c->server == 0 ||
+               (left >= 7 && p[6] > TCP_GROUP_NAME_MAX)) {
+                SMOKE_ERROR("[ERROR] Invalid link frame");
+                remove(c, DISC_PROTOCOL);
+                return;
+            }
+            if(left < 7 + (size_t) KNX::tg_size::hdr + 1 ||
+               left < 7 + (size_t) p[6] + KNX::tg_size::hdr + 1)
+                break;
+
+            size_t nlen = p[6];
+            const uint8_t *raw = p + 7 + nlen;
+            uint8_t size = KNX::telegram::rawSize(raw);
+            if(left < 7 + nlen + size)
+                break;
+            off += 7 + nlen + size;
+
+            uint32_t server = linkServer(p);
+            if(!KNX::telegram::rawCheck(raw)) {
+                _metrics.telegramsInvalid.inc();
+                continue;
+            }
+            // Gone around a loop
+            if(server == _fed.id)
+                continue;
+
+            Group *g = _groups.join((const char *) p + 7, nlen);
+            if(g == NULL)
+                continue;
+
+            Frame *f = frame(c, g, raw, size, now);
+            f->server = server;
+            f->hops = p[5] > 0 ? (int8_t) (p[5] - 1) : (int8_t) -1;
+            learn(c, g, f->src);
+            route(f, g);
+        }
+
+        c->partialLen = (uint8_t) (len - off);
+        memcpy(c->partial, data + off, c->partialLen);
+    }
+
+    /**
+     * Handles a keepalive byte found between two telegrams: a probe of a
+     * linked server is answered, an answer is only accounted by lastRx.
+     *
+     * @param c - the client that sent the byte.
+     * @param b - the byte.
+     * @return TRUE - if it's a keepalive.
+     *         FALSE - otherwise.
+     */
+    bool keepalive(Client *c, uint8_t b) {
+        if(b == TCP_KEEPALIVE_PING) {
+            uint8_t pong = TCP_KEEPALIVE_PONG;
+            control(c, &pong, 1);
+            return true;
+        }
+        return b == TCP_KEEPALIVE_PONG;
+    }
+
+    /**
+     * Stores a valid telegram inside a new frame.
+     *
+     * @param c - the client the telegram comes from.
+     * @param g - the group of the telegram.
+     * @param raw - the telegram.
+     * @param size - the length of the telegram.
+     * @param now - when the telegram has been received.
+     * @return the frame, with the reference of the caller.
+     */
+    Frame *frame(Client *c, Group *g, const uint8_t *raw, uint8_t size,
+                 uint64_t now) {
+        Frame *f = _pool.alloc();
+        memcpy(f->data, raw, size);
+        f->len = size;
+        f->priority = (raw[0] >> 2) & 0x03;
+        f->src = (uint16_t) ((raw[1] << 8) | raw[2]);
+        f->dest = (uint16_t) ((raw[3] << 8) | raw[4]);
+        f->unicast = !(raw[5] & 0x80) &&
+                     f->dest != KNX::telegram::address::broadcast;
+        f->group = g->id;
+        f->origin = c;
+        f->server = _fed.id;
+        f->hops = (int8_t) _fed.hops;
+        f->rxTime = now;
+        _metrics.telegramsIn.inc();
+        if(_capture)
+            record(c, g, raw, size, now);
+        return f;
+    }
+
+    /**
+     * Appends a telegram to the capture, preceded by the name of its
+     * group the first time the shard records one of it.
+     *
+     * @param c - the sender.
+     * @param g - the group of the telegram.
+     * @param raw - the telegram.
+     * @param size - the length of the telegram.
+     * @param now - when the telegram has been received.
+     */
+    void record(Client *c, Group *g, const uint8_t *raw, uint8_t size,
+                uint64_t now) {
+        if(_named.size() <= g->id)
+            _named.resize(g->id + 1, false);
+        if(!_named[g->id]) {
+            _named[g->id] = true;
+            size_t len = g->name.size() < UINT8_MAX ? g->name.size()
+                                                    : UINT8_MAX;
+            _capture->record(KNX::CAPTURE_GROUP, 0, g->id,
+                             (const uint8_t *) g->name.data(),
+                             (uint8_t) len, now);
+        }
+        _capture->record(KNX::CAPTURE_TELEGRAM, c->id, g->id, raw, size, now);
+    }
+
+    /**
+     * Sends as many queued frames as possible with a single sendmsg().
+     * A partial write is resumed from outOffset as soon as epoll reports
+     * the socket as writable, so slow clients are not disconnected.
+     * With io_uring the sendmsg() is only queued, and submitted with the
+     * ones of the other clients by the next iteration.
+     *
+     * @param c - the client to flush.
+     */
+    void flush(Client *c) {
+        if(_uring) {
+            submit(c);
+            return;
+        }
+
+        while(!c->outq.empty()) {
+            struct iovec iov[MAX_IOV];
+            size_t cnt = 0, total = 0;
+            for(auto it = c->outq.begin();
+                it != c->outq.end() && cnt < MAX_IOV; ++it, ++cnt) {
+                if(c->packet && total + (*it)->len > UNIX_RECORD_MAX)
+                    break;
+                size_t off = (cnt == 0) ? c->outOffset : 0;
+                iov[cnt].iov_base = (*it)->data + off;
+                iov[cnt].iov_len = (*it)->len - off;
+                total += iov[cnt].iov_len;
+            }
+
+            struct msghdr msg = {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = cnt;
+            ssize_t sent = sendmsg(c->sock, &msg, MSG_NOSIGNAL);
+            _metrics.sendCalls.inc();
+
+            if(sent < 0) {
+                if(errno == EINTR)
+                    continue;
+                if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                    _metrics.shortWrites.inc();
+                    break;
+                }
+                remove(c, DISC_SEND_ERROR);
+                return;
+            }
+            _metrics.bytesOut.inc((uint64_t) sent);
+            if((size_t) sent < total)
+                _metrics.shortWrites.inc();
+
+            release(c, (size_t) sent);
+            if(c->outOffset > 0)
+                break;
+        }
+
+        // Wait for EPOLLOUT only while there's something left
+        bool pending = !c->outq.empty();
+        if(pending != c->waitingOut) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN | (pending ? (uint32_t) EPOLLOUT : 0u);
+            ev.data.ptr = c;
+            epoll_ctl(_epfd, EPOLL_CTL_MOD, c->sock, &ev);
+            c->waitingOut = pending;
+        }
+    }
+
+    /**
+     * Releases the frames completely sent to a client.
+     *
+     * @param c - the client.
+     * @param sent - #Bytes sent, starting from outOffset.
+     */
+    void release(Client *c, size_t sent) {
+        size_t left = sent;
+        while(left > 0) {
+            Frame *f = c->outq.front();
+            size_t rem = f->len - c->outOffset;
+            if(left < rem) {
+                c->outOffset += left;
+                break;
+            }
+            left -= rem;
+            c->outOffset = 0;
+            c->outBytes -= f->len;
+            c->outq.pop_front();
+            _metrics.queuedBytes.add(-(int64_t) f->len);
+            _metrics.queuedFrames.add(-1);
+
+            // The last copy sent gives the fan-out latency
+            if(!f->delivered.load(std::memory_order_relaxed))
+                f->delivered.store(true, std::memory_order_relaxed);
+            uint64_t rx = f->rxTime;
+            if(f->unref())
+                _metrics.fanoutLatency.record(monotonicUs() - rx);
+        }
+
+        if(c->congested && c->outBytes <= _bp.lowWatermark)
+            c->congested = false;
+    }
+    /**
+     * Creates the io_uring instance and its provided buffers.
+     *
+     * @return TRUE - if io_uring can be used.
+     */
+    bool initUring() {
+#ifdef SMOKE_HAVE_URING
+        if(_ring.init(URING_ENTRIES, URING_CQ_ENTRIES) &&
+           _ring.setupBuffers(0, URING_BUFFERS, URING_BUFSZ))
+            return true;
+        _ring.close();
+#endif
+        return false;
+    }
+
+    /**
+     * Destroys the io_uring instance, if any.
+     */
+    void closeUring() {
+#ifdef SMOKE_HAVE_URING
+        _ring.close();
+#endif
+    }
+
+    /**
+     * Kind of request, saved inside the low bits of its user_data
+     * (the rest is the Client, if any).
+     */
+    enum UringOp {
+        URING_ACCEPT = 1,
+        URING_EVENT = 2,
+        URING_RECV = 3,
+        URING_SEND = 4,
+        URING_ACCEPT_UNIX = 5,
+    };
+
+#ifdef SMOKE_HAVE_URING
+    static uint64_t tag(const Client *c, UringOp op) {
+        return (uint64_t) (uintptr_t) c | op;
+    }
+#endif
+
+    /**
+     * Submits the pending requests and handles the completions, waiting
+     * for the first one. A single io_uring_enter() for the whole iteration.
+     *
+     * @param timeout - max wait (ms).
+     */
+    void waitUring(int timeout) {
+#ifdef SMOKE_HAVE_URING
+        int ret = _ring.enter(1, timeout);
+        if(ret < 0 && ret != -ETIME && ret != -EINTR && ret != -EBUSY)
+            SMOKE_ERROR("[ERROR] io_uring_enter failed (%d)", -ret);
+
+        _ring.reap([this](const struct io_uring_cqe *cqe) {
+            complete(cqe);
+        });
+
+        // Like epoll does with a recv() per socket, don't take more pkts
+        // than a send can carry before broadcasting them. The data left
+        // keeps its buffers: when they run out the recvs stop, and TCP
+        // slows down the senders.
+        bool recycled = false;
+        while(!_rxPending.empty() && pktQueue.size() < URING_IOV) {
+            RxBuffer b = _rxPending.front();
+            _rxPending.pop_front();
+            b.c->ops--;
+            if(b.len == 0) {
+                remove(b.c, DISC_PEER_CLOSED);
+                continue;
+            }
+            if(!b.c->mustDelete)
+                consume(b.c, _ring.buffer(b.bid), b.len);
+            _ring.recycle(b.bid);
+            recycled = true;
+        }
+        _ring.publish();
+
+        // Restart the recvs stopped because there were no more buffers
+        if(recycled) {
+            for(Client *c : _starved) {
+                c->ops--;
+                if(!c->mustDelete)
+                    armRecv(c);
+            }
+            _starved.clear();
+        }
+#endif
+    }
+
+    /**
+     * Starts accepting the new connections with a multishot accept.
+     *
+     * @param op - URING_ACCEPT for the TCP socket, URING_ACCEPT_UNIX for
+     *             the unix one.
+     */
+    void armAccept(UringOp op) {
+#ifdef SMOKE_HAVE_URING
+        struct io_uring_sqe *sqe = _ring.sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = op == URING_ACCEPT ? _sock : _usock;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = tag(NULL, op);
+#else
+        (void) op;
+#endif
+    }
+
+    /**
+     * Waits for the next wakeup of the other shards with a read of the
+     * eventfd.
+     */
+    void armEvent() {
+#ifdef SMOKE_HAVE_URING
+        struct io_uring_sqe *sqe = _ring.sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = _evfd;
+        sqe->addr = (uint64_t) (uintptr_t) &_evcount;
+        sqe->len = sizeof(_evcount);
+        sqe->user_data = tag(NULL, URING_EVENT);
+#endif
+    }
+
+    /**
+     * Starts receiving the data of a client with a multishot recv: every
+     * completion brings a provided buffer, until the client is closed or
+     * the buffers are exhausted.
+     *
+     * @param c - the client.
+     */
+    void armRecv(Client *c) {
+#ifdef SMOKE_HAVE_URING
+        struct io_uring_sqe *sqe = _ring.sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = c->sock;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = tag(c, URING_RECV);
+        c->ops++;
+#else
+        (void) c;
+#endif
+    }
+
+    /**
+     * Queues a sendmsg() of the frames of a client, unless one is
+     * already in flight. Frames referenced by the request are never shed.
+     *
+     * @param c - the client to flush.
+     */
+    void submit(Client *c) {
+#ifdef SMOKE_HAVE_URING
+        if(c->inflight > 0 || c->outq.empty())
+            return;
+
+        if(c->iov == NULL)
+            c->iov = new struct iovec[URING_IOV];
+
+        size_t cnt = 0, total = 0;
+        for(auto it = c->outq.begin();
+            it != c->outq.end() && cnt < URING_IOV; ++it, ++cnt) {
+            if(c->packet && total + (*it)->len > UNIX_RECORD_MAX)
+                break;
+            size_t off = (cnt == 0) ? c->outOffset : 0;
+            c->iov[cnt].iov_base = (*it)->data + off;
+            c->iov[cnt].iov_len = (*it)->len - off;
+            total += c->iov[cnt].iov_len;
+        }
+
+        memset(&c->msg, 0, sizeof(c->msg));
+        c->msg.msg_iov = c->iov;
+        c->msg.msg_iovlen = cnt;
+        c->msgBytes = total;
+        c->inflight = cnt;
+
+        struct io_uring_sqe *sqe = _ring.sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = c->sock;
+        sqe->addr = (uint64_t) (uintptr_t) &c->msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = tag(c, URING_SEND);
+        c->ops++;
+        _metrics.sendCalls.inc();
+#else
+        (void) c;
+#endif
+    }
+
+#ifdef SMOKE_HAVE_URING
+    /**
+     * Handles a completion.
+     *
+     * @param cqe - the completion.
+     */
+    void complete(const struct io_uring_cqe *cqe) {
+        UringOp op = (UringOp) (cqe->user_data & 7);
+        Client *c = (Client *) (uintptr_t) (cqe->user_data & ~(uint64_t) 7);
+        bool more = cqe->flags & IORING_CQE_F_MORE;
+        int res = cqe->res;
+
+        switch(op) {
+        case URING_ACCEPT:
+        case URING_ACCEPT_UNIX:
+            if(res >= 0) {
+                struct sockaddr_in in;
+                socklen_t len = sizeof(in);
+                memset(&in, 0, sizeof(in));
+                if(op == URING_ACCEPT)
+                    getpeername(res, (struct sockaddr *) &in, &len);
+                else
+                    in.sin_family = AF_UNIX;
+                addClient(res, in,
+                          op == URING_ACCEPT_UNIX && _utype == SOCK_SEQPACKET);
+            } else if(res != -EINTR && res != -ECONNABORTED) {
+                SMOKE_ERROR("[ERROR] Cannot accept a new connection");
+            }
+            if(!more && (op == URING_ACCEPT ? _sock : _usock) >= 0)
+                armAccept(op);
+            break;
+
+        case URING_EVENT:
+            takeInbox();
+            armEvent();
+            break;
+
+        case URING_RECV:
+            if(!more)
+                c->ops--;
+            if(cqe->flags & IORING_CQE_F_BUFFER) {
+                uint16_t bid = (uint16_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                if(res > 0) {
+                    // Parsed by waitUring(), the client must live until then
+                    RxBuffer b = {c, bid, (uint32_t) res};
+                    _rxPending.push_back(b);
+                    c->ops++;
+                } else {
+                    _ring.recycle(bid);
+                }
+            }
+            if(res == 0) {
+                // Closed once the data received before is parsed
+                RxBuffer b = {c, 0, 0};
+                _rxPending.push_back(b);
+                c->ops++;
+                break;
+            } else if(res == -ENOBUFS && !c->mustDelete) {
+                // Restarted as soon as some buffers are given back
+                _starved.push_back(c);
+                c->ops++;
+                break;
+            } else if(res < 0 && res != -ENOBUFS && res != -EINTR &&
+                      res != -EAGAIN) {
+                remove(c, DISC_RECV_ERROR);
+            }
+            if(!more && !c->mustDelete)
+                armRecv(c);
+            break;
+
+        case URING_SEND:
+            c->ops--;
+            c->inflight = 0;
+            if(c->mustDelete)
+                break;
+            if(res < 0) {
+                if(res == -EINTR || res == -EAGAIN)
+                    markDirty(c);
+                else
+                    remove(c, DISC_SEND_ERROR);
+                break;
+            }
+            _metrics.bytesOut.inc((uint64_t) res);
+            if((size_t) res < c->msgBytes)
+                _metrics.shortWrites.inc();
+            release(c, (size_t) res);
+            if(!c->outq.empty())
+                markDirty(c);
+            break;
+        }
+    }
+#endif
+    /**
+     * Appends a frame to the outbound queue of a client, applying the
+     * Backpressure policy if the queue is congested or full.
+     *
+     * @param c - the recipient.
+     * @param f - the frame to send.
+     * @return TRUE - if the frame has been queued (the caller must add
+     *                a reference for it).
+     *         FALSE - if it has been shed or the client disconnected.
+     */
+    bool enqueue(Client *c, Frame *f) {
+        bool lowPriority = _bp.policy == SHED_DROP_LOW_PRIORITY &&
+                           !isProtected(f);
+
+        if(c->congested && lowPriority) {
+            shed(_shedLowPriority, f);
+            return false;
+        }
+
+        // Make room for the new frame
+        while(c->outBytes + f->len > _bp.maxBytes ||
+              c->outq.size() + 1 > _bp.maxFrames) {
+            if(_bp.policy == SHED_DISCONNECT) {
+                _shedDisconnects.fetch_add(1, std::memory_order_relaxed);
+                remove(c, DISC_SHED);
+                return false;
+            }
+
+            // Frames partially sent or in flight can't be dropped
+            size_t first = (c->inflight > 0) ? c->inflight :
+                           ((c->outOffset > 0) ? 1 : 0);
+            size_t victim = c->outq.size();
+
+            if(_bp.policy == SHED_DROP_LOW_PRIORITY) {
+                for(size_t i = first; i < c->outq.size(); i++) {
+                    if(!isProtected(c->outq[i])) {
+                        victim = i;
+                        break;
+                    }
+                }
+                // Nothing better to drop than the new frame
+                if(victim == c->outq.size() && lowPriority) {
+                    shed(_shedLowPriority, f);
+                    return false;
+                }
+            }
+
+            if(victim == c->outq.size())
+                victim = first;
+
+            // Only the partially sent frame is left, shed the new one
+            if(victim >= c->outq.size()) {
+                shed(_shedOldest, f);
+                return false;
+            }
+
+            Frame *old = c->outq[victim];
+            if(_bp.policy == SHED_DROP_LOW_PRIORITY && !isProtected(old))
+                shed(_shedLowPriority, old);
+            else
+                shed(_shedOldest, old);
+
+            c->outBytes -= old->len;
+            c->outq.erase(c->outq.begin() + victim);
+            _metrics.queuedBytes.add(-(int64_t) old->len);
+            _metrics.queuedFrames.add(-1);
+            old->unref();
+        }
+
+        c->outq.push_back(f);
+        c->outBytes += f->len;
+        _metrics.queuedBytes.add(f->len);
+        _metrics.queuedFrames.add(1);
+        if(c->outBytes > _bp.highWatermark)
+            c->congested = true;
+        return true;
+    }
+
+    /**
+     * Updates the counters of the shed frames.
+     *
+     * @param counter - the counter of the reason why the frame is shed.
+     * @param f - the shed frame.
+     */
+    void shed(std::atomic<uint64_t> &counter, const Frame *f) {
+        counter.fetch_add(1, std::memory_order_relaxed);
+        _shedBytes.fetch_add(f->len, std::memory_order_relaxed);
+    }
+
+    /**
+     * Alarm and system telegrams are the last ones to be shed.
+     */
+    static bool isProtected(const Frame *f) {
+        return f->priority == KNX::telegram::level::alarm ||
+               f->priority == KNX::telegram::level::system;
+    }
 
-    Client() : sock(0), mustDelete(false) {}
+    /**
+     * Adds a client to the list of the ones to flush at the end of poll().
+     */
+    void markDirty(Client *c) {
+        if(c->dirty) return;
+        c->dirty = true;
+        dirtyClients.push_back(c);
+    }
+
+    /**
+     * Marks a client as closed. It's deleted at the end of poll(),
+     * so pointers held by pending epoll events stay valid.
+     *
+     * @param c - the client.
+     * @param reason - why it's disconnected.
+     */
+    void remove(Client *c, DisconnectReason reason) {
+        if(c->mustDelete) return;
+        _metrics.disconnects[reason].inc();
+        c->mustDelete = true;
+        deadClients.push_back(c);
+    }
+
+    /**
+     * Used to save the index of the reactor inside _peers.
+     */
+    const int _id;
+    /**
+     * Used to reach the other shards of the server.
+     */
+    vector<Reactor *> &_peers;
+    /**
+     * Used to save the groups of the server.
+     */
+    GroupTable &_groups;
+    /**
+     * Used to save the federation state of the server.
+     */
+    Federation &_fed;
+    /**
+     * Used to save the links to other servers handled by this shard, and
+     * the servers this shard connects to.
+     */
+    vector<Client *> _links;
+    vector<LinkTarget *> _targets;
+    /**
+     * Used to save the local members of each group, indexed by group id.
+     */
+    vector<vector<Client *>> members;
+    /**
+     * Used to save the owner of each address (scoped by group) learned
+     * by this shard.
+     */
+    std::unordered_map<uint32_t, Client *> addrs;
+    /**
+     * Used to save the limits of the outbound queues.
+     */
+    const Backpressure _bp;
+    /**
+     * Used to save the deadlines of the clients, and the timers waiting
+     * for them.
+     */
+    const Keepalive _ka;
+    TimerWheel _timers;
+    /**
+     * Used to save the limits of the senders, the buckets of the KNX
+     * sources (keyed like addrs) and the #Telegrams held by the clients.
+     */
+    const RateLimit _rl;
+    std::unordered_map<uint32_t, TokenBucket> _sources;
+    size_t _held;
+    /**
+     * Used to record the telegrams received, NULL if they are not, and
+     * the groups already named inside the capture.
+     */
+    KNX::CaptureStream *_capture;
+    vector<bool> _named;
+    /**
+     * Used to copy the History sent to a client catching up.
+     */
+    vector<HistoryEntry> _history;
+    /**
+     * Used to number the connections of the shard.
+     */
+    uint32_t _seq;
+    /**
+     * Used to allocate the frames received by the clients of the shard.
+     */
+    FramePool _pool;
+    /**
+     * Used to receive the data of the clients.
+     */
+    uint8_t _rxbuf[RECV_BUFSZ];
+    /**
+     * Used to save the pkts that has to be broadcasted.
+     */
+    queue<Frame *> pktQueue;
+    /**
+     * Used to receive the pkts from the other shards.
+     */
+    MPSCQueue<Frame *> inbox;
+    /**
+     * Used to save the connected clients.
+     */
+    vector<Client *> clients;
+    /**
+     * Used to save the clients that have to be removed at the end of poll().
+     */
+    vector<Client *> deadClients;
+    /**
+     * Used to save the clients with new frames to send.
+     */
+    vector<Client *> dirtyClients;
+    /**
+     * Used to save the listening socket of the shard.
+     */
+    int _sock;
+    /**
+     * Used to save the optional AF_UNIX listening socket, its type and its
+     * path (removed by shutdown()).
+     */
+    int _usock;
+    int _utype;
+    std::string _upath;
+    /**
+     * Used to save the epoll instance watching all the sockets.
+     */
+    int _epfd;
+    /**
+     * Used by the other shards to wake up this one.
+     */
+    int _evfd;
+    /**
+     * TRUE if the reactor uses io_uring instead of epoll.
+     */
+    bool _uring;
+#ifdef SMOKE_HAVE_URING
+    /**
+     * Used to drive the sockets with ENGINE_URING.
+     */
+    Uring _ring;
+#endif
+    /**
+     * Used to save the data received with io_uring and not yet parsed
+     * (len is 0 when the client closed the connection).
+     */
+    struct RxBuffer {
+        Client *c;
+        uint16_t bid;
+        uint32_t len;
+    };
+    std::deque<RxBuffer> _rxPending;
+    /**
+     * Used to save the clients whose recv stopped for lack of buffers.
+     */
+    vector<Client *> _starved;
+    /**
+     * Used to read the eventfd with io_uring.
+     */
+    uint64_t _evcount;
+    /**
+     * TRUE if the eventfd has been written and not yet drained.
+     */
+    std::atomic<bool> _signaled;
+    /**
+     * Counters of what has been shed, written only by the reactor thread.
+     */
+    std::atomic<uint64_t> _shedOldest;
+    std::atomic<uint64_t> _shedLowPriority;
+    std::atomic<uint64_t> _shedBytes;
+    std::atomic<uint64_t> _shedDisconnects;
+    /**
+     * Used to save the metrics of the shard.
+     */
+    Metrics _metrics;
 };
 
 /**
@@ -37,20 +2362,35 @@ public:
     /**
      * Constructor of Libsmoke Server.
      * Sets _ready to false in order to say that the server is not yet initialized.
+     *
+     * @param reactors - #Reactors (threads) sharing the clients. The first
+     *                   one is driven by run(), the others by their own thread.
      */
-    ServerSmoke() : _ready(false) {}
+    explicit ServerSmoke(size_t reactors = 1) :
+            _numReactors(reactors == 0 ? 1 :
+                         (reactors > MAX_REACTORS ? MAX_REACTORS : reactors)),
+            _groups(NULL), _engine(ENGINE_EPOLL), _ready(false) {
+        // Only needs to differ from the ids of the linked servers
+        std::random_device rd;
+        do {
+            _fed.id = rd();
+        } while(_fed.id == 0);
+    }
 
 
     /**
      * Checks if the server is already initialized.
-     * If not, creates the socket with the given IP and PORT.
+     * If not, creates a socket for each reactor with the given IP and PORT.
+     * With more than one reactor the sockets share the PORT using
+     * SO_REUSEPORT, so the kernel spreads the new connections between them.
      *
      * @param addr - IP addr of the socket to create.
      * @param port - PORT of the socket to create.
+     * @param backlog - max length of the queue of pending connections.
      * @return TRUE - if socket is created with no errors and is listening.
      *         FALSE - otherwise.
      */
-    bool init(const char *addr, int port) {
+    bool init(const char *addr, int port, int backlog = LISTEN_BACKLOG) {
         if(_ready)
             return false;
 
@@ -60,128 +2400,333 @@ public:
         in.sin_port = htons(port);
         in.sin_addr.s_addr = inet_addr(addr);
 
-        _sock = socket(AF_INET, SOCK_STREAM, 0);
-        if(_sock < 0) {
-            fprintf(stderr, "Cannot create server socket\n");
-            _ready = false;
-            return false;
-        }
-
-        if(bind(_sock, (struct sockaddr *)&in, sizeof(in)) < 0) {
-            fprintf(stderr, "Cannot bind on port %u\n", port);
-            close(_sock);
-            _ready = false;
-            return false;
+        _groups = new GroupTable(_numReactors > 1, _history);
+        for(size_t i = 0; i < _numReactors; i++) {
+            Reactor *r = new Reactor((int) i, _reactors, *_groups, _fed, _bp,
+                                     _ka, _rl);
+            _reactors.push_back(r);
+            if(!r->init(in, backlog, _numReactors > 1, _engine)) {
+                shutdown();
+                return false;
+            }
         }
 
-        if(listen(_sock, 10) < 0) {
-            fprintf(stderr, "Cannot start listening\n");
-            close(_sock);
-            _ready = false;
-            return false;
+        if(!_capturePath.empty()) {
+            if(!_capture.open(_capturePath.c_str())) {
+                SMOKE_ERROR("[ERROR] Cannot create the capture %s",
+                            _capturePath.c_str());
+                shutdown();
+                return false;
+            }
+            for(Reactor *r : _reactors)
+                r->capture(_capture.stream());
         }
 
         // Socket ready and listening
         _ready = true;
+        for(size_t i = 1; i < _reactors.size(); i++) {
+            Reactor *r = _reactors[i];
+            _threads.emplace_back([this, r]() {
+                while(_ready.load(std::memory_order_relaxed))
+                    r->poll();
+            });
+        }
+
         banner();
         return true;
     }
 
 
     /**
-     * Handles connections : registering the new ones or deleting the closed ones.
-     * Also used to broadcast messages to all connected clients.
+     * Sets the limits of the outbound queue of every client.
+     * Must be called before init().
+     *
+     * @param bp - the limits and the policy used to enforce them.
+     * @return TRUE - if the limits are set.
+     *         FALSE - if the server is already initialized.
      */
-    void run() {
-        char buf[BUFSZ];
-        if(!_ready) return;
-        int max_id = _sock;
+    bool setBackpressure(const Backpressure &bp) {
+        if(_ready)
+            return false;
+        _bp = bp;
+        return true;
+    }
 
-        FD_ZERO(&_rfds);
-        FD_SET(_sock, &_rfds);
 
-        // Register all sockets
-        for(size_t i=0; i < clients.size(); i++) {
-            Client *c = clients[i];
-            if(c->sock == -1) {
-                c->mustDelete = true;
-                continue;
-            }
+    /**
+     * Sets the deadlines of the clients: the keepalive probes of the silent
+     * ones and the time to complete a handshake. Must be called before
+     * init().
+     *
+     * @param ka - the deadlines, 0 to disable one of them.
+     * @return TRUE - if the deadlines are set.
+     *         FALSE - if the server is already initialized.
+     */
+    bool setKeepalive(const Keepalive &ka) {
+        if(_ready)
+            return false;
+        _ka = ka;
+        return true;
+    }
 
-            max_id = (max_id > c->sock) ? max_id : c->sock;
-            FD_SET(c->sock,  &_rfds);
-        }
+
+    /**
+     * Sets the limits of the telegrams each sender can broadcast: per
+     * connection and, optionally, per KNX source address. The telegrams
+     * over the limits are dropped or delayed, and counted in the metrics.
+     * Must be called before init().
+     *
+     * @param rl - the limits and what to do with the telegrams over them.
+     * @return TRUE - if the limits are set.
+     *         FALSE - if the server is already initialized.
+     */
+    bool setRateLimit(const RateLimit &rl) {
+        if(_ready)
+            return false;
+        _rl = rl;
+        return true;
+    }
 
 
-        struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = 100000;
-        int n = select(max_id + 1, &_rfds, NULL, NULL, &tv);
+    /**
+     * Keeps the recent telegrams of each group, sent to the clients that
+     * ask for them (see LinuxTCP::catchup()) before the live ones, so a
+     * node restarting doesn't need the others to send their state again.
+     * Must be called before init().
+     *
+     * @param h - #Telegrams kept for each group and their max age.
+     * @return TRUE - if the history is set.
+     *         FALSE - if the server is already initialized.
+     */
+    bool setHistory(const History &h) {
+        if(_ready)
+            return false;
+        _history = h;
+        return true;
+    }
 
-        if(n > 0) {
-            // Handle new connections
-            if(FD_ISSET(_sock, &_rfds)) {
-                Client *c = new Client();
 
-                socklen_t len = sizeof(c->in);
-                c->sock = accept(_sock, (struct sockaddr *) &(c->in), &len);
+    /**
+     * Records every telegram received (with its time, connection and
+     * group) inside a capture file, that smoke_replay can send again.
+     * The reactors only copy the telegrams into memory allocated by
+     * init(), a thread of its own writes them: when the disk can't keep
+     * up they are dropped from the capture, never delayed.
+     * Must be called before init().
+     *
+     * @param path - the capture file, created (or truncated) by init().
+     * @return TRUE - if the capture is set.
+     *         FALSE - if the server is already initialized.
+     */
+    bool setCapture(const char *path) {
+        if(_ready || path == NULL)
+            return false;
+        _capturePath = path;
+        return true;
+    }
 
-                if(c->sock < 0) {
-                    fprintf(stderr,
-                            "[ERROR] Cannot accept a new connection\n");
-                    delete c;
-                }
 
-                printf("[NEWCONN] Say welcome to %s:%d\n",
-                       inet_ntoa(c->in.sin_addr), c->in.sin_port);
+    /**
+     * Sets the I/O engine of the reactors. Must be called before init().
+     * If io_uring is not available, init() falls back to epoll.
+     *
+     * @param engine - the engine to use.
+     * @return TRUE - if the engine is set.
+     *         FALSE - if the server is already initialized.
+     */
+    bool setEngine(IoEngine engine) {
+        if(_ready)
+            return false;
+        _engine = engine;
+        return true;
+    }
 
-                clients.push_back(c);
-            }
 
-            for(size_t i = 0; i < clients.size(); i++) {
-                Client *c = clients[i];
-                if(c->mustDelete) continue;
-                if(FD_ISSET(c->sock, &_rfds)) {
-                    int m = recv(c->sock, buf, BUFSZ, 0);
+    /**
+     * Gets the I/O engine actually used by the reactors.
+     */
+    IoEngine engine() const {
+        return (_ready && _reactors[0]->uring()) ? ENGINE_URING : ENGINE_EPOLL;
+    }
 
-                    // Connection closed. Delete the socket
-                    if(m <= 0) {
-                        c->mustDelete = true;
-                    } else if(m > 0) {
-                        printf("[MSGPUSH] Broadcasting data from %s:%d\n",
-                               inet_ntoa(c->in.sin_addr), c->in.sin_port);
-                        vector<uint8_t> temp(buf, buf+m);
-                        pktQueue.push(temp);
-                    }
-                }
-            }
 
-            // Broadcast messages
-            while(!pktQueue.empty()) {
-                vector<uint8_t> &data = pktQueue.front();
-                for(size_t i = 0; i < clients.size(); i++) {
-                    Client *c = clients[i];
-                    if(c->mustDelete) continue; // Only active clients
+    /**
+     * Gets the counters of what has been shed by all the reactors.
+     *
+     * @return the sum of the counters of each shard.
+     */
+    ShedStats shedStats() const {
+        ShedStats stats;
+        for(const Reactor *r : _reactors)
+            r->addShedStats(stats);
+        return stats;
+    }
 
-                    if(send(c->sock, (const char *) &data[0],
-                            data.size(), 0) < (ssize_t)data.size())
-                        c->mustDelete = true;
-                }
-                pktQueue.pop();
-            }
-
-            // Remove disconnected clients
-            for(size_t i = 0; i < clients.size(); i++) {
-                Client *c = clients[i];
-                if(c->mustDelete) {
-                    printf("[DISCONN] Say goodbye to %s:%d\n",
-                           inet_ntoa(c->in.sin_addr), c->in.sin_port);
-                    if(c->sock > 0) close(c->sock);
-                    clients.erase(clients.begin() + i--);
-                    delete c;
-                }
-            }
-        }
+
+    /**
+     * Gets the metrics of all the reactors. Can be called by any thread.
+     *
+     * @return the sum of the metrics of each shard.
+     */
+    MetricsSnapshot metrics() const {
+        MetricsSnapshot snap;
+        for(const Reactor *r : _reactors)
+            r->addMetrics(snap);
+        return snap;
+    }
+
+
+    /**
+     * Accepts also the local clients (see KNX::LinuxUnix) on a AF_UNIX
+     * socket. They are handled by the first reactor, in the same groups
+     * of the TCP ones. With SOCK_SEQPACKET every record carries whole
+     * telegrams, so they are never reassembled.
+     * Must be called after init() and before run().
+     *
+     * @param path - path of the socket to create.
+     * @param type - SOCK_SEQPACKET or SOCK_STREAM.
+     * @param backlog - max length of the queue of pending connections.
+     * @return TRUE - if the socket is listening.
+     *         FALSE - if the server is not initialized or the socket
+     *                 cannot be created.
+     */
+    bool listenUnix(const char *path, int type = SOCK_SEQPACKET,
+                    int backlog = LISTEN_BACKLOG) {
+        if(!_ready)
+            return false;
+        return _reactors[0]->listenUnix(path, type, backlog);
+    }
+
+
+    /**
+     * Sets how many servers a telegram can cross after the first one it's
+     * forwarded to. 0 (the default) fits a full mesh of servers, where each
+     * one is linked to all the others; a tree needs its diameter - 1.
+     * Must be called before init().
+     *
+     * @param hops - the extra hops, at most LINK_MAX_HOPS.
+     * @return TRUE - if the hops are set.
+     *         FALSE - if the server is already initialized or hops is
+     *                 too big.
+     */
+    bool setLinkHops(uint8_t hops) {
+        if(_ready || hops > LINK_MAX_HOPS)
+            return false;
+        _fed.hops = hops;
+        return true;
+    }
+
+
+    /**
+     * Sets the secret shared by the federated servers, carried by the
+     * hellos of their links: a connection whose hello doesn't carry it is
+     * dropped, and without a secret no link is accepted at all. It's sent
+     * in clear, so the links must cross a trusted network.
+     * Must be called before init().
+     *
+     * @param secret - the secret, up to LINK_SECRET_SIZE chars.
+     * @return TRUE - if the secret is set.
+     *         FALSE - if the server is already initialized or the secret
+     *                 is empty or too long.
+     */
+    bool setLinkSecret(const char *secret) {
+        size_t len = strlen(secret);
+        if(_ready || len == 0 || len > LINK_SECRET_SIZE)
+            return false;
+        memset(_fed.secret, 0, LINK_SECRET_SIZE);
+        memcpy(_fed.secret, secret, len);
+        _fed.secured = true;
+        return true;
+    }
+
+
+    /**
+     * Links this server to another ServerSmoke: the telegrams of every
+     * group are forwarded once to the other server, that hands them to
+     * its local members, and vice versa. The link is reconnected whenever
+     * it's lost. The other server doesn't need to add this one, but both
+     * need the same setLinkSecret().
+     * Handled by the first reactor. Must be called after init() and
+     * before run().
+     *
+     * @param addr - IP addr of the other server.
+     * @param port - PORT of the other server (the one of its clients).
+     * @return TRUE - if the link is added.
+     *         FALSE - if the server is not initialized or has no secret.
+     */
+    bool addPeer(const char *addr, int port) {
+        if(!_ready || !_fed.secured)
+            return false;
+
+        struct sockaddr_in in;
+        memset(&in, 0, sizeof(in));
+        in.sin_family = AF_INET;
+        in.sin_port = htons(port);
+        in.sin_addr.s_addr = inet_addr(addr);
+        _reactors[0]->connectLink(in);
+        return true;
+    }
+
+
+    /**
+     * Gets the random id of the server, carried by the telegrams it
+     * forwards to the other servers.
+     */
+    uint32_t serverId() const {
+        return _fed.id;
+    }
+
+
+    /**
+     * Exports the metrics (and the shed counters) in plain text on a TCP
+     * port, served by its own thread. Must be called after init().
+     *
+     * @param port - PORT of the stats endpoint.
+     * @param addr - IP addr of the stats endpoint, localhost by default.
+     * @return TRUE - if the endpoint is listening.
+     *         FALSE - if the server is not initialized or the socket
+     *                 cannot be created.
+     */
+    bool exportMetrics(int port, const char *addr = "127.0.0.1") {
+        if(!_ready)
+            return false;
+        return _stats.start(addr, port, [this]() {
+            std::string out;
+            metrics().render(out);
+
+            ShedStats shed = shedStats();
+            char buf[768];
+            int n = snprintf(buf, sizeof(buf),
+                    "# TYPE smoke_capture_records_total counter\n"
+                    "smoke_capture_records_total{result=\"written\"} %llu\n"
+                    "smoke_capture_records_total{result=\"dropped\"} %llu\n"
+                    "# TYPE smoke_shed_frames_total counter\n"
+                    "smoke_shed_frames_total{reason=\"oldest\"} %llu\n"
+                    "smoke_shed_frames_total{reason=\"low_priority\"} %llu\n"
+                    "# TYPE smoke_shed_bytes_total counter\n"
+                    "smoke_shed_bytes_total %llu\n"
+                    "# TYPE smoke_log_dropped_total counter\n"
+                    "smoke_log_dropped_total %llu\n",
+                    (unsigned long long) _capture.records(),
+                    (unsigned long long) _capture.dropped(),
+                    (unsigned long long) shed.oldestFrames,
+                    (unsigned long long) shed.lowPriorityFrames,
+                    (unsigned long long) shed.bytes,
+                    (unsigned long long) Logger::instance().dropped());
+            if(n > 0)
+                out.append(buf, (size_t) n);
+            return out;
+        });
+    }
+
+
+    /**
+     * Runs a single iteration of the first reactor.
+     * The other reactors, if any, are running on their own threads.
+     */
+    void run() {
+        if(!_ready) return;
+        _reactors[0]->poll();
     }
 
 
@@ -195,25 +2740,39 @@ public:
 
 
     /**
-     * Used to close all sockets and clear the vector of the registered clients.
+     * Used to stop the reactor threads, close all sockets and clear
+     * the vector of the registered clients.
      * Sets also _ready to false, so the server can be initialized again.
      */
     void shutdown() {
+        _stats.stop();
         _ready = false;
-        close(_sock);
-        for(Client* c : clients) {
-            close(c->sock);
-            delete c;
-        }
-        clients.clear();
+        for(Reactor *r : _reactors)
+            r->wakeup();
+        for(std::thread &t : _threads)
+            t.join();
+        _threads.clear();
+
+        // Frames can be referenced by any shard, release them all first
+        for(Reactor *r : _reactors)
+            r->shutdown();
+        _capture.close();
+        for(Reactor *r : _reactors)
+            delete r;
+        _reactors.clear();
+        delete _groups;
+        _groups = NULL;
     }
 
 
     /**
      * Banner displayed when the server initialization is completed
-     * and it's waiting for clients to connect.
+     * and it's waiting for clients to connect. Skipped when the INFO logs
+     * are, so tools printing their results on stdout stay parsable.
      */
     void banner() {
+        if(!Logger::enabled(SMOKE_LOG_INFO))
+            return;
         printf(
                 " ********************************************************************************\n"
                 " * $$\\       $$\\ $$\\        $$$$$$\\                          $$\\                 \n"
@@ -228,25 +2787,58 @@ public:
 
 private:
     /**
-     * Used to save the pkts that has to be broadcasted.
+     * Used to save the shards of the server.
      */
-    queue<vector<uint8_t>> pktQueue;
+    vector<Reactor *> _reactors;
     /**
-     * Used to save the connected clients.
+     * Used to save the threads running the reactors (all but the first one).
      */
-    vector<Client *> clients;
+    vector<std::thread> _threads;
     /**
-     * Used to save the listening socket of the server.
+     * Used to save the #Reactors requested.
      */
-    int _sock;
+    const size_t _numReactors;
+    /**
+     * Used to save the groups joined by the clients.
+     */
+    GroupTable *_groups;
+    /**
+     * Used to save the id of the server and the state of its links.
+     */
+    Federation _fed;
+    /**
+     * Used to save the limits of the outbound queues.
+     */
+    Backpressure _bp;
+    /**
+     * Used to save the deadlines of the clients.
+     */
+    Keepalive _ka;
+    /**
+     * Used to save the limits of the senders.
+     */
+    RateLimit _rl;
+    /**
+     * Used to save the recent telegrams kept for each group.
+     */
+    History _history;
+    /**
+     * Used to save the path of the capture file and to write it.
+     */
+    std::string _capturePath;
+    KNX::Capture _capture;
+    /**
+     * Used to save the I/O engine requested.
+     */
+    IoEngine _engine;
     /**
      * Used to check if the server is already initialized or not.
      */
-    bool _ready;
+    std::atomic<bool> _ready;
     /**
-     * Selection Function used for socket.
+     * Used to serve the metrics, if exported.
      */
-    fd_set _rfds;
+    StatsEndpoint _stats;
 };
 
-#endif //LIBSMOKE_SERVER_H
\ No newline at end of file
+#endif //LIBSMOKE_SERVER_H
@@ -0,0 +1,203 @@
+#ifndef LIBSMOKE_TIMER_H
+#define LIBSMOKE_TIMER_H
+
+#include <cstddef>
+#include <cstdint>
+
+/* Resolution of the wheel, the timeouts are in the order of seconds */
+#define TIMER_TICK_US 10000
+/* 4 levels of 64 slots: up to 2^24 ticks (~46 hours) without cascading
+ * twice */
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+/**
+ * Node of a TimerWheel, embedded inside the object it belongs to, so
+ * scheduling never allocates.
+ */
+struct Timer {
+    Timer *prev;
+    Timer *next;
+    /**
+     * Tick of the expiration.
+     */
+    uint64_t expires;
+    /**
+     * The object the timer belongs to.
+     */
+    void *data;
+
+    Timer() : prev(NULL), next(NULL), expires(0), data(NULL) {}
+
+    /**
+     * Checks if the timer is scheduled.
+     */
+    bool pending() const {
+        return next != NULL;
+    }
+};
+
+/**
+ * Hierarchical timing wheel: the first level has a slot for each of the
+ * next TIMER_SLOTS ticks, every next level a slot for TIMER_SLOTS slots of
+ * the previous one. Scheduling and cancelling a timer cost O(1), and each
+ * tick only touches the timers of a single slot, plus the ones of a higher
+ * level slot (moved down) once every TIMER_SLOTS ticks.
+ * Not thread-safe, it belongs to a single reactor.
+ */
+class TimerWheel {
+public:
+
+    /**
+     * Constructor of the wheel, every slot is an empty circular list.
+     */
+    TimerWheel() : _now(0), _count(0) {
+        for(size_t l = 0; l < TIMER_LEVELS; l++) {
+            for(size_t s = 0; s < TIMER_SLOTS; s++) {
+                _slots[l][s].prev = &_slots[l][s];
+                _slots[l][s].next = &_slots[l][s];
+            }
+        }
+    }
+
+
+    /**
+     * Sets the current time, before scheduling the first timer.
+     *
+     * @param nowUs - the current time (monotonicUs()).
+     */
+    void start(uint64_t nowUs) {
+        _now = nowUs / TIMER_TICK_US;
+    }
+
+
+    /**
+     * Schedules (or reschedules) a timer. A time already passed fires at
+     * the next tick.
+     *
+     * @param t - the timer.
+     * @param whenUs - when it expires (monotonicUs()).
+     */
+    void schedule(Timer *t, uint64_t whenUs) {
+        cancel(t);
+        uint64_t tick = (whenUs + TIMER_TICK_US - 1) / TIMER_TICK_US;
+        t->expires = tick > _now ? tick : _now + 1;
+        insert(t);
+        _count++;
+    }
+
+
+    /**
+     * Cancels a timer, if it's scheduled.
+     *
+     * @param t - the timer.
+     */
+    void cancel(Timer *t) {
+        if(!t->pending())
+            return;
+        detach(t);
+        _count--;
+    }
+
+
+    /**
+     * Moves the wheel up to the current time, calling fire(Timer *) for
+     * every expired timer, already cancelled so it can be scheduled again.
+     *
+     * @param nowUs - the current time (monotonicUs()).
+     * @param fire - called for each expired timer.
+     */
+    template<typename F>
+    void advance(uint64_t nowUs, F fire) {
+        uint64_t target = nowUs / TIMER_TICK_US;
+        while(_now < target) {
+            _now++;
+
+            // Move down the timers of the levels reaching a new slot,
+            // the highest first so they can go down more than one level
+            size_t top = 0;
+            while(top + 1 < TIMER_LEVELS &&
+                  (_now & ((1ULL << ((top + 1) * TIMER_SLOT_BITS)) - 1)) == 0)
+                top++;
+            for(size_t l = top; l > 0; l--)
+                cascade(l);
+
+            Timer &head = _slots[0][_now & (TIMER_SLOTS - 1)];
+            while(head.next != &head) {
+                Timer *t = head.next;
+                detach(t);
+                _count--;
+                fire(t);
+            }
+        }
+    }
+
+
+    /**
+     * Gets the #Timers scheduled.
+     */
+    size_t size() const {
+        return _count;
+    }
+
+private:
+    /**
+     * Puts a timer inside the slot of the lowest level that can hold it.
+     * Timers too far away wait inside the last slot of the last level, and
+     * are placed again when it's reached.
+     */
+    void insert(Timer *t) {
+        uint64_t delta = t->expires - _now;
+        uint64_t at = t->expires;
+        size_t l = 0;
+        while(l + 1 < TIMER_LEVELS &&
+              delta >= (1ULL << ((l + 1) * TIMER_SLOT_BITS)))
+            l++;
+        if(delta >= (1ULL << (TIMER_LEVELS * TIMER_SLOT_BITS)))
+            at = _now + (1ULL << (TIMER_LEVELS * TIMER_SLOT_BITS)) - 1;
+
+        Timer &head = _slots[l][(at >> (l * TIMER_SLOT_BITS)) &
+                                (TIMER_SLOTS - 1)];
+        t->prev = head.prev;
+        t->next = &head;
+        head.prev->next = t;
+        head.prev = t;
+    }
+
+    /**
+     * Places again the timers of the current slot of a level.
+     */
+    void cascade(size_t l) {
+        Timer &head = _slots[l][(_now >> (l * TIMER_SLOT_BITS)) &
+                                (TIMER_SLOTS - 1)];
+        Timer *t = head.next;
+        head.prev = head.next = &head;
+        while(t != &head) {
+            Timer *next = t->next;
+            insert(t);
+            t = next;
+        }
+    }
+
+    static void detach(Timer *t) {
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+        t->prev = t->next = NULL;
+    }
+
+    /**
+     * Used to save the current tick.
+     */
+    uint64_t _now;
+    /**
+     * Used to save the #Timers scheduled.
+     */
+    size_t _count;
+    /**
+     * Used to save the slots, each one is the head of a circular list.
+     */
+    Timer _slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+#endif //LIBSMOKE_TIMER_H
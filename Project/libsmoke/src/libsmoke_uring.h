@@ -0,0 +1,366 @@
+#ifndef LIBSMOKE_URING_H
+#define LIBSMOKE_URING_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * The io_uring engine needs the multishot recv and the provided buffer
+ * rings of Linux 6.0, so it's compiled only with recent enough headers.
+ */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define SMOKE_HAVE_URING 1
+#endif
+#endif
+#endif
+
+#ifdef SMOKE_HAVE_URING
+
+/**
+ * Minimal io_uring wrapper built on the raw syscalls, so no library is
+ * needed. Only the owner thread can use it.
+ * SQEs are filled by the caller and submitted all together by enter(),
+ * which also waits for the completions: a whole iteration of a reactor
+ * costs a single syscall.
+ * It also owns a ring of provided buffers, used by the multishot recvs:
+ * the kernel picks a free buffer for every completion, and the caller
+ * gives it back with recycle() once the data has been consumed.
+ */
+class Uring {
+public:
+
+    /**
+     * Constructor of the wrapper. No ring is created until init().
+     */
+    Uring() : _fd(-1), _sq(NULL), _cq(NULL), _sqes(NULL),
+              _sqSize(0), _cqSize(0), _sqesSize(0), _sqTail(0),
+              _bufRing(NULL), _bufs(NULL), _bufRingSize(0), _bufsSize(0),
+              _bufCount(0), _bufSize(0), _bufTail(0) {}
+
+
+    /**
+     * Destructor of the wrapper. It just calls the close() method.
+     */
+    ~Uring() {
+        close();
+    }
+
+
+    /**
+     * Creates the ring and checks that the kernel supports all the
+     * features used by the reactor.
+     *
+     * @param entries - #SQEs.
+     * @param cqEntries - #CQEs, bigger to absorb the multishot completions.
+     * @return TRUE - if the ring is ready.
+     *         FALSE - if io_uring is not available or too old.
+     */
+    bool init(unsigned entries, unsigned cqEntries) {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+        p.cq_entries = cqEntries;
+
+        _fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+        if(_fd < 0) {
+            _fd = -1;
+            return false;
+        }
+
+        if(!(p.features & IORING_FEAT_EXT_ARG) ||
+           !(p.features & IORING_FEAT_NODROP) || !supports(IORING_OP_SEND_ZC)) {
+            // Older than 6.0: no multishot recv
+            close();
+            return false;
+        }
+
+        _sqSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+        _cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if(p.features & IORING_FEAT_SINGLE_MMAP)
+            _sqSize = _cqSize = (_sqSize > _cqSize) ? _sqSize : _cqSize;
+
+        _sq = map(_sqSize, IORING_OFF_SQ_RING);
+        if(_sq == NULL) {
+            close();
+            return false;
+        }
+        if(p.features & IORING_FEAT_SINGLE_MMAP) {
+            _cq = _sq;
+        } else {
+            _cq = map(_cqSize, IORING_OFF_CQ_RING);
+            if(_cq == NULL) {
+                close();
+                return false;
+            }
+        }
+
+        _sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+        _sqes = (struct io_uring_sqe *) map(_sqesSize, IORING_OFF_SQES);
+        if(_sqes == NULL) {
+            close();
+            return false;
+        }
+
+        _sqHead = (uint32_t *) (_sq + p.sq_off.head);
+        _sqTailK = (uint32_t *) (_sq + p.sq_off.tail);
+        _sqMask = *(uint32_t *) (_sq + p.sq_off.ring_mask);
+        _sqEntries = p.sq_entries;
+        _cqHead = (uint32_t *) (_cq + p.cq_off.head);
+        _cqTail = (uint32_t *) (_cq + p.cq_off.tail);
+        _cqMask = *(uint32_t *) (_cq + p.cq_off.ring_mask);
+        _cqes = (struct io_uring_cqe *) (_cq + p.cq_off.cqes);
+
+        // SQEs are always used in order
+        uint32_t *array = (uint32_t *) (_sq + p.sq_off.array);
+        for(uint32_t i = 0; i < p.sq_entries; i++)
+            array[i] = i;
+        _sqTail = *_sqTailK;
+        return true;
+    }
+
+
+    /**
+     * Registers the ring of provided buffers used by the recvs.
+     *
+     * @param group - id of the buffer group.
+     * @param count - #Buffers, a power of two.
+     * @param size - size of each buffer.
+     * @return TRUE - if the buffers are registered.
+     *         FALSE - otherwise.
+     */
+    bool setupBuffers(uint16_t group, unsigned count, unsigned size) {
+        _bufRingSize = count * sizeof(struct io_uring_buf);
+        _bufsSize = (size_t) count * size;
+        // Mapped (not allocated) memory: a late write of the kernel after
+        // close() faults instead of corrupting the heap
+        void *r = mmap(NULL, _bufRingSize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        void *b = mmap(NULL, _bufsSize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(r == MAP_FAILED || b == MAP_FAILED) {
+            if(r != MAP_FAILED) munmap(r, _bufRingSize);
+            if(b != MAP_FAILED) munmap(b, _bufsSize);
+            return false;
+        }
+        _bufRing = (struct io_uring_buf_ring *) r;
+        _bufs = (uint8_t *) b;
+
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t) (uintptr_t) _bufRing;
+        reg.ring_entries = count;
+        reg.bgid = group;
+        if(syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PBUF_RING,
+                   &reg, 1) < 0) {
+            freeBuffers();
+            return false;
+        }
+
+        _bufCount = count;
+        _bufSize = size;
+        _bufTail = 0;
+        for(unsigned i = 0; i < count; i++)
+            recycle((uint16_t) i);
+        publish();
+        return true;
+    }
+
+
+    /**
+     * Gets a free SQE, submitting the pending ones if the ring is full.
+     * Its fields are cleared.
+     *
+     * @return the SQE, to be filled by the caller.
+     */
+    struct io_uring_sqe *sqe() {
+        uint32_t head = __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+        if(_sqTail - head >= _sqEntries)
+            enter(0, 0);
+        struct io_uring_sqe *s = &_sqes[_sqTail & _sqMask];
+        memset(s, 0, sizeof(*s));
+        _sqTail++;
+        return s;
+    }
+
+
+    /**
+     * Submits all the pending SQEs and, if asked, waits for completions.
+     *
+     * @param waitNr - #Completions to wait for.
+     * @param timeoutMs - max time to wait.
+     * @return the #SQEs submitted, or a negative errno (-ETIME when the
+     *         timeout expires).
+     */
+    int enter(unsigned waitNr, int timeoutMs) {
+        __atomic_store_n(_sqTailK, _sqTail, __ATOMIC_RELEASE);
+        unsigned toSubmit = _sqTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+
+        unsigned flags = 0;
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+        void *argp = NULL;
+        size_t argsz = 0;
+        if(waitNr > 0) {
+            ts.tv_sec = timeoutMs / 1000;
+            ts.tv_nsec = (long long) (timeoutMs % 1000) * 1000000;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (uint64_t) (uintptr_t) &ts;
+            flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argsz = sizeof(arg);
+        }
+
+        long ret = syscall(__NR_io_uring_enter, _fd, toSubmit, waitNr, flags,
+                           argp, argsz);
+        return ret < 0 ? -errno : (int) ret;
+    }
+
+
+    /**
+     * Calls f for every available completion, then frees them.
+     *
+     * @param f - called with a const struct io_uring_cqe *.
+     * @return #Completions handled.
+     */
+    template<typename F>
+    unsigned reap(F f) {
+        uint32_t head = *_cqHead;
+        uint32_t tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+        for(uint32_t i = head; i != tail; i++)
+            f(&_cqes[i & _cqMask]);
+        __atomic_store_n(_cqHead, tail, __ATOMIC_RELEASE);
+        return tail - head;
+    }
+
+
+    /**
+     * Gets a provided buffer.
+     *
+     * @param bid - the id of the buffer, taken from the flags of a CQE.
+     */
+    uint8_t *buffer(uint16_t bid) const {
+        return _bufs + (size_t) bid * _bufSize;
+    }
+
+
+    /**
+     * Gives a buffer back to the kernel. It's visible only after publish().
+     *
+     * @param bid - the id of the buffer.
+     */
+    void recycle(uint16_t bid) {
+        // Not _bufRing->bufs: in C++ the empty struct of __DECLARE_FLEX_ARRAY
+        // moves it 8 bytes forward
+        struct io_uring_buf *b = (struct io_uring_buf *) _bufRing +
+                                 (_bufTail & (_bufCount - 1));
+        // Fields set one by one: resv of the first entry is the ring tail
+        b->addr = (uint64_t) (uintptr_t) buffer(bid);
+        b->len = _bufSize;
+        b->bid = bid;
+        _bufTail++;
+    }
+
+
+    /**
+     * Makes the recycled buffers visible to the kernel.
+     */
+    void publish() {
+        __atomic_store_n(&_bufRing->tail, _bufTail, __ATOMIC_RELEASE);
+    }
+
+
+    /**
+     * Checks if the ring is ready.
+     */
+    bool ready() const {
+        return _fd >= 0;
+    }
+
+
+    /**
+     * Destroys the ring (cancelling all its requests) and the buffers.
+     */
+    void close() {
+        if(_fd >= 0) ::close(_fd);
+        _fd = -1;
+        if(_sqes) munmap(_sqes, _sqesSize);
+        if(_cq && _cq != _sq) munmap(_cq, _cqSize);
+        if(_sq) munmap(_sq, _sqSize);
+        _sq = _cq = NULL;
+        _sqes = NULL;
+        freeBuffers();
+    }
+
+private:
+    uint8_t *map(size_t size, off_t off) {
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, _fd, off);
+        return p == MAP_FAILED ? NULL : (uint8_t *) p;
+    }
+
+    /**
+     * Checks if an opcode is supported by the kernel.
+     */
+    bool supports(uint8_t op) {
+        size_t len = sizeof(struct io_uring_probe) +
+                     256 * sizeof(struct io_uring_probe_op);
+        struct io_uring_probe *probe = (struct io_uring_probe *) calloc(1, len);
+        if(probe == NULL)
+            return false;
+        bool ok = syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PROBE,
+                          probe, 256) >= 0 &&
+                  op <= probe->last_op &&
+                  (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+        free(probe);
+        return ok;
+    }
+
+    void freeBuffers() {
+        if(_bufRing) munmap(_bufRing, _bufRingSize);
+        if(_bufs) munmap(_bufs, _bufsSize);
+        _bufRing = NULL;
+        _bufs = NULL;
+    }
+
+    int _fd;
+    uint8_t *_sq;
+    uint8_t *_cq;
+    struct io_uring_sqe *_sqes;
+    size_t _sqSize;
+    size_t _cqSize;
+    size_t _sqesSize;
+    /**
+     * Used to save the SQEs filled but not yet published to the kernel.
+     */
+    uint32_t _sqTail;
+    uint32_t *_sqHead;
+    uint32_t *_sqTailK;
+    uint32_t _sqMask;
+    uint32_t _sqEntries;
+    uint32_t *_cqHead;
+    uint32_t *_cqTail;
+    uint32_t _cqMask;
+    struct io_uring_cqe *_cqes;
+    /**
+     * Used to save the provided buffers.
+     */
+    struct io_uring_buf_ring *_bufRing;
+    uint8_t *_bufs;
+    size_t _bufRingSize;
+    size_t _bufsSize;
+    unsigned _bufCount;
+    unsigned _bufSize;
+    uint16_t _bufTail;
+};
+
+#endif //SMOKE_HAVE_URING
+
+#endif //LIBSMOKE_URING_H
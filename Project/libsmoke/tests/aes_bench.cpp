@@ -0,0 +1,421 @@
+#include "../src/libsmoke_cipher.h"
+#include <tiny-AES-c-master/aes.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * AES-256-CTR benchmark: checks that every engine gives the same output
+ * (the one of tiny-AES, used by the older clients, and the NIST test
+ * vectors), then measures the throughput of each one in bytes per cycle
+ * (TSC cycles on x86, ns elsewhere) for messages of different sizes.
+ * With AES-NI, the polarssl column is the PolarSSL code encrypting a
+ * block at a time with AES-NI too.
+ * The cost of a telegram body is also given with the key expanded for
+ * every message, as the clients did before caching the round keys, and
+ * with the keystream prepared in advance by a KeystreamPool.
+ * AES-256-GCM (the CTR engine and GHASH) is checked and measured the same
+ * way, with PCLMULQDQ and with the portable GHASH, and ChaCha20 with 1
+ * (the 32 bits code), 4 (SSE2) and 8 (AVX2) blocks at a time.
+ * Last, each Cipher of ClientSmoke seals a telegram body with its
+ * keystream prepared.
+ *
+ * Usage: aes_bench [MB per size]
+ */
+
+#define BENCH_RUNS 5
+/* A telegram body */
+#define BENCH_MSG 14
+
+/* NIST SP 800-38A, F.5.5 CTR-AES256.Encrypt */
+static const uint8_t nistKey[32] = {
+    0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0,
+    0x85, 0x7d, 0x77, 0x81, 0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7,
+    0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4 };
+static const uint8_t nistCtr[16] = {
+    0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb,
+    0xfc, 0xfd, 0xfe, 0xff };
+static const uint8_t nistPlain[64] = {
+    0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11,
+    0x73, 0x93, 0x17, 0x2a, 0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+    0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51, 0x30, 0xc8, 0x1c, 0x46,
+    0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+    0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b,
+    0xe6, 0x6c, 0x37, 0x10 };
+static const uint8_t nistCipher[64] = {
+    0x60, 0x1e, 0xc3, 0x13, 0x77, 0x57, 0x89, 0xa5, 0xb7, 0xa7, 0xf5, 0x04,
+    0xbb, 0xf3, 0xd2, 0x28, 0xf4, 0x43, 0xe3, 0xca, 0x4d, 0x62, 0xb5, 0x9a,
+    0xca, 0x84, 0xe9, 0x90, 0xca, 0xca, 0xf5, 0xc5, 0x2b, 0x09, 0x30, 0xda,
+    0xa2, 0x3d, 0xe9, 0x4c, 0xe8, 0x70, 0x17, 0xba, 0x2d, 0x84, 0x98, 0x8d,
+    0xdf, 0xc9, 0xc5, 0x8d, 0xb6, 0x7a, 0xad, 0xa6, 0x13, 0xc2, 0xdd, 0x08,
+    0x45, 0x79, 0x41, 0xa6 };
+
+/* The Galois/Counter Mode of Operation, test case 16 */
+static const uint8_t gcmKey[32] = {
+    0xfe, 0xff, 0xe9, 0x92, 0x86, 0x65, 0x73, 0x1c, 0x6d, 0x6a, 0x8f, 0x94,
+    0x67, 0x30, 0x83, 0x08, 0xfe, 0xff, 0xe9, 0x92, 0x86, 0x65, 0x73, 0x1c,
+    0x6d, 0x6a, 0x8f, 0x94, 0x67, 0x30, 0x83, 0x08 };
+static const uint8_t gcmIv[12] = {
+    0xca, 0xfe, 0xba, 0xbe, 0xfa, 0xce, 0xdb, 0xad, 0xde, 0xca, 0xf8, 0x88 };
+static const uint8_t gcmAad[20] = {
+    0xfe, 0xed, 0xfa, 0xce, 0xde, 0xad, 0xbe, 0xef, 0xfe, 0xed, 0xfa, 0xce,
+    0xde, 0xad, 0xbe, 0xef, 0xab, 0xad, 0xda, 0xd2 };
+static const uint8_t gcmPlain[60] = {
+    0xd9, 0x31, 0x32, 0x25, 0xf8, 0x84, 0x06, 0xe5, 0xa5, 0x59, 0x09, 0xc5,
+    0xaf, 0xf5, 0x26, 0x9a, 0x86, 0xa7, 0xa9, 0x53, 0x15, 0x34, 0xf7, 0xda,
+    0x2e, 0x4c, 0x30, 0x3d, 0x8a, 0x31, 0x8a, 0x72, 0x1c, 0x3c, 0x0c, 0x95,
+    0x95, 0x68, 0x09, 0x53, 0x2f, 0xcf, 0x0e, 0x24, 0x49, 0xa6, 0xb5, 0x25,
+    0xb1, 0x6a, 0xed, 0xf5, 0xaa, 0x0d, 0xe6, 0x57, 0xba, 0x63, 0x7b, 0x39 };
+static const uint8_t gcmCipher[60] = {
+    0x52, 0x2d, 0xc1, 0xf0, 0x99, 0x56, 0x7d, 0x07, 0xf4, 0x7f, 0x37, 0xa3,
+    0x2a, 0x84, 0x42, 0x7d, 0x64, 0x3a, 0x8c, 0xdc, 0xbf, 0xe5, 0xc0, 0xc9,
+    0x75, 0x98, 0xa2, 0xbd, 0x25, 0x55, 0xd1, 0xaa, 0x8c, 0xb0, 0x8e, 0x48,
+    0x59, 0x0d, 0xbb, 0x3d, 0xa7, 0xb0, 0x8b, 0x10, 0x56, 0x82, 0x88, 0x38,
+    0xc5, 0xf6, 0x1e, 0x63, 0x93, 0xba, 0x7a, 0x0a, 0xbc, 0xc9, 0xf6, 0x62 };
+static const uint8_t gcmTag[16] = {
+    0x76, 0xfc, 0x6e, 0xce, 0x0f, 0x4e, 0x17, 0x68, 0xcd, 0xdf, 0x88, 0x53,
+    0xbb, 0x2d, 0x55, 0x1b };
+
+/* RFC 8439, 2.8.2 AEAD test vector, the key is 0x80 ... 0x9f */
+static const uint8_t chachaNonce[12] = {
+    0x07, 0x00, 0x00, 0x00, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47 };
+static const uint8_t chachaAad[12] = {
+    0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7 };
+static const char chachaPlain[] =
+    "Ladies and Gentlemen of the class of '99: If I could offer you only "
+    "one tip for the future, sunscreen would be it.";
+static const uint8_t chachaCipher[114] = {
+    0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb, 0x7b, 0x86, 0xaf, 0xbc,
+    0x53, 0xef, 0x7e, 0xc2, 0xa4, 0xad, 0xed, 0x51, 0x29, 0x6e, 0x08, 0xfe,
+    0xa9, 0xe2, 0xb5, 0xa7, 0x36, 0xee, 0x62, 0xd6, 0x3d, 0xbe, 0xa4, 0x5e,
+    0x8c, 0xa9, 0x67, 0x12, 0x82, 0xfa, 0xfb, 0x69, 0xda, 0x92, 0x72, 0x8b,
+    0x1a, 0x71, 0xde, 0x0a, 0x9e, 0x06, 0x0b, 0x29, 0x05, 0xd6, 0xa5, 0xb6,
+    0x7e, 0xcd, 0x3b, 0x36, 0x92, 0xdd, 0xbd, 0x7f, 0x2d, 0x77, 0x8b, 0x8c,
+    0x98, 0x03, 0xae, 0xe3, 0x28, 0x09, 0x1b, 0x58, 0xfa, 0xb3, 0x24, 0xe4,
+    0xfa, 0xd6, 0x75, 0x94, 0x55, 0x85, 0x80, 0x8b, 0x48, 0x31, 0xd7, 0xbc,
+    0x3f, 0xf4, 0xde, 0xf0, 0x8e, 0x4b, 0x7a, 0x9d, 0xe5, 0x76, 0xd2, 0x65,
+    0x86, 0xce, 0xc6, 0x4b, 0x61, 0x16 };
+static const uint8_t chachaTag[16] = {
+    0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a, 0x7e, 0x90, 0x2e, 0xcb,
+    0xd0, 0x60, 0x06, 0x91 };
+
+static uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+static void tinyAes(const uint8_t *key, const uint8_t *iv, uint8_t *buf,
+                    size_t len) {
+    struct AES_ctx ctx;
+    AES_init_ctx_iv(&ctx, key, iv);
+    AES_CTR_xcrypt_buffer(&ctx, buf, (uint32_t) len);
+}
+
+/**
+ * Checks an engine against the test vectors and tiny-AES, also with a
+ * counter wrapping its lower 64 bits.
+ */
+static bool check(AesCtr &aes, const char *name) {
+    uint8_t buf[1024];
+    uint8_t ref[1024];
+
+    aes.setKey(nistKey);
+    memcpy(buf, nistPlain, sizeof(nistPlain));
+    aes.xcrypt(nistCtr, buf, sizeof(nistPlain));
+    bool ok = memcmp(buf, nistCipher, sizeof(nistCipher)) == 0;
+
+    uint8_t iv[16];
+    memset(iv, 0xff, sizeof(iv));
+    iv[0] = 0x12;
+    srand(1);
+    for(size_t len = 0; len <= sizeof(buf) && ok; len += 1 + rand() % 37) {
+        for(size_t i = 0; i < len; i++)
+            buf[i] = ref[i] = (uint8_t) rand();
+        iv[7] = (uint8_t) len;
+        aes.xcrypt(iv, buf, len);
+        tinyAes(nistKey, iv, ref, len);
+        ok = memcmp(buf, ref, len) == 0;
+    }
+
+    if(!ok)
+        printf("%-10s WRONG OUTPUT\n", name);
+    return ok;
+}
+
+/**
+ * AES-GCM encryption with a 96 bits IV.
+ */
+static void gcm(AesCtr &aes, const Ghash &ghash, const uint8_t iv[12],
+                const uint8_t *aad, size_t aadLen, uint8_t *buf, size_t len,
+                uint8_t tag[GCM_TAG_SIZE]) {
+    uint8_t ctr[AES_CTR_BLOCK] = { 0 };
+    memcpy(ctr, iv, 12);
+    ctr[15] = 1;
+    memset(tag, 0, GCM_TAG_SIZE);
+    aes.xcrypt(ctr, tag, GCM_TAG_SIZE);
+    ctr[15] = 2;
+    aes.xcrypt(ctr, buf, len);
+
+    uint8_t hash[GCM_TAG_SIZE];
+    ghash.digest(aad, aadLen, buf, len, hash);
+    for(size_t i = 0; i < GCM_TAG_SIZE; i++)
+        tag[i] ^= hash[i];
+}
+
+/**
+ * Checks GHASH against the test vector, and the portable code against
+ * PCLMULQDQ on random messages.
+ */
+static bool checkGcm(AesCtr &aes, Ghash &ghash, Ghash &portable) {
+    uint8_t buf[1024];
+    uint8_t tag[GCM_TAG_SIZE];
+    uint8_t ref[GCM_TAG_SIZE];
+
+    aes.setKey(gcmKey);
+    ghash.setKey(aes);
+    portable.setKey(aes);
+    memcpy(buf, gcmPlain, sizeof(gcmPlain));
+    gcm(aes, ghash, gcmIv, gcmAad, sizeof(gcmAad), buf, sizeof(gcmPlain),
+        tag);
+    bool ok = memcmp(buf, gcmCipher, sizeof(gcmCipher)) == 0 &&
+              memcmp(tag, gcmTag, sizeof(gcmTag)) == 0;
+
+    srand(2);
+    for(size_t len = 0; len <= sizeof(buf) && ok; len += 1 + rand() % 37) {
+        for(size_t i = 0; i < len; i++)
+            buf[i] = (uint8_t) rand();
+        size_t aadLen = (size_t) rand() % 40;
+        ghash.digest(buf + len / 2, aadLen, buf, len, tag);
+        portable.digest(buf + len / 2, aadLen, buf, len, ref);
+        ok = memcmp(tag, ref, sizeof(tag)) == 0;
+    }
+
+    if(!ok)
+        printf("%-10s WRONG OUTPUT\n", "gcm");
+    return ok;
+}
+
+/**
+ * Checks ChaCha20-Poly1305 against the test vector, and the vector code
+ * against the 32 bits one on random messages.
+ */
+static bool checkChaCha(ChaCha20 &chacha, ChaCha20 &portable) {
+    uint8_t key[32];
+    for(int i = 0; i < 32; i++)
+        key[i] = (uint8_t) (0x80 + i);
+    chacha.setKey(key);
+    portable.setKey(key);
+
+    uint8_t buf[2048];
+    uint8_t ref[2048];
+    uint8_t otk[CHACHA_BLOCK] = { 0 };
+    uint8_t tag[POLY1305_TAG_SIZE];
+    uint8_t lens[16] = { sizeof(chachaAad), 0, 0, 0, 0, 0, 0, 0,
+                         sizeof(chachaCipher) };
+    chacha.xcrypt(chachaNonce, 0, otk, sizeof(otk));
+    memcpy(buf, chachaPlain, sizeof(chachaCipher));
+    chacha.xcrypt(chachaNonce, 1, buf, sizeof(chachaCipher));
+    Poly1305 poly(otk);
+    poly.pad(chachaAad, sizeof(chachaAad));
+    poly.pad(buf, sizeof(chachaCipher));
+    poly.pad(lens, sizeof(lens));
+    poly.finish(tag);
+    bool ok = memcmp(buf, chachaCipher, sizeof(chachaCipher)) == 0 &&
+              memcmp(tag, chachaTag, sizeof(chachaTag)) == 0;
+
+    srand(3);
+    for(size_t len = 0; len <= sizeof(buf) && ok; len += 1 + rand() % 131) {
+        for(size_t i = 0; i < len; i++)
+            buf[i] = ref[i] = (uint8_t) rand();
+        chacha.xcrypt(chachaNonce, (uint32_t) len, buf, len);
+        portable.xcrypt(chachaNonce, (uint32_t) len, ref, len);
+        ok = memcmp(buf, ref, len) == 0;
+    }
+
+    if(!ok)
+        printf("%-10s WRONG OUTPUT\n", "chacha20");
+    return ok;
+}
+
+/**
+ * Measures the cost of a telegram body sealed by a Cipher, its keystream
+ * prepared: only the messages are timed, not the refill while idle.
+ *
+ * @return cycles per message.
+ */
+template<class Cipher>
+static double telegram(size_t total) {
+    Cipher cipher;
+    cipher.setKey(nistKey);
+    cipher.reset(1);
+    uint8_t tag[Cipher::TAG_SIZE + 1];
+    uint8_t msg[BENCH_MSG] = { 0 };
+    uint64_t spent = 0;
+    size_t count = 0;
+    while(count < total / BENCH_MSG) {
+        cipher.refill(KEYSTREAM_AHEAD);
+        uint64_t start = cycles();
+        for(size_t j = 0; j < KEYSTREAM_AHEAD; j++)
+            cipher.seal(1, cipher.next(), 0, tag, msg, sizeof(msg));
+        spent += cycles() - start;
+        count += KEYSTREAM_AHEAD;
+    }
+    return (double) spent / count;
+}
+
+/**
+ * Measures an engine, the best of BENCH_RUNS runs.
+ *
+ * @param total - bytes encrypted by each run.
+ * @return bytes per cycle.
+ */
+template<typename F>
+static double measure(F xcrypt, size_t size, size_t total) {
+    std::vector<uint8_t> buf(size, 0x5a);
+    uint8_t iv[16] = { 0 };
+    size_t count = total / size > 0 ? total / size : 1;
+    double best = 0;
+    for(int run = 0; run < BENCH_RUNS; run++) {
+        uint64_t start = cycles();
+        for(size_t i = 0; i < count; i++) {
+            iv[15] = (uint8_t) i;
+            xcrypt(iv, buf.data(), size);
+        }
+        uint64_t elapsed = cycles() - start;
+        double bpc = (double) (count * size) / (elapsed ? elapsed : 1);
+        if(bpc > best)
+            best = bpc;
+    }
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    size_t total = (size_t) (argc > 1 ? atof(argv[1]) : 4) * 1024 * 1024;
+    static const size_t sizes[] = { 14, 64, 256, 1024, 16384 };
+
+    AesCtr portable(false);
+    AesCtr aesni(true);
+    Ghash clmul(true);
+    Ghash shoup(false);
+    ChaCha20 chacha;
+    ChaCha20 scalar(1);
+    ChaCha20 sse2(4);
+    bool ok = check(portable, "polarssl") && check(aesni, "aesni") &&
+              checkGcm(aesni, clmul, shoup) && checkChaCha(chacha, scalar) &&
+              checkChaCha(sse2, scalar);
+    if(!ok)
+        return 1;
+    // Keys expanded once, only the encryption is measured
+    portable.setKey(nistKey);
+    aesni.setKey(nistKey);
+    clmul.setKey(aesni);
+    shoup.setKey(aesni);
+    struct AES_ctx ctx;
+    AES_init_ctx(&ctx, nistKey);
+
+    printf("AES-256-CTR and GCM, bytes per %s (AES-NI %s, PCLMULQDQ %s)\n",
+#if defined(__x86_64__) || defined(__i386__)
+           "cycle",
+#else
+           "ns",
+#endif
+           aesni.hardware() ? "available" : "not available",
+           clmul.hardware() ? "available" : "not available");
+    printf("%8s %10s %10s %10s %10s %10s\n", "bytes", "tiny-aes", "polarssl",
+           aesni.hardware() ? "aesni" : "-", "gcm", "gcm-shoup");
+    for(size_t size : sizes) {
+        double tiny = measure([&ctx](const uint8_t *iv, uint8_t *buf,
+                                     size_t len) {
+            AES_ctx_set_iv(&ctx, iv);
+            AES_CTR_xcrypt_buffer(&ctx, buf, (uint32_t) len);
+        }, size, total / 8);
+        double soft = measure([&portable](const uint8_t *iv, uint8_t *buf,
+                                          size_t len) {
+            portable.xcrypt(iv, buf, len);
+        }, size, total);
+        double hard = measure([&aesni](const uint8_t *iv, uint8_t *buf,
+                                       size_t len) {
+            aesni.xcrypt(iv, buf, len);
+        }, size, total);
+        uint8_t tag[GCM_TAG_SIZE];
+        double fast = measure([&aesni, &clmul, &tag](const uint8_t *iv,
+                                                     uint8_t *buf,
+                                                     size_t len) {
+            gcm(aesni, clmul, iv, NULL, 0, buf, len, tag);
+        }, size, total);
+        double slow = measure([&aesni, &shoup, &tag](const uint8_t *iv,
+                                                     uint8_t *buf,
+                                                     size_t len) {
+            gcm(aesni, shoup, iv, NULL, 0, buf, len, tag);
+        }, size, total / 4);
+        printf("%8zu %10.3f %10.3f %10.3f %10.3f %10.3f\n", size, tiny, soft,
+               aesni.hardware() ? hard : 0.0, fast, slow);
+    }
+
+    printf("\n%d bytes message, cycles with the key expanded per message "
+           "and once\n", BENCH_MSG);
+    double tinyKey = measure([](const uint8_t *iv, uint8_t *buf, size_t len) {
+        tinyAes(nistKey, iv, buf, len);
+    }, BENCH_MSG, total / 64);
+    double tinyOnce = measure([&ctx](const uint8_t *iv, uint8_t *buf,
+                                     size_t len) {
+        AES_ctx_set_iv(&ctx, iv);
+        AES_CTR_xcrypt_buffer(&ctx, buf, (uint32_t) len);
+    }, BENCH_MSG, total / 64);
+    AesCtr &best = aesni.hardware() ? aesni : portable;
+    double bestKey = measure([&best](const uint8_t *iv, uint8_t *buf,
+                                     size_t len) {
+        best.setKey(nistKey);
+        best.xcrypt(iv, buf, len);
+    }, BENCH_MSG, total / 8);
+    double bestOnce = measure([&best](const uint8_t *iv, uint8_t *buf,
+                                      size_t len) {
+        best.xcrypt(iv, buf, len);
+    }, BENCH_MSG, total / 8);
+    printf("%-10s %10.0f %10.0f\n", "tiny-aes", BENCH_MSG / tinyKey,
+           BENCH_MSG / tinyOnce);
+    printf("%-10s %10.0f %10.0f\n", best.hardware() ? "aesni" : "polarssl",
+           BENCH_MSG / bestKey, BENCH_MSG / bestOnce);
+
+    printf("\nChaCha20, bytes per %s (up to %u blocks at a time)\n",
+#if defined(__x86_64__) || defined(__i386__)
+           "cycle",
+#else
+           "ns",
+#endif
+           ChaCha20::supported());
+    printf("%8s %10s %10s %10s\n", "bytes", "32 bits", "sse2", "avx2");
+    for(size_t size : sizes) {
+        ChaCha20 *engines[3] = { &scalar, &sse2, &chacha };
+        double bpc[3];
+        for(int e = 0; e < 3; e++) {
+            ChaCha20 &c = *engines[e];
+            bpc[e] = measure([&c](const uint8_t *iv, uint8_t *buf,
+                                  size_t len) {
+                c.xcrypt(iv, 0, buf, len);
+            }, size, total);
+        }
+        printf("%8zu %10.3f %10.3f %10.3f\n", size, bpc[0],
+               sse2.lanes() >= 4 ? bpc[1] : 0.0,
+               chacha.lanes() >= 8 ? bpc[2] : 0.0);
+    }
+
+    printf("\n%d bytes message sealed by each Cipher, cycles with the "
+           "keystream prepared\n", BENCH_MSG);
+    printf("%-16s %10.0f\n", "AesCtrCipher", telegram<AesCtrCipher>(total / 8));
+    printf("%-16s %10.0f\n", "AesGcmCipher", telegram<AesGcmCipher>(total / 8));
+    printf("%-16s %10.0f\n", "ChaChaPolyCipher",
+           telegram<ChaChaPolyCipher>(total / 8));
+    return 0;
+}
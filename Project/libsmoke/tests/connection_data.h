@@ -3,7 +3,11 @@
 
 #define TCP_PORT 45067
 #define TCP_IP "127.0.0.1"
+#define UNIX_PATH "/tmp/libsmoke.sock"
 
 #define CLIENTS_NUM 2
 
+#define MCAST_IP MCAST_DEFAULT_GROUP
+#define MCAST_IFACE "127.0.0.1"
+
 #endif //LIBSMOKE_CONNECTION_DATA_H
@@ -0,0 +1,180 @@
+#include "../src/libsmoke_server.h"
+#include <cstdlib>
+#include <cstring>
+
+/**
+ * Fan-out benchmark: a sender broadcasts telegrams to many receivers, all
+ * connected to an in-process ServerSmoke, and the time needed to deliver
+ * all the copies is measured with each I/O engine.
+ *
+ * Usage: fanout_bench [receivers] [telegrams] [epoll|uring|all] [port]
+ */
+
+#define BENCH_BODY 8
+
+static std::atomic<bool> serverStop(false);
+
+/**
+ * Builds a broadcast KNX telegram, with a valid checksum.
+ */
+static size_t telegram(uint8_t *raw, uint16_t src) {
+    raw[0] = 0xbc;
+    raw[1] = (uint8_t) (src >> 8);
+    raw[2] = (uint8_t) src;
+    raw[3] = 0;
+    raw[4] = 0;
+    raw[5] = 0x80 | BENCH_BODY;
+    for(size_t i = 0; i < BENCH_BODY; i++)
+        raw[6 + i] = (uint8_t) i;
+
+    uint8_t sum = 0;
+    for(size_t i = 0; i < 6 + BENCH_BODY; i++)
+        sum ^= raw[i];
+    raw[6 + BENCH_BODY] = (uint8_t) ~sum;
+    return 7 + BENCH_BODY;
+}
+
+/**
+ * Gets the upper bound of the latency bucket holding a percentile.
+ */
+static unsigned long long percentile(const MetricsSnapshot &m, double p) {
+    uint64_t seen = 0;
+    for(size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += m.latencyBuckets[i];
+        if(seen >= p * m.latencyCount)
+            return Histogram::upperBound(i);
+    }
+    return 0;
+}
+
+static int connectTo(int port) {
+    struct sockaddr_in in;
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_port = htons(port);
+    in.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(s < 0 || connect(s, (struct sockaddr *) &in, sizeof(in)) < 0) {
+        perror("connect");
+        exit(-1);
+    }
+    return s;
+}
+
+/**
+ * Runs the benchmark with an engine.
+ *
+ * @return FALSE - if some copy has not been delivered.
+ */
+static bool run(IoEngine engine, int port, size_t receivers, size_t count) {
+    ServerSmoke server;
+    // The benchmark must not shed anything
+    Backpressure bp;
+    bp.maxFrames = count + 1;
+    bp.maxBytes = bp.highWatermark = (count + 1) * KNX::tg_size::max;
+    server.setBackpressure(bp);
+    server.setEngine(engine);
+    if(!server.init("127.0.0.1", port)) {
+        printf("Cannot init the server on port %d\n", port);
+        return false;
+    }
+
+    serverStop = false;
+    std::thread loop([&server]() {
+        while(!serverStop.load(std::memory_order_relaxed))
+            server.run();
+    });
+
+    vector<int> socks;
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    for(size_t i = 0; i < receivers; i++) {
+        int s = connectTo(port);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t) i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, s, &ev);
+        socks.push_back(s);
+    }
+    int sender = connectTo(port);
+    while(server.metrics().connections < (int64_t) receivers + 1)
+        usleep(1000);
+
+    uint8_t raw[KNX::tg_size::max];
+    size_t size = telegram(raw, 0x1101);
+    vector<uint8_t> burst;
+    for(size_t i = 0; i < count; i++)
+        burst.insert(burst.end(), raw, raw + size);
+
+    MetricsSnapshot before = server.metrics();
+    uint64_t start = monotonicUs();
+    std::thread tx([&]() {
+        size_t off = 0;
+        while(off < burst.size()) {
+            ssize_t n = send(sender, burst.data() + off, burst.size() - off,
+                             MSG_NOSIGNAL);
+            if(n <= 0) break;
+            off += (size_t) n;
+        }
+    });
+
+    // Drain the receivers until every one got all the telegrams
+    size_t expected = count * size;
+    vector<size_t> got(receivers, 0);
+    size_t done = 0;
+    uint8_t buf[65536];
+    while(done < receivers) {
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(ep, events, MAX_EVENTS, 2000);
+        if(n <= 0)
+            break;
+        for(int i = 0; i < n; i++) {
+            uint32_t r = events[i].data.u32;
+            ssize_t m = recv(socks[r], buf, sizeof(buf), MSG_DONTWAIT);
+            if(m <= 0) continue;
+            got[r] += (size_t) m;
+            if(got[r] >= expected && got[r] - (size_t) m < expected)
+                done++;
+        }
+    }
+    uint64_t elapsed = monotonicUs() - start;
+    tx.join();
+    MetricsSnapshot after = server.metrics();
+
+    uint64_t deliveries = after.deliveries - before.deliveries;
+    uint64_t sends = after.sendCalls - before.sendCalls;
+    printf("%-6s receivers=%zu telegrams=%zu: %.1f ms, %.0f deliveries/s, "
+           "%.1f deliveries per send, fan-out p50 <= %lluus, "
+           "p99 <= %lluus%s\n",
+           server.engine() == ENGINE_URING ? "uring" : "epoll",
+           receivers, count, elapsed / 1000.0,
+           deliveries * 1e6 / (elapsed ? elapsed : 1),
+           sends ? (double) deliveries / sends : 0.0,
+           percentile(after, 0.50), percentile(after, 0.99),
+           done == receivers ? "" : " INCOMPLETE");
+
+    for(int s : socks)
+        close(s);
+    close(sender);
+    close(ep);
+    serverStop = true;
+    loop.join();
+    server.shutdown();
+    return done == receivers;
+}
+
+int main(int argc, char *argv[]) {
+    size_t receivers = argc > 1 ? (size_t) atoi(argv[1]) : 200;
+    size_t count = argc > 2 ? (size_t) atoi(argv[2]) : 2000;
+    const char *engine = argc > 3 ? argv[3] : "all";
+    int port = argc > 4 ? atoi(argv[4]) : 45100;
+
+    Logger::setLevel(SMOKE_LOG_WARN);
+
+    bool ok = true;
+    if(strcmp(engine, "uring") != 0)
+        ok = run(ENGINE_EPOLL, port, receivers, count) && ok;
+    if(strcmp(engine, "epoll") != 0)
+        ok = run(ENGINE_URING, port + 1, receivers, count) && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,256 @@
+#include "../src/libsmoke_server.h"
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/**
+ * Idle benchmark: holds many silent connections on a ServerSmoke and
+ * measures the CPU it burns while nothing happens, then while a single
+ * connection wakes it up at a slow pace. The server runs in a child
+ * process, so the CPU is the one of its whole process and each side only
+ * needs a file per connection. The wakeups are its returns from run().
+ *
+ * Usage: idle_bench [seconds] [epoll|uring|all] [port] [conns...]
+ *   conns defaults to 10 1000 10000.
+ */
+
+#define IDLE_BODY 4
+/* Telegrams sent by the poking connection, one every IDLE_POKE_GAP_US */
+#define IDLE_POKES 1000
+#define IDLE_POKE_GAP_US 1000
+/* Group of the poking connection, so its telegrams reach nobody */
+#define IDLE_POKE_GROUP "idle-poke"
+
+/**
+ * State of the server process, shared with the benchmark.
+ */
+struct Shared {
+    std::atomic<int> state;
+    std::atomic<bool> stop;
+    std::atomic<uint64_t> wakeups;
+    std::atomic<int64_t> connections;
+    std::atomic<int64_t> expected;
+    std::atomic<int> engine;
+};
+
+/* Shared::state */
+#define IDLE_STARTING 0
+#define IDLE_READY 1
+#define IDLE_FAILED 2
+
+/**
+ * Builds a broadcast KNX telegram, with a valid checksum.
+ */
+static size_t telegram(uint8_t *raw, uint16_t src) {
+    raw[0] = 0xbc;
+    raw[1] = (uint8_t) (src >> 8);
+    raw[2] = (uint8_t) src;
+    raw[3] = 0;
+    raw[4] = 0;
+    raw[5] = 0x80 | IDLE_BODY;
+    for(size_t i = 0; i < IDLE_BODY; i++)
+        raw[6 + i] = (uint8_t) i;
+
+    uint8_t sum = 0;
+    for(size_t i = 0; i < 6 + IDLE_BODY; i++)
+        sum ^= raw[i];
+    raw[6 + IDLE_BODY] = (uint8_t) ~sum;
+    return 7 + IDLE_BODY;
+}
+
+static int connectTo(int port) {
+    struct sockaddr_in in;
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_port = htons(port);
+    in.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(s < 0 || connect(s, (struct sockaddr *) &in, sizeof(in)) < 0) {
+        perror("connect");
+        exit(-1);
+    }
+    return s;
+}
+
+/**
+ * Gets the CPU time used by a process, in us.
+ */
+static uint64_t cpuUs(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+/**
+ * CPU and wakeups of the server over a phase.
+ */
+struct Sample {
+    uint64_t wallUs;
+    uint64_t cpuUs;
+    uint64_t wakeups;
+};
+
+/**
+ * Measures the server while f() runs.
+ */
+template<class F>
+static Sample measure(Shared *sh, clockid_t clock, F f) {
+    uint64_t wall = monotonicUs();
+    uint64_t cpu = cpuUs(clock);
+    uint64_t w = sh->wakeups.load();
+    f();
+    Sample s;
+    s.wallUs = monotonicUs() - wall;
+    s.cpuUs = cpuUs(clock) - cpu;
+    s.wakeups = sh->wakeups.load() - w;
+    return s;
+}
+
+/**
+ * Body of the server process, until the benchmark sets stop.
+ */
+static void serve(Shared *sh, IoEngine engine, int port) {
+    Logger::setLevel(SMOKE_LOG_WARN);
+    ServerSmoke server;
+    server.setEngine(engine);
+    if(!server.init("127.0.0.1", port)) {
+        sh->state = IDLE_FAILED;
+        return;
+    }
+    sh->engine = server.engine();
+    sh->state = IDLE_READY;
+
+    while(!sh->stop.load(std::memory_order_relaxed)) {
+        server.run();
+        sh->wakeups.fetch_add(1, std::memory_order_relaxed);
+        // Only until everybody is in, not to weigh on the measure
+        if(sh->connections < sh->expected)
+            sh->connections = server.metrics().connections;
+    }
+    server.shutdown();
+}
+
+/**
+ * Runs the benchmark with an engine and a #Connections.
+ *
+ * @return FALSE - if the server could not be started.
+ */
+static bool run(IoEngine engine, int port, size_t conns, double seconds) {
+    Shared *sh = (Shared *) mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(sh == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    new (sh) Shared();
+    sh->expected = (int64_t) conns + 1;
+
+    pid_t pid = fork();
+    if(pid == 0) {
+        serve(sh, engine, port);
+        _exit(0);
+    }
+    if(pid < 0) {
+        perror("fork");
+        munmap(sh, sizeof(Shared));
+        return false;
+    }
+    clockid_t clock;
+    if(clock_getcpuclockid(pid, &clock) != 0)
+        clock = CLOCK_PROCESS_CPUTIME_ID;
+    while(sh->state == IDLE_STARTING)
+        usleep(1000);
+    if(sh->state == IDLE_FAILED) {
+        printf("Cannot init the server on port %d\n", port);
+        waitpid(pid, NULL, 0);
+        munmap(sh, sizeof(Shared));
+        return false;
+    }
+
+    vector<int> socks;
+    for(size_t i = 0; i < conns; i++)
+        socks.push_back(connectTo(port));
+    int poker = connectTo(port);
+    int one = 1;
+    setsockopt(poker, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    uint8_t pre[2 + TCP_GROUP_NAME_MAX];
+    size_t len = strlen(IDLE_POKE_GROUP);
+    pre[0] = TCP_JOIN_MAGIC;
+    pre[1] = (uint8_t) len;
+    memcpy(pre + 2, IDLE_POKE_GROUP, len);
+    send(poker, pre, 2 + len, MSG_NOSIGNAL);
+    while(sh->connections < sh->expected)
+        usleep(1000);
+    // Let the accepts settle before measuring
+    usleep(200000);
+
+    Sample idle = measure(sh, clock, [seconds]() {
+        usleep((useconds_t) (seconds * 1e6));
+    });
+
+    uint8_t raw[KNX::tg_size::max];
+    size_t size = telegram(raw, 0x1101);
+    Sample poke = measure(sh, clock, [&]() {
+        for(size_t i = 0; i < IDLE_POKES; i++) {
+            send(poker, raw, size, MSG_NOSIGNAL);
+            usleep(IDLE_POKE_GAP_US);
+        }
+    });
+
+    double idleS = idle.wallUs / 1e6;
+    printf("%-6s conns=%-6zu idle: %.1f us CPU/s, %.1f wakeups/s, "
+           "%.2f us/wakeup | poked: %.2f us/wakeup (%llu wakeups)\n",
+           sh->engine == ENGINE_URING ? "uring" : "epoll", conns,
+           idle.cpuUs / idleS, idle.wakeups / idleS,
+           idle.wakeups ? (double) idle.cpuUs / idle.wakeups : 0.0,
+           poke.wakeups ? (double) poke.cpuUs / poke.wakeups : 0.0,
+           (unsigned long long) poke.wakeups);
+
+    // The server closes first, so the TIME_WAITs don't hold the ports
+    // of the clients
+    sh->stop = true;
+    waitpid(pid, NULL, 0);
+    for(int s : socks)
+        close(s);
+    close(poker);
+    munmap(sh, sizeof(Shared));
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 5;
+    const char *engine = argc > 2 ? argv[2] : "all";
+    int port = argc > 3 ? atoi(argv[3]) : 45300;
+    vector<size_t> counts;
+    for(int i = 4; i < argc; i++)
+        counts.push_back((size_t) atoi(argv[i]));
+    if(counts.empty())
+        counts = { 10, 1000, 10000 };
+
+    // Every connection is a file, on both sides
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    Logger::setLevel(SMOKE_LOG_WARN);
+
+    bool ok = true;
+    for(size_t conns : counts) {
+        if(conns + 64 > rl.rlim_cur) {
+            printf("conns=%zu skipped: only %llu files allowed\n", conns,
+                   (unsigned long long) rl.rlim_cur);
+            ok = false;
+            continue;
+        }
+        if(strcmp(engine, "uring") != 0)
+            ok = run(ENGINE_EPOLL, port++, conns, seconds) && ok;
+        if(strcmp(engine, "epoll") != 0)
+            ok = run(ENGINE_URING, port++, conns, seconds) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,187 @@
+#include "../src/libsmoke_server.h"
+#include <cstdlib>
+#include <cstring>
+
+/**
+ * Join test: the preamble of KNX::LinuxTCP (TCP_JOIN_MAGIC, name length,
+ * name) sent in pieces to an in-process ServerSmoke, with each I/O engine.
+ * A preamble announcing a name longer than TCP_GROUP_NAME_MAX must drop
+ * the client before anything is buffered, a valid one split across
+ * several reads must still join the group.
+ *
+ * Usage: join_test [epoll|uring|all] [port]
+ */
+
+#define TEST_BODY 4
+#define TEST_TIMEOUT_MS 2000
+
+static std::atomic<bool> serverStop(false);
+
+/**
+ * Builds a broadcast KNX telegram, with a valid checksum.
+ */
+static size_t telegram(uint8_t *raw, uint16_t src) {
+    raw[0] = 0xbc;
+    raw[1] = (uint8_t) (src >> 8);
+    raw[2] = (uint8_t) src;
+    raw[3] = 0;
+    raw[4] = 0;
+    raw[5] = 0x80 | TEST_BODY;
+    for(size_t i = 0; i < TEST_BODY; i++)
+        raw[6 + i] = (uint8_t) i;
+
+    uint8_t sum = 0;
+    for(size_t i = 0; i < 6 + TEST_BODY; i++)
+        sum ^= raw[i];
+    raw[6 + TEST_BODY] = (uint8_t) ~sum;
+    return 7 + TEST_BODY;
+}
+
+static int connectTo(int port) {
+    struct sockaddr_in in;
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_port = htons(port);
+    in.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(s < 0 || connect(s, (struct sockaddr *) &in, sizeof(in)) < 0) {
+        perror("connect");
+        exit(-1);
+    }
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return s;
+}
+
+static void sendAll(int s, const uint8_t *buf, size_t len) {
+    send(s, buf, len, MSG_NOSIGNAL);
+}
+
+/**
+ * Waits for some bytes from the server.
+ *
+ * @return the bytes read, 0 if the server closed the connection,
+ *         -1 on timeout.
+ */
+static ssize_t waitRecv(int s, uint8_t *buf, size_t len) {
+    struct pollfd p;
+    p.fd = s;
+    p.events = POLLIN;
+    if(::poll(&p, 1, TEST_TIMEOUT_MS) <= 0)
+        return -1;
+    ssize_t n = recv(s, buf, len, 0);
+    return n < 0 ? 0 : n;
+}
+
+/**
+ * Sends the preamble of a name longer than TCP_GROUP_NAME_MAX and stops
+ * before its end.
+ *
+ * @return TRUE - if the server dropped the client.
+ */
+static bool longPreamble(int port) {
+    int s = connectTo(port);
+    uint8_t pre[2 + 200];
+    pre[0] = TCP_JOIN_MAGIC;
+    pre[1] = 0xff;
+    memset(pre + 2, 'x', sizeof(pre) - 2);
+    sendAll(s, pre, sizeof(pre));
+
+    uint8_t buf[64];
+    bool dropped = waitRecv(s, buf, sizeof(buf)) == 0;
+    close(s);
+    return dropped;
+}
+
+/**
+ * Joins two clients to the same group with the preamble split in pieces,
+ * then sends a telegram from one to the other.
+ *
+ * @return TRUE - if the telegram got through.
+ */
+static bool splitPreamble(ServerSmoke &server, int port) {
+    const char *name = "join-test";
+    size_t len = strlen(name);
+    uint8_t pre[2 + TCP_GROUP_NAME_MAX];
+    pre[0] = TCP_JOIN_MAGIC;
+    pre[1] = (uint8_t) len;
+    memcpy(pre + 2, name, len);
+
+    int64_t before = server.metrics().connections;
+    int a = connectTo(port), b = connectTo(port);
+    while(server.metrics().connections < before + 2)
+        usleep(1000);
+    for(int s : { a, b }) {
+        // Magic alone, then the length, then the name in two parts
+        sendAll(s, pre, 1);
+        usleep(20000);
+        sendAll(s, pre + 1, 1);
+        usleep(20000);
+        sendAll(s, pre + 2, len / 2);
+        usleep(20000);
+        sendAll(s, pre + 2 + len / 2, len - len / 2);
+    }
+    usleep(50000);
+
+    uint8_t raw[KNX::tg_size::max];
+    size_t size = telegram(raw, 0x1101);
+    sendAll(a, raw, size);
+
+    uint8_t buf[64];
+    size_t got = 0;
+    while(got < size) {
+        ssize_t n = waitRecv(b, buf + got, sizeof(buf) - got);
+        if(n <= 0)
+            break;
+        got += (size_t) n;
+    }
+    close(a);
+    close(b);
+    return got == size && memcmp(buf, raw, size) == 0;
+}
+
+/**
+ * Runs the tests with an engine.
+ *
+ * @return FALSE - if some test failed.
+ */
+static bool run(IoEngine engine, int port) {
+    ServerSmoke server;
+    server.setEngine(engine);
+    if(!server.init("127.0.0.1", port)) {
+        printf("Cannot init the server on port %d\n", port);
+        return false;
+    }
+
+    serverStop = false;
+    std::thread loop([&server]() {
+        while(!serverStop.load(std::memory_order_relaxed))
+            server.run();
+    });
+
+    const char *name = server.engine() == ENGINE_URING ? "uring" : "epoll";
+    bool dropped = longPreamble(port);
+    printf("%-6s long preamble: %s\n", name, dropped ? "dropped" : "FAILED");
+    bool joined = splitPreamble(server, port);
+    printf("%-6s split preamble: %s\n", name, joined ? "joined" : "FAILED");
+
+    serverStop = true;
+    loop.join();
+    server.shutdown();
+    return dropped && joined;
+}
+
+int main(int argc, char *argv[]) {
+    const char *engine = argc > 1 ? argv[1] : "all";
+    int port = argc > 2 ? atoi(argv[2]) : 45200;
+
+    Logger::setLevel(SMOKE_LOG_WARN);
+
+    bool ok = true;
+    if(strcmp(engine, "uring") != 0)
+        ok = run(ENGINE_EPOLL, port) && ok;
+    if(strcmp(engine, "epoll") != 0)
+        ok = run(ENGINE_URING, port + 1) && ok;
+    return ok ? 0 : 1;
+}
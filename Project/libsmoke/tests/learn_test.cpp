@@ -0,0 +1,143 @@
+#include "../src/libsmoke_server.h"
+#include <cstdlib>
+#include <cstring>
+
+/**
+ * Learn test: two connections of an in-process ServerSmoke send in turn
+ * telegrams with the same source address, so its owner keeps moving from
+ * one to the other, and the addresses learned by the server must stay
+ * one, with each I/O engine.
+ *
+ * Usage: learn_test [telegrams] [epoll|uring|all] [port]
+ */
+
+#define TEST_BODY 4
+#define TEST_TIMEOUT_MS 2000
+
+static std::atomic<bool> serverStop(false);
+
+/**
+ * Builds a broadcast KNX telegram, with a valid checksum.
+ */
+static size_t telegram(uint8_t *raw, uint16_t src) {
+    raw[0] = 0xbc;
+    raw[1] = (uint8_t) (src >> 8);
+    raw[2] = (uint8_t) src;
+    raw[3] = 0;
+    raw[4] = 0;
+    raw[5] = 0x80 | TEST_BODY;
+    for(size_t i = 0; i < TEST_BODY; i++)
+        raw[6 + i] = (uint8_t) i;
+
+    uint8_t sum = 0;
+    for(size_t i = 0; i < 6 + TEST_BODY; i++)
+        sum ^= raw[i];
+    raw[6 + TEST_BODY] = (uint8_t) ~sum;
+    return 7 + TEST_BODY;
+}
+
+static int connectTo(int port) {
+    struct sockaddr_in in;
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_port = htons(port);
+    in.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(s < 0 || connect(s, (struct sockaddr *) &in, sizeof(in)) < 0) {
+        perror("connect");
+        exit(-1);
+    }
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return s;
+}
+
+/**
+ * Waits for a whole telegram from the server.
+ *
+ * @return TRUE - if it arrived in time.
+ */
+static bool waitTelegram(int s, size_t size) {
+    uint8_t buf[KNX::tg_size::max];
+    size_t got = 0;
+    while(got < size) {
+        struct pollfd p;
+        p.fd = s;
+        p.events = POLLIN;
+        if(::poll(&p, 1, TEST_TIMEOUT_MS) <= 0)
+            return false;
+        ssize_t n = recv(s, buf + got, size - got, 0);
+        if(n <= 0)
+            return false;
+        got += (size_t) n;
+    }
+    return true;
+}
+
+/**
+ * Runs the test with an engine.
+ *
+ * @return FALSE - if the learned addresses grew or were not released.
+ */
+static bool run(IoEngine engine, int port, size_t count) {
+    ServerSmoke server;
+    server.setEngine(engine);
+    if(!server.init("127.0.0.1", port)) {
+        printf("Cannot init the server on port %d\n", port);
+        return false;
+    }
+
+    serverStop = false;
+    std::thread loop([&server]() {
+        while(!serverStop.load(std::memory_order_relaxed))
+            server.run();
+    });
+
+    int a = connectTo(port), b = connectTo(port), r = connectTo(port);
+    while(server.metrics().connections < 3)
+        usleep(1000);
+
+    // Each telegram is received before the next one, so the owner of the
+    // address moves every time
+    uint8_t raw[KNX::tg_size::max];
+    size_t size = telegram(raw, 0x1101);
+    bool delivered = true;
+    for(size_t i = 0; i < count && delivered; i++) {
+        send(i % 2 ? b : a, raw, size, MSG_NOSIGNAL);
+        delivered = waitTelegram(r, size);
+    }
+    int64_t learned = server.metrics().learnedAddrs;
+
+    close(a);
+    close(b);
+    close(r);
+    while(server.metrics().connections > 0)
+        usleep(1000);
+    int64_t left = server.metrics().learnedAddrs;
+
+    const char *name = server.engine() == ENGINE_URING ? "uring" : "epoll";
+    printf("%-6s telegrams=%zu: %lld addresses learned, %lld after the "
+           "close%s\n", name, count, (long long) learned, (long long) left,
+           delivered ? "" : " INCOMPLETE");
+
+    serverStop = true;
+    loop.join();
+    server.shutdown();
+    return delivered && learned == 1 && left == 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t count = argc > 1 ? (size_t) atoi(argv[1]) : 1000;
+    const char *engine = argc > 2 ? argv[2] : "all";
+    int port = argc > 3 ? atoi(argv[3]) : 45250;
+
+    Logger::setLevel(SMOKE_LOG_WARN);
+
+    bool ok = true;
+    if(strcmp(engine, "uring") != 0)
+        ok = run(ENGINE_EPOLL, port, count) && ok;
+    if(strcmp(engine, "epoll") != 0)
+        ok = run(ENGINE_URING, port + 1, count) && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,206 @@
+#include "../src/libsmoke_server.h"
+#include <cstdlib>
+#include <cstring>
+
+/**
+ * Link test: plain clients of an in-process ServerSmoke send a link hello
+ * (LINK_HELLO_MAGIC) without the secret of the server, one in the old
+ * format and one with a wrong secret, while a telegram goes through a
+ * group they are not in. They must not get it, and the one with the
+ * wrong secret must be dropped; a link with the right secret gets it,
+ * with each I/O engine.
+ *
+ * Usage: link_test [epoll|uring|all] [port]
+ */
+
+#define TEST_BODY 4
+#define TEST_TIMEOUT_MS 2000
+#define TEST_QUIET_MS 200
+#define TEST_SECRET "link-test"
+#define TEST_GROUP "link-b"
+
+static std::atomic<bool> serverStop(false);
+
+/**
+ * Builds a broadcast KNX telegram, with a valid checksum.
+ */
+static size_t telegram(uint8_t *raw, uint16_t src) {
+    raw[0] = 0xbc;
+    raw[1] = (uint8_t) (src >> 8);
+    raw[2] = (uint8_t) src;
+    raw[3] = 0;
+    raw[4] = 0;
+    raw[5] = 0x80 | TEST_BODY;
+    for(size_t i = 0; i < TEST_BODY; i++)
+        raw[6 + i] = (uint8_t) i;
+
+    uint8_t sum = 0;
+    for(size_t i = 0; i < 6 + TEST_BODY; i++)
+        sum ^= raw[i];
+    raw[6 + TEST_BODY] = (uint8_t) ~sum;
+    return 7 + TEST_BODY;
+}
+
+static int connectTo(int port) {
+    struct sockaddr_in in;
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_port = htons(port);
+    in.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(s < 0 || connect(s, (struct sockaddr *) &in, sizeof(in)) < 0) {
+        perror("connect");
+        exit(-1);
+    }
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return s;
+}
+
+static void sendAll(int s, const uint8_t *buf, size_t len) {
+    send(s, buf, len, MSG_NOSIGNAL);
+}
+
+static void join(int s, const char *name) {
+    uint8_t pre[2 + TCP_GROUP_NAME_MAX];
+    size_t len = strlen(name);
+    pre[0] = TCP_JOIN_MAGIC;
+    pre[1] = (uint8_t) len;
+    memcpy(pre + 2, name, len);
+    sendAll(s, pre, 2 + len);
+}
+
+/**
+ * Reads exactly len bytes from the server.
+ *
+ * @return TRUE - if they arrived in time.
+ */
+static bool recvAll(int s, uint8_t *buf, size_t len) {
+    size_t got = 0;
+    while(got < len) {
+        struct pollfd p;
+        p.fd = s;
+        p.events = POLLIN;
+        if(::poll(&p, 1, TEST_TIMEOUT_MS) <= 0)
+            return false;
+        ssize_t n = recv(s, buf + got, len - got, 0);
+        if(n <= 0)
+            return false;
+        got += (size_t) n;
+    }
+    return true;
+}
+
+/**
+ * Reads whatever the server sends until it closes the connection or
+ * stays quiet for TEST_QUIET_MS.
+ *
+ * @param closed - set to TRUE if the server closed the connection.
+ * @return #Bytes received.
+ */
+static size_t drain(int s, bool &closed) {
+    uint8_t buf[256];
+    size_t got = 0;
+    closed = false;
+    for(;;) {
+        struct pollfd p;
+        p.fd = s;
+        p.events = POLLIN;
+        if(::poll(&p, 1, TEST_QUIET_MS) <= 0)
+            return got;
+        ssize_t n = recv(s, buf, sizeof(buf), 0);
+        if(n <= 0) {
+            closed = true;
+            return got;
+        }
+        got += (size_t) n;
+    }
+}
+
+/**
+ * Runs the test with an engine.
+ *
+ * @return FALSE - if a client without the secret got the telegram, or
+ *                 the trusted link did not.
+ */
+static bool run(IoEngine engine, int port) {
+    ServerSmoke server;
+    server.setEngine(engine);
+    server.setLinkSecret(TEST_SECRET);
+    if(!server.init("127.0.0.1", port)) {
+        printf("Cannot init the server on port %d\n", port);
+        return false;
+    }
+
+    serverStop = false;
+    std::thread loop([&server]() {
+        while(!serverStop.load(std::memory_order_relaxed))
+            server.run();
+    });
+
+    uint8_t secret[LINK_SECRET_SIZE] = { 0 };
+    memcpy(secret, TEST_SECRET, strlen(TEST_SECRET));
+    uint8_t wrong[LINK_SECRET_SIZE] = { 0 };
+    memcpy(wrong, "not-the-secret", 14);
+
+    int a = connectTo(port), b = connectTo(port);
+    int old = connectTo(port), forged = connectTo(port), peer = connectTo(port);
+    join(a, TEST_GROUP);
+    join(b, TEST_GROUP);
+
+    // An old hello cut before the secret, a wrong secret and the right one
+    uint8_t hello[LINK_HELLO_SIZE];
+    linkHello(hello, 0x12345678, secret);
+    sendAll(old, hello, 5);
+    linkHello(hello, 0x12345679, wrong);
+    sendAll(forged, hello, LINK_HELLO_SIZE);
+    linkHello(hello, 0x1234567a, secret);
+    sendAll(peer, hello, LINK_HELLO_SIZE);
+    usleep(50000);
+
+    uint8_t raw[KNX::tg_size::max];
+    size_t size = telegram(raw, 0x1101);
+    sendAll(a, raw, size);
+
+    uint8_t buf[LINK_HELLO_SIZE + LINK_HDR_MAX + KNX::tg_size::max];
+    bool member = recvAll(b, buf, size) && memcmp(buf, raw, size) == 0;
+    // Our hello, then the frame of the telegram
+    size_t frame = 7 + strlen(TEST_GROUP) + size;
+    bool linked = recvAll(peer, buf, LINK_HELLO_SIZE + frame) &&
+                  buf[0] == LINK_HELLO_MAGIC &&
+                  linkServer(buf) == server.serverId() &&
+                  buf[LINK_HELLO_SIZE] == LINK_FRAME_MAGIC &&
+                  memcmp(buf + LINK_HELLO_SIZE + frame - size, raw, size) == 0;
+
+    bool oldClosed, forgedClosed;
+    size_t oldGot = drain(old, oldClosed);
+    size_t forgedGot = drain(forged, forgedClosed);
+
+    const char *name = server.engine() == ENGINE_URING ? "uring" : "epoll";
+    printf("%-6s member: %s, trusted link: %s, old hello: %zu bytes, "
+           "wrong secret: %zu bytes%s\n", name, member ? "ok" : "FAILED",
+           linked ? "ok" : "FAILED", oldGot, forgedGot,
+           forgedClosed ? " (dropped)" : " NOT DROPPED");
+
+    for(int s : { a, b, old, forged, peer })
+        close(s);
+    serverStop = true;
+    loop.join();
+    server.shutdown();
+    return member && linked && oldGot == 0 && forgedGot == 0 && forgedClosed;
+}
+
+int main(int argc, char *argv[]) {
+    const char *engine = argc > 1 ? argv[1] : "all";
+    int port = argc > 2 ? atoi(argv[2]) : 45350;
+
+    Logger::setLevel(SMOKE_LOG_WARN);
+
+    bool ok = true;
+    if(strcmp(engine, "uring") != 0)
+        ok = run(ENGINE_EPOLL, port) && ok;
+    if(strcmp(engine, "epoll") != 0)
+        ok = run(ENGINE_URING, port + 1) && ok;
+    return ok ? 0 : 1;
+}
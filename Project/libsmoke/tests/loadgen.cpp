@@ -0,0 +1,484 @@
+#include "../src/libsmoke_server.h"
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include "connection_data.h"
+
+/**
+ * Load generator: opens many connections to a ServerSmoke, some of them
+ * sending broadcast telegrams at a fixed rate (open loop, the schedule
+ * doesn't slow down when the server does), and all of them receiving the
+ * telegrams of the others. Each telegram carries the time it has been
+ * sent, so every copy received gives an end-to-end latency.
+ * The result is printed as a single JSON object on stdout.
+ *
+ * Usage: smoke_loadgen [options]
+ *   -a addr        IP addr of the server (TCP_IP)
+ *   -p port        PORT of the server (TCP_PORT)
+ *   -c conns       #Connections (1000)
+ *   -s senders     #Connections that send, the first ones (10)
+ *   -r rate        Telegrams/s of each sender (100)
+ *   -b bytes       Body of the telegrams, LOADGEN_STAMP..15 bytes (8)
+ *   -d seconds     Duration of the measure (10)
+ *   -w seconds     Warmup, whose latencies are not counted (1)
+ *   -g group       Group joined by all the connections (the default one)
+ *   -t threads     Threads driving the connections (1)
+ *   -S reactors    Runs its own ServerSmoke with this #Reactors
+ *   -e engine      epoll or uring, for the server started by -S
+ */
+
+/* Bytes of the body holding the send time */
+#define LOADGEN_STAMP 4
+/* Data a connection can have unsent before its telegrams are skipped */
+#define LOADGEN_PENDING_MAX (64 * 1024)
+/* Log-linear histogram: 32 buckets for each power of 2 (~3% error) */
+#define LOADGEN_SUB_BITS 5
+#define LOADGEN_BUCKETS 1024
+/* How long the telegrams still in flight are waited for at the end */
+#define LOADGEN_DRAIN_US 1000000
+
+static std::atomic<bool> serverStop(false);
+
+/**
+ * Latency histogram of a thread, merged with the others at the end.
+ */
+struct LatencyHistogram {
+    uint64_t buckets[LOADGEN_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+
+    LatencyHistogram() : buckets(), count(0), max(0) {}
+
+    static size_t index(uint64_t us) {
+        if(us < (2u << LOADGEN_SUB_BITS))
+            return (size_t) us;
+        unsigned msb = 63 - (unsigned) __builtin_clzll(us);
+        unsigned e = msb - LOADGEN_SUB_BITS;
+        size_t idx = (2u << LOADGEN_SUB_BITS) +
+                     (size_t) (e - 1) * (1u << LOADGEN_SUB_BITS) +
+                     (size_t) ((us >> e) - (1u << LOADGEN_SUB_BITS));
+        return idx < LOADGEN_BUCKETS ? idx : LOADGEN_BUCKETS - 1;
+    }
+
+    /** Smallest value of a bucket */
+    static uint64_t lowerBound(size_t idx) {
+        if(idx < (2u << LOADGEN_SUB_BITS))
+            return idx;
+        idx -= 2u << LOADGEN_SUB_BITS;
+        unsigned e = (unsigned) (idx >> LOADGEN_SUB_BITS) + 1;
+        uint64_t m = (idx & ((1u << LOADGEN_SUB_BITS) - 1)) +
+                     (1u << LOADGEN_SUB_BITS);
+        return m << e;
+    }
+
+    void record(uint64_t us) {
+        buckets[index(us)]++;
+        count++;
+        if(us > max)
+            max = us;
+    }
+
+    void add(const LatencyHistogram &h) {
+        for(size_t i = 0; i < LOADGEN_BUCKETS; i++)
+            buckets[i] += h.buckets[i];
+        count += h.count;
+        if(h.max > max)
+            max = h.max;
+    }
+
+    uint64_t percentile(double p) const {
+        uint64_t seen = 0;
+        for(size_t i = 0; i < LOADGEN_BUCKETS; i++) {
+            seen += buckets[i];
+            if(seen > 0 && seen >= p * count)
+                return lowerBound(i);
+        }
+        return 0;
+    }
+};
+
+/**
+ * Options of the run.
+ */
+struct Options {
+    const char *addr;
+    int port;
+    size_t conns;
+    size_t senders;
+    double rate;
+    size_t body;
+    double duration;
+    double warmup;
+    const char *group;
+    size_t threads;
+    size_t reactors;
+    IoEngine engine;
+
+    Options() : addr(TCP_IP), port(TCP_PORT), conns(1000), senders(10),
+                rate(100), body(8), duration(10), warmup(1), group(NULL),
+                threads(1), reactors(0), engine(ENGINE_EPOLL) {}
+};
+
+/**
+ * A simulated connection.
+ */
+struct Conn {
+    int sock;
+    uint16_t src;
+    bool sender;
+    /** Telegrams sent since the start of the measure */
+    uint64_t sent;
+    /** Bytes not yet sent, and the ones of a telegram not yet received */
+    vector<uint8_t> pending;
+    uint8_t partial[KNX::tg_size::max];
+    size_t partialLen;
+
+    Conn() : sock(-1), src(0), sender(false), sent(0), partialLen(0) {}
+};
+
+/**
+ * Counters of a thread.
+ */
+struct Result {
+    uint64_t sent;
+    uint64_t skipped;
+    uint64_t received;
+    uint64_t invalid;
+    uint64_t closed;
+    LatencyHistogram latency;
+
+    Result() : sent(0), skipped(0), received(0), invalid(0), closed(0) {}
+};
+
+static uint32_t now32() {
+    return (uint32_t) monotonicUs();
+}
+
+/**
+ * Builds a broadcast KNX telegram whose body starts with the send time.
+ *
+ * @param ts - the send time (now32()), the one that decides if the
+ *             telegram is counted as sent after the warmup too.
+ */
+static size_t telegram(uint8_t *raw, uint16_t src, size_t body, uint32_t ts) {
+    raw[0] = 0xbc;
+    raw[1] = (uint8_t) (src >> 8);
+    raw[2] = (uint8_t) src;
+    raw[3] = 0;
+    raw[4] = 0;
+    raw[5] = (uint8_t) (0x80 | body);
+    memcpy(raw + 6, &ts, LOADGEN_STAMP);
+    for(size_t i = LOADGEN_STAMP; i < body; i++)
+        raw[6 + i] = (uint8_t) i;
+
+    uint8_t sum = 0;
+    for(size_t i = 0; i < 6 + body; i++)
+        sum ^= raw[i];
+    raw[6 + body] = (uint8_t) ~sum;
+    return 7 + body;
+}
+
+static int connectTo(const Options &o) {
+    struct sockaddr_in in;
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_port = htons(o.port);
+    in.sin_addr.s_addr = inet_addr(o.addr);
+
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(s < 0 || connect(s, (struct sockaddr *) &in, sizeof(in)) < 0) {
+        perror("connect");
+        exit(-1);
+    }
+
+    if(o.group) {
+        uint8_t preamble[2 + TCP_GROUP_NAME_MAX];
+        size_t len = strlen(o.group);
+        preamble[0] = TCP_JOIN_MAGIC;
+        preamble[1] = (uint8_t) len;
+        memcpy(preamble + 2, o.group, len);
+        if(send(s, preamble, 2 + len, MSG_NOSIGNAL) != (ssize_t) (2 + len)) {
+            perror("send");
+            exit(-1);
+        }
+    }
+
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    int flags = fcntl(s, F_GETFL);
+    fcntl(s, F_SETFL, flags | O_NONBLOCK);
+    return s;
+}
+
+/**
+ * Sends the data queued for a connection, as much as the socket takes.
+ */
+static void flushConn(Conn &c) {
+    if(c.pending.empty())
+        return;
+    ssize_t n = send(c.sock, c.pending.data(), c.pending.size(), MSG_NOSIGNAL);
+    if(n > 0)
+        c.pending.erase(c.pending.begin(), c.pending.begin() + n);
+}
+
+/**
+ * Splits the data received by a connection into telegrams, counting the
+ * ones sent after the warmup and recording their latency.
+ *
+ * @param from - time (now32()) of the end of the warmup.
+ */
+static void parse(Conn &c, const uint8_t *data, size_t len, uint32_t from,
+                  Result &res) {
+    uint8_t buf[KNX::tg_size::max * 2];
+    size_t off = 0;
+
+    // Complete the telegram split between two reads
+    if(c.partialLen > 0) {
+        size_t need = c.partialLen < KNX::tg_size::hdr ?
+                      (size_t) KNX::tg_size::hdr :
+                      KNX::telegram::rawSize(c.partial);
+        while(c.partialLen < need && off < len) {
+            c.partial[c.partialLen++] = data[off++];
+            if(c.partialLen == KNX::tg_size::hdr)
+                need = KNX::telegram::rawSize(c.partial);
+        }
+        if(c.partialLen < need)
+            return;
+        memcpy(buf, c.partial, c.partialLen);
+        c.partialLen = 0;
+        parse(c, buf, need, from, res);
+    }
+
+    uint32_t now = now32();
+    while(off < len) {
+        const uint8_t *raw = data + off;
+        // Keepalive probes of the server
+        if(raw[0] == TCP_KEEPALIVE_PING) {
+            uint8_t pong = TCP_KEEPALIVE_PONG;
+            c.pending.push_back(pong);
+            off++;
+            continue;
+        }
+        if(len - off < KNX::tg_size::hdr ||
+           len - off < KNX::telegram::rawSize(raw)) {
+            c.partialLen = len - off;
+            memcpy(c.partial, raw, c.partialLen);
+            return;
+        }
+
+        uint8_t size = KNX::telegram::rawSize(raw);
+        off += size;
+        if(!KNX::telegram::rawCheck(raw) ||
+           size < 7 + LOADGEN_STAMP) {
+            res.invalid++;
+            continue;
+        }
+        uint32_t ts;
+        memcpy(&ts, raw + 6, LOADGEN_STAMP);
+        if((int32_t) (ts - from) >= 0) {
+            res.received++;
+            res.latency.record(now - ts);
+        }
+    }
+}
+
+/**
+ * Drives a slice of the connections: sends the telegrams due by the
+ * schedule of each sender, and receives everything.
+ */
+static void worker(const Options &o, vector<Conn> &conns, size_t first,
+                   size_t last, uint64_t start, Result &res) {
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    for(size_t i = first; i < last; i++) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, conns[i].sock, &ev);
+    }
+
+    uint64_t warmupEnd = start + (uint64_t) (o.warmup * 1e6);
+    uint64_t sendEnd = warmupEnd + (uint64_t) (o.duration * 1e6);
+    uint64_t end = sendEnd + LOADGEN_DRAIN_US;
+    uint8_t buf[65536];
+
+    for(;;) {
+        uint64_t now = monotonicUs();
+        if(now >= end)
+            break;
+
+        // Open loop: every sender catches up with its schedule
+        if(now < sendEnd) {
+            uint64_t due = (uint64_t) ((now - start) * o.rate / 1e6);
+            for(size_t i = first; i < last; i++) {
+                Conn &c = conns[i];
+                if(!c.sender)
+                    continue;
+                for(; c.sent < due; c.sent++) {
+                    if(c.pending.size() > LOADGEN_PENDING_MAX) {
+                        res.skipped++;
+                        continue;
+                    }
+                    uint8_t raw[KNX::tg_size::max];
+                    // Same clock as parse(), so received never exceeds sent
+                    size_t size = telegram(raw, c.src, o.body,
+                                           (uint32_t) now);
+                    c.pending.insert(c.pending.end(), raw, raw + size);
+                    if(now >= warmupEnd)
+                        res.sent++;
+                }
+                flushConn(c);
+            }
+        }
+
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(ep, events, MAX_EVENTS, 1);
+        for(int i = 0; i < n; i++) {
+            Conn &c = conns[events[i].data.u64];
+            ssize_t m;
+            while((m = recv(c.sock, buf, sizeof(buf), 0)) > 0)
+                parse(c, buf, (size_t) m, (uint32_t) warmupEnd, res);
+            if(m == 0 || (m < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                res.closed++;
+                epoll_ctl(ep, EPOLL_CTL_DEL, c.sock, NULL);
+            }
+            if(!c.pending.empty())
+                flushConn(c);
+        }
+    }
+    close(ep);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-a addr] [-p port] [-c conns] [-s senders] "
+                    "[-r rate] [-b bytes] [-d seconds] [-w seconds] "
+                    "[-g group] [-t threads] [-S reactors] "
+                    "[-e epoll|uring]\n", name);
+    exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+    Options o;
+    int opt;
+    while((opt = getopt(argc, argv, "a:p:c:s:r:b:d:w:g:t:S:e:h")) != -1) {
+        switch(opt) {
+        case 'a': o.addr = optarg; break;
+        case 'p': o.port = atoi(optarg); break;
+        case 'c': o.conns = (size_t) atoi(optarg); break;
+        case 's': o.senders = (size_t) atoi(optarg); break;
+        case 'r': o.rate = atof(optarg); break;
+        case 'b': o.body = (size_t) atoi(optarg); break;
+        case 'd': o.duration = atof(optarg); break;
+        case 'w': o.warmup = atof(optarg); break;
+        case 'g': o.group = optarg; break;
+        case 't': o.threads = (size_t) atoi(optarg); break;
+        case 'S': o.reactors = (size_t) atoi(optarg); break;
+        case 'e': o.engine = strcmp(optarg, "uring") == 0 ? ENGINE_URING :
+                             ENGINE_EPOLL; break;
+        default: usage(argv[0]);
+        }
+    }
+    if(o.conns < 2 || o.senders > o.conns || o.threads == 0 ||
+       o.body < LOADGEN_STAMP || o.body > KNX::tg_size::payload ||
+       (o.group && strlen(o.group) > TCP_GROUP_NAME_MAX))
+        usage(argv[0]);
+    if(o.threads > o.conns)
+        o.threads = o.conns;
+
+    // Every connection is a file, and so is its peer with -S
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    Logger::setLevel(SMOKE_LOG_WARN);
+    ServerSmoke server(o.reactors > 0 ? o.reactors : 1);
+    std::thread loop;
+    if(o.reactors > 0) {
+        server.setEngine(o.engine);
+        if(!server.init(o.addr, o.port)) {
+            fprintf(stderr, "Cannot init the server on port %d\n", o.port);
+            return 1;
+        }
+        loop = std::thread([&server]() {
+            while(!serverStop.load(std::memory_order_relaxed))
+                server.run();
+        });
+    }
+
+    vector<Conn> conns(o.conns);
+    for(size_t i = 0; i < o.conns; i++) {
+        conns[i].sock = connectTo(o);
+        conns[i].src = (uint16_t) (0x1000 + i);
+        conns[i].sender = i < o.senders;
+    }
+    if(o.reactors > 0) {
+        while(server.metrics().connections < (int64_t) o.conns)
+            usleep(1000);
+    } else {
+        // Give the server the time to register everybody
+        usleep(200000);
+    }
+
+    vector<Result> results(o.threads);
+    vector<std::thread> threads;
+    uint64_t start = monotonicUs();
+    size_t slice = (o.conns + o.threads - 1) / o.threads;
+    for(size_t t = 0; t < o.threads; t++) {
+        size_t first = t * slice;
+        size_t last = first + slice < o.conns ? first + slice : o.conns;
+        threads.emplace_back(worker, std::cref(o), std::ref(conns), first,
+                             last, start, std::ref(results[t]));
+    }
+    for(std::thread &t : threads)
+        t.join();
+
+    Result total;
+    for(const Result &r : results) {
+        total.sent += r.sent;
+        total.skipped += r.skipped;
+        total.received += r.received;
+        total.invalid += r.invalid;
+        total.closed += r.closed;
+        total.latency.add(r.latency);
+    }
+
+    for(Conn &c : conns)
+        close(c.sock);
+    const char *engine = o.reactors == 0 ? "external" :
+                         (server.engine() == ENGINE_URING ? "uring" : "epoll");
+    if(o.reactors > 0) {
+        serverStop = true;
+        loop.join();
+        server.shutdown();
+    }
+
+    // Every telegram reaches all the connections but its sender
+    uint64_t expected = total.sent * (o.conns - 1);
+    printf("{\"connections\": %zu, \"senders\": %zu, \"rate\": %.1f, "
+           "\"body_bytes\": %zu, \"duration_s\": %.1f, \"threads\": %zu, "
+           "\"server\": \"%s\", "
+           "\"sent\": %llu, \"skipped\": %llu, \"received\": %llu, "
+           "\"expected\": %llu, \"invalid\": %llu, \"closed\": %llu, "
+           "\"sent_per_s\": %.1f, \"received_per_s\": %.1f, "
+           "\"latency_us\": {\"samples\": %llu, \"p50\": %llu, "
+           "\"p99\": %llu, \"p999\": %llu, \"max\": %llu}}\n",
+           o.conns, o.senders, o.rate, o.body, o.duration, o.threads,
+           engine,
+           (unsigned long long) total.sent,
+           (unsigned long long) total.skipped,
+           (unsigned long long) total.received,
+           (unsigned long long) expected,
+           (unsigned long long) total.invalid,
+           (unsigned long long) total.closed,
+           total.sent / o.duration, total.received / o.duration,
+           (unsigned long long) total.latency.count,
+           (unsigned long long) total.latency.percentile(0.50),
+           (unsigned long long) total.latency.percentile(0.99),
+           (unsigned long long) total.latency.percentile(0.999),
+           (unsigned long long) total.latency.max);
+    return 0;
+}
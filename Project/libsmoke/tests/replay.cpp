@@ -0,0 +1,352 @@
+#include "../src/libsmoke_server.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <getopt.h>
+#include <map>
+#include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "connection_data.h"
+
+/**
+ * Replays a capture (ServerSmoke::setCapture() or LinuxTCP::capture()) to
+ * a ServerSmoke: every connection of the capture is opened again, one per
+ * group it sent telegrams to, and each telegram is sent by its connection
+ * at its original time, scaled by the speed. The file is mmap'd and read
+ * in place. The telegrams broadcast by the server are received (and
+ * counted) so the replay connections are never shed.
+ * The result is printed as a single JSON object on stdout.
+ *
+ * Usage: smoke_replay [options] capture
+ *   -a addr        IP addr of the server (TCP_IP)
+ *   -p port        PORT of the server (TCP_PORT)
+ *   -x speed       Speed of the replay, 2 is twice as fast, 0 sends
+ *                  everything as fast as possible (1)
+ *   -w seconds     Wait for the telegrams in flight at the end (1)
+ */
+
+/* Data a connection can have unsent before the replay waits for it */
+#define REPLAY_PENDING_MAX (256 * 1024)
+
+struct Options {
+    const char *addr;
+    int port;
+    double speed;
+    double drain;
+    const char *path;
+
+    Options() : addr(TCP_IP), port(TCP_PORT), speed(1), drain(1),
+                path(NULL) {}
+};
+
+/**
+ * A connection of the capture, in one of its groups.
+ */
+struct Conn {
+    int sock;
+    uint32_t id;
+    uint16_t group;
+    bool closed;
+    vector<uint8_t> pending;
+    vector<uint8_t> rx;
+
+    Conn() : sock(-1), id(0), group(0), closed(false) {}
+};
+
+struct Result {
+    uint64_t records;
+    uint64_t sent;
+    uint64_t received;
+    uint64_t closed;
+    uint64_t maxLag;
+
+    Result() : records(0), sent(0), received(0), closed(0), maxLag(0) {}
+};
+
+static int connectTo(const Options &o, const std::string &group) {
+    struct sockaddr_in in;
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_port = htons(o.port);
+    in.sin_addr.s_addr = inet_addr(o.addr);
+
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(s < 0 || connect(s, (struct sockaddr *) &in, sizeof(in)) < 0) {
+        perror("connect");
+        exit(-1);
+    }
+
+    if(!group.empty()) {
+        uint8_t preamble[2 + TCP_GROUP_NAME_MAX];
+        preamble[0] = TCP_JOIN_MAGIC;
+        preamble[1] = (uint8_t) group.size();
+        memcpy(preamble + 2, group.data(), group.size());
+        size_t len = 2 + group.size();
+        if(send(s, preamble, len, MSG_NOSIGNAL) != (ssize_t) len) {
+            perror("send");
+            exit(-1);
+        }
+    }
+
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    int flags = fcntl(s, F_GETFL);
+    fcntl(s, F_SETFL, flags | O_NONBLOCK);
+    return s;
+}
+
+/**
+ * Sends the data queued for a connection, as much as the socket takes.
+ */
+static void flushConn(Conn &c) {
+    if(c.pending.empty() || c.closed)
+        return;
+    ssize_t n = send(c.sock, c.pending.data(), c.pending.size(), MSG_NOSIGNAL);
+    if(n > 0)
+        c.pending.erase(c.pending.begin(), c.pending.begin() + n);
+}
+
+/**
+ * Receives what the server sent to a connection: counts the telegrams
+ * and answers the keepalive probes.
+ */
+static void receive(Conn &c, Result &res) {
+    uint8_t buf[65536];
+    ssize_t m;
+    while((m = recv(c.sock, buf, sizeof(buf), 0)) > 0)
+        c.rx.insert(c.rx.end(), buf, buf + m);
+    if(m == 0 || (m < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        c.closed = true;
+        res.closed++;
+    }
+
+    size_t off = 0;
+    while(off < c.rx.size()) {
+        const uint8_t *raw = &c.rx[off];
+        size_t left = c.rx.size() - off;
+        if(raw[0] == TCP_KEEPALIVE_PING) {
+            c.pending.push_back(TCP_KEEPALIVE_PONG);
+            off++;
+            continue;
+        }
+        if(left < KNX::tg_size::hdr || left < KNX::telegram::rawSize(raw))
+            break;
+        off += KNX::telegram::rawSize(raw);
+        res.received++;
+    }
+    c.rx.erase(c.rx.begin(), c.rx.begin() + off);
+    flushConn(c);
+}
+
+/**
+ * Checks the header of a capture and indexes its records.
+ *
+ * @param telegrams - the telegram records, sorted by time.
+ * @param names - the name of each group.
+ * @return TRUE - if the capture is valid, even if truncated.
+ *         FALSE - otherwise.
+ */
+static bool load(const uint8_t *map, size_t size,
+                 vector<const KNX::CaptureRecord *> &telegrams,
+                 std::map<uint16_t, std::string> &names, Result &res) {
+    const KNX::CaptureHeader *h = (const KNX::CaptureHeader *) map;
+    if(size < sizeof(*h) || memcmp(h->magic, CAPTURE_MAGIC,
+                                   sizeof(CAPTURE_MAGIC)) != 0 ||
+       h->version != CAPTURE_VERSION)
+        return false;
+
+    size_t off = sizeof(*h);
+    while(off + sizeof(KNX::CaptureRecord) <= size) {
+        const KNX::CaptureRecord *r = (const KNX::CaptureRecord *) (map + off);
+        size_t len = KNX::CaptureRecord::size(r->len);
+        if(off + len > size)
+            break;  // Cut while it was written
+        off += len;
+        res.records++;
+
+        const uint8_t *data = (const uint8_t *) (r + 1);
+        if(r->type == KNX::CAPTURE_GROUP)
+            names[r->group] = std::string((const char *) data, r->len);
+        else if(r->type == KNX::CAPTURE_TELEGRAM &&
+                r->len >= KNX::tg_size::hdr &&
+                r->len == KNX::telegram::rawSize(data))
+            telegrams.push_back(r);
+    }
+
+    // Each shard has written its records in order, merge them
+    std::stable_sort(telegrams.begin(), telegrams.end(),
+                     [](const KNX::CaptureRecord *a,
+                        const KNX::CaptureRecord *b) {
+        return a->ts < b->ts;
+    });
+    return true;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-a addr] [-p port] [-x speed] [-w seconds] "
+                    "capture\n", name);
+    exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+    Options o;
+    int opt;
+    while((opt = getopt(argc, argv, "a:p:x:w:h")) != -1) {
+        switch(opt) {
+        case 'a': o.addr = optarg; break;
+        case 'p': o.port = atoi(optarg); break;
+        case 'x': o.speed = atof(optarg); break;
+        case 'w': o.drain = atof(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1 || o.speed < 0)
+        usage(argv[0]);
+    o.path = argv[optind];
+
+    int fd = open(o.path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        perror(o.path);
+        return 1;
+    }
+    size_t size = (size_t) st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    Result res;
+    vector<const KNX::CaptureRecord *> telegrams;
+    std::map<uint16_t, std::string> names;
+    if(!load((const uint8_t *) map, size, telegrams, names, res)) {
+        fprintf(stderr, "%s is not a capture\n", o.path);
+        return 1;
+    }
+
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // Open all the connections first, so the replay is not slowed down
+    std::unordered_map<uint64_t, size_t> index;
+    vector<size_t> owner(telegrams.size());
+    vector<Conn> conns;
+    for(size_t i = 0; i < telegrams.size(); i++) {
+        uint64_t key = ((uint64_t) telegrams[i]->conn << 16) |
+                       telegrams[i]->group;
+        auto it = index.find(key);
+        if(it == index.end()) {
+            it = index.emplace(key, conns.size()).first;
+            conns.push_back(Conn());
+            conns.back().id = telegrams[i]->conn;
+            conns.back().group = telegrams[i]->group;
+        }
+        owner[i] = it->second;
+    }
+
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    for(size_t i = 0; i < conns.size(); i++) {
+        std::string group = names[conns[i].group];
+        if(group.size() > TCP_GROUP_NAME_MAX) {
+            fprintf(stderr, "Group %s too long, replayed in the default one\n",
+                    group.c_str());
+            group.clear();
+        }
+        conns[i].sock = connectTo(o, group);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, conns[i].sock, &ev);
+    }
+
+    uint64_t first = telegrams.empty() ? 0 : telegrams[0]->ts;
+    uint64_t span = telegrams.empty() ? 0 : telegrams.back()->ts - first;
+    uint64_t start = monotonicUs();
+    uint64_t end = 0;
+    size_t next = 0;
+    vector<size_t> dirty;
+
+    for(;;) {
+        uint64_t now = monotonicUs();
+        int timeout = 1;
+
+        if(next < telegrams.size()) {
+            // Queue every telegram already due, at most a burst of them
+            // when the connections can't keep up
+            while(next < telegrams.size()) {
+                const KNX::CaptureRecord *r = telegrams[next];
+                uint64_t due = start + (o.speed > 0 ?
+                               (uint64_t) ((r->ts - first) / o.speed) : 0);
+                if(due > now) {
+                    uint64_t ms = (due - now) / 1000;
+                    timeout = ms < 100 ? (int) ms : 100;
+                    break;
+                }
+                Conn &c = conns[owner[next]];
+                if(c.pending.size() > REPLAY_PENDING_MAX) {
+                    timeout = 0;
+                    break;
+                }
+                if(now - due > res.maxLag)
+                    res.maxLag = now - due;
+                if(c.pending.empty())
+                    dirty.push_back(owner[next]);
+                const uint8_t *raw = (const uint8_t *) (r + 1);
+                c.pending.insert(c.pending.end(), raw, raw + r->len);
+                res.sent++;
+                next++;
+            }
+            for(size_t i : dirty)
+                flushConn(conns[i]);
+            dirty.erase(std::remove_if(dirty.begin(), dirty.end(),
+                        [&conns](size_t i) {
+                return conns[i].pending.empty() || conns[i].closed;
+            }), dirty.end());
+            if(next == telegrams.size())
+                end = monotonicUs();
+        } else {
+            // Everything sent, wait for the last telegrams in flight
+            for(size_t i : dirty)
+                flushConn(conns[i]);
+            if(now >= end + (uint64_t) (o.drain * 1e6))
+                break;
+        }
+
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(ep, events, MAX_EVENTS, timeout);
+        for(int i = 0; i < n; i++) {
+            Conn &c = conns[events[i].data.u64];
+            receive(c, res);
+            if(c.closed)
+                epoll_ctl(ep, EPOLL_CTL_DEL, c.sock, NULL);
+        }
+    }
+
+    double elapsed = (double) (end - start) / 1e6;
+    printf("{\"records\":%llu,\"telegrams\":%zu,\"connections\":%zu,"
+           "\"speed\":%g,\"span_s\":%.3f,\"elapsed_s\":%.3f,"
+           "\"sent\":%llu,\"received\":%llu,\"closed\":%llu,"
+           "\"max_lag_us\":%llu}\n",
+           (unsigned long long) res.records, telegrams.size(), conns.size(),
+           o.speed, (double) span / 1e6, elapsed,
+           (unsigned long long) res.sent, (unsigned long long) res.received,
+           (unsigned long long) res.closed,
+           (unsigned long long) res.maxLag);
+
+    for(Conn &c : conns)
+        close(c.sock);
+    close(ep);
+    munmap(map, size);
+    return 0;
+}
@@ -10,11 +10,22 @@ int main() //int argc, char *argv[])
 {
     ServerSmoke server;
 
+    // Probe the clients silent for 30s, so the dead ones are dropped
+    Keepalive ka;
+    ka.idleMs = 30000;
+    server.setKeepalive(ka);
+
     if(!server.init(TCP_IP, TCP_PORT)) {
         printf("Cannot init TCP connection.");
         exit(-1);
     }
 
+    // Local clients can skip the TCP stack
+    if(!server.listenUnix(UNIX_PATH)) {
+        printf("Cannot listen on %s.", UNIX_PATH);
+        exit(-1);
+    }
+
     printf("[MAIN] Server is up and running\n");
     while(!mustStop) {
         server.run();